@@ -0,0 +1,699 @@
+/*
+ * Elastic Binary Trees - microbenchmarks.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+/* Measures the common operations on eb32/eb64/ebmb/ebst trees : insertion,
+ * lookup hit and miss, lookup_ge, full walks, deletion, and a timer-wheel
+ * style mix of expirations and re-arms. A classic red-black tree and a
+ * sorted array with binary search are measured on the same keys so that
+ * results can be compared against the usual alternatives.
+ *
+ * Each operation reports nanoseconds per op from CLOCK_MONOTONIC, and cache
+ * misses per op from perf_event_open() when the kernel allows it (run as
+ * root or lower kernel.perf_event_paranoid otherwise ; the column is then
+ * reported as "-").
+ *
+ * Build and run with "make bench". Tree sizes default to 1k..1M and can be
+ * overridden by passing sizes on the command line, eg :
+ *     obj/ebbench 1000 100000000
+ * The largest sizes need a few GB of RAM.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eb32tree.h"
+#include "eb64tree.h"
+#include "ebmbtree.h"
+#include "ebsttree.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define MB_KEY_LEN 16
+
+/* a dummy accumulator keeping the compiler from optimizing lookups out */
+static uint64_t blackhole;
+
+/*****************************************************************************/
+/* measurement helpers                                                       */
+/*****************************************************************************/
+
+static int perf_fd = -1;
+
+static void perf_init(void)
+{
+#if defined(__linux__)
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_t0, bench_m0;
+
+static void bench_start(void)
+{
+#if defined(__linux__)
+	if (perf_fd >= 0) {
+		uint64_t v = 0;
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+		if (read(perf_fd, &v, sizeof(v)) == sizeof(v))
+			bench_m0 = v;
+	}
+#endif
+	bench_t0 = now_ns();
+}
+
+static void bench_stop(const char *name, uint64_t ops)
+{
+	uint64_t t = now_ns() - bench_t0;
+
+	printf("  %-24s %10.1f ns/op", name, (double)t / ops);
+#if defined(__linux__)
+	if (perf_fd >= 0) {
+		uint64_t v = 0;
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_fd, &v, sizeof(v)) == sizeof(v)) {
+			printf("  %8.2f miss/op", (double)(v - bench_m0) / ops);
+			printf("\n");
+			return;
+		}
+	}
+#endif
+	printf("  %8s miss/op", "-");
+	printf("\n");
+}
+
+/* xorshift64, so that key generation does not pollute the counters with the
+ * cost of random()
+ */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static inline uint64_t rng64(void)
+{
+	uint64_t x = rng_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	rng_state = x;
+	return x;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+	if (ka < kb)
+		return -1;
+	return ka > kb;
+}
+
+/*****************************************************************************/
+/* red-black tree baseline (textbook implementation, bench-local)            */
+/*****************************************************************************/
+
+struct rb_node {
+	struct rb_node *left, *right, *parent;
+	int red;
+	uint64_t key;
+};
+
+struct rb_tree {
+	struct rb_node *root;
+};
+
+static void rb_rotate(struct rb_tree *t, struct rb_node *x, int left)
+{
+	struct rb_node *y = left ? x->right : x->left;
+	struct rb_node *sub = left ? y->left : y->right;
+
+	if (left) {
+		x->right = sub;
+		y->left = x;
+	} else {
+		x->left = sub;
+		y->right = x;
+	}
+	if (sub)
+		sub->parent = x;
+	y->parent = x->parent;
+	if (!x->parent)
+		t->root = y;
+	else if (x == x->parent->left)
+		x->parent->left = y;
+	else
+		x->parent->right = y;
+	x->parent = y;
+}
+
+static void rb_insert(struct rb_tree *t, struct rb_node *z)
+{
+	struct rb_node *y = NULL, *x = t->root;
+
+	while (x) {
+		y = x;
+		x = (z->key < x->key) ? x->left : x->right;
+	}
+	z->parent = y;
+	z->left = z->right = NULL;
+	z->red = 1;
+	if (!y)
+		t->root = z;
+	else if (z->key < y->key)
+		y->left = z;
+	else
+		y->right = z;
+
+	while (z->parent && z->parent->red) {
+		struct rb_node *p = z->parent, *g = p->parent;
+		int pleft = (p == g->left);
+		struct rb_node *u = pleft ? g->right : g->left;
+
+		if (u && u->red) {
+			p->red = u->red = 0;
+			g->red = 1;
+			z = g;
+			continue;
+		}
+		if (z == (pleft ? p->right : p->left)) {
+			z = p;
+			rb_rotate(t, z, pleft);
+			p = z->parent;
+		}
+		p->red = 0;
+		g->red = 1;
+		rb_rotate(t, g, !pleft);
+	}
+	t->root->red = 0;
+}
+
+static struct rb_node *rb_lookup(struct rb_tree *t, uint64_t key)
+{
+	struct rb_node *x = t->root;
+
+	while (x) {
+		if (key == x->key)
+			return x;
+		x = (key < x->key) ? x->left : x->right;
+	}
+	return NULL;
+}
+
+static struct rb_node *rb_first(struct rb_tree *t)
+{
+	struct rb_node *x = t->root;
+
+	if (!x)
+		return NULL;
+	while (x->left)
+		x = x->left;
+	return x;
+}
+
+static struct rb_node *rb_next(struct rb_node *x)
+{
+	if (x->right) {
+		x = x->right;
+		while (x->left)
+			x = x->left;
+		return x;
+	}
+	while (x->parent && x == x->parent->right)
+		x = x->parent;
+	return x->parent;
+}
+
+static void rb_delete_fixup(struct rb_tree *t, struct rb_node *x, struct rb_node *xp)
+{
+	while (x != t->root && (!x || !x->red)) {
+		int left = (x == xp->left);
+		struct rb_node *w = left ? xp->right : xp->left;
+
+		if (w->red) {
+			w->red = 0;
+			xp->red = 1;
+			rb_rotate(t, xp, left);
+			w = left ? xp->right : xp->left;
+		}
+		if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+			w->red = 1;
+			x = xp;
+			xp = x->parent;
+			continue;
+		}
+		if (left ? (!w->right || !w->right->red) : (!w->left || !w->left->red)) {
+			if (left)
+				w->left->red = 0;
+			else
+				w->right->red = 0;
+			w->red = 1;
+			rb_rotate(t, w, !left);
+			w = left ? xp->right : xp->left;
+		}
+		w->red = xp->red;
+		xp->red = 0;
+		if (left)
+			w->right->red = 0;
+		else
+			w->left->red = 0;
+		rb_rotate(t, xp, left);
+		x = t->root;
+		xp = NULL;
+	}
+	if (x)
+		x->red = 0;
+}
+
+static void rb_transplant(struct rb_tree *t, struct rb_node *u, struct rb_node *v)
+{
+	if (!u->parent)
+		t->root = v;
+	else if (u == u->parent->left)
+		u->parent->left = v;
+	else
+		u->parent->right = v;
+	if (v)
+		v->parent = u->parent;
+}
+
+static void rb_delete(struct rb_tree *t, struct rb_node *z)
+{
+	struct rb_node *y = z, *x, *xp;
+	int yred = y->red;
+
+	if (!z->left) {
+		x = z->right;
+		xp = z->parent;
+		rb_transplant(t, z, z->right);
+	} else if (!z->right) {
+		x = z->left;
+		xp = z->parent;
+		rb_transplant(t, z, z->left);
+	} else {
+		y = z->right;
+		while (y->left)
+			y = y->left;
+		yred = y->red;
+		x = y->right;
+		if (y->parent == z) {
+			xp = y;
+		} else {
+			xp = y->parent;
+			rb_transplant(t, y, y->right);
+			y->right = z->right;
+			y->right->parent = y;
+		}
+		rb_transplant(t, z, y);
+		y->left = z->left;
+		y->left->parent = y;
+		y->red = z->red;
+	}
+	if (!yred)
+		rb_delete_fixup(t, x, xp);
+}
+
+/*****************************************************************************/
+/* benchmarks                                                                */
+/*****************************************************************************/
+
+static void bench_eb32(unsigned long n, const uint64_t *keys, const uint64_t *probes)
+{
+	struct eb_root root = EB_ROOT;
+	struct eb32_node *nodes = calloc(n, sizeof(*nodes));
+	struct eb32_node *node;
+	unsigned long i;
+
+	printf("eb32, %lu keys :\n", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		nodes[i].key = (uint32_t)keys[i];
+		eb32_insert(&root, &nodes[i]);
+	}
+	bench_stop("insert", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)eb32_lookup(&root, (uint32_t)keys[rng64() % n]);
+	bench_stop("lookup hit", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)eb32_lookup(&root, (uint32_t)probes[i]);
+	bench_stop("lookup miss", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)eb32_lookup_ge(&root, (uint32_t)probes[i]);
+	bench_stop("lookup_ge", n);
+
+	bench_start();
+	for (node = eb32_first(&root); node; node = eb32_next(node))
+		blackhole += node->key;
+	bench_stop("walk", n);
+
+	/* timer-wheel style mix : expire the earliest entry, re-arm it at
+	 * now + random timeout, as a scheduler would do.
+	 */
+	bench_start();
+	for (i = 0; i < n; i++) {
+		node = eb32_first(&root);
+		eb32_delete(node);
+		node->key += 1 + (uint32_t)(rng64() & 0xffff);
+		eb32_insert(&root, node);
+	}
+	bench_stop("timer mix", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		eb32_delete(&nodes[i]);
+	bench_stop("delete", n);
+
+	free(nodes);
+}
+
+static void bench_eb64(unsigned long n, const uint64_t *keys, const uint64_t *probes)
+{
+	struct eb_root root = EB_ROOT;
+	struct eb64_node *nodes = calloc(n, sizeof(*nodes));
+	struct eb64_node *node;
+	unsigned long i;
+
+	printf("eb64, %lu keys :\n", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		nodes[i].key = keys[i];
+		eb64_insert(&root, &nodes[i]);
+	}
+	bench_stop("insert", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)eb64_lookup(&root, keys[rng64() % n]);
+	bench_stop("lookup hit", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)eb64_lookup(&root, probes[i]);
+	bench_stop("lookup miss", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)eb64_lookup_ge(&root, probes[i]);
+	bench_stop("lookup_ge", n);
+
+	bench_start();
+	for (node = eb64_first(&root); node; node = eb64_next(node))
+		blackhole += node->key;
+	bench_stop("walk", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		node = eb64_first(&root);
+		eb64_delete(node);
+		node->key += 1 + (rng64() & 0xffffff);
+		eb64_insert(&root, node);
+	}
+	bench_stop("timer mix", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		eb64_delete(&nodes[i]);
+	bench_stop("delete", n);
+
+	free(nodes);
+}
+
+static void bench_ebmb(unsigned long n, const uint64_t *keys, const uint64_t *probes)
+{
+	struct mb_item {
+		struct ebmb_node node;
+		char key[MB_KEY_LEN];
+	};
+	struct eb_root root = EB_ROOT;
+	struct mb_item *items = calloc(n, sizeof(*items));
+	char probe[MB_KEY_LEN];
+	unsigned long i;
+
+	printf("ebmb, %lu keys of %u bytes :\n", n, MB_KEY_LEN);
+
+	for (i = 0; i < n; i++) {
+		memcpy(items[i].node.key, &keys[i], 8);
+		memcpy(items[i].node.key + 8, &i, sizeof(i));
+	}
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		ebmb_insert(&root, &items[i].node, MB_KEY_LEN);
+	bench_stop("insert", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		unsigned long j = rng64() % n;
+		memcpy(probe, &keys[j], 8);
+		memcpy(probe + 8, &j, sizeof(j));
+		blackhole += (uintptr_t)ebmb_lookup(&root, probe, MB_KEY_LEN);
+	}
+	bench_stop("lookup hit", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		memcpy(probe, &probes[i], 8);
+		memcpy(probe + 8, &i, sizeof(i));
+		blackhole += (uintptr_t)ebmb_lookup(&root, probe, MB_KEY_LEN);
+	}
+	bench_stop("lookup miss", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		eb_delete(&items[i].node.node);
+	bench_stop("delete", n);
+
+	free(items);
+}
+
+static void bench_ebst(unsigned long n, const uint64_t *keys, const uint64_t *probes)
+{
+	struct st_item {
+		struct ebmb_node node;
+		char key[24];
+	};
+	struct eb_root root = EB_ROOT;
+	struct st_item *items = calloc(n, sizeof(*items));
+	char probe[24];
+	unsigned long i;
+
+	printf("ebst, %lu string keys :\n", n);
+
+	for (i = 0; i < n; i++)
+		snprintf((char *)items[i].node.key, sizeof(items[i].key),
+			 "k-%016" PRIx64, keys[i]);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		ebst_insert(&root, &items[i].node);
+	bench_stop("insert", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		snprintf(probe, sizeof(probe), "k-%016" PRIx64, keys[rng64() % n]);
+		blackhole += (uintptr_t)ebst_lookup(&root, probe);
+	}
+	bench_stop("lookup hit", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		snprintf(probe, sizeof(probe), "k-%016" PRIx64, probes[i]);
+		blackhole += (uintptr_t)ebst_lookup(&root, probe);
+	}
+	bench_stop("lookup miss", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		eb_delete(&items[i].node.node);
+	bench_stop("delete", n);
+
+	free(items);
+}
+
+static void bench_rbtree(unsigned long n, const uint64_t *keys, const uint64_t *probes)
+{
+	struct rb_tree tree = { NULL };
+	struct rb_node *nodes = calloc(n, sizeof(*nodes));
+	struct rb_node *node;
+	unsigned long i;
+
+	printf("red-black tree, %lu keys :\n", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		nodes[i].key = keys[i];
+		rb_insert(&tree, &nodes[i]);
+	}
+	bench_stop("insert", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)rb_lookup(&tree, keys[rng64() % n]);
+	bench_stop("lookup hit", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		blackhole += (uintptr_t)rb_lookup(&tree, probes[i]);
+	bench_stop("lookup miss", n);
+
+	bench_start();
+	for (node = rb_first(&tree); node; node = rb_next(node))
+		blackhole += node->key;
+	bench_stop("walk", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		node = rb_first(&tree);
+		rb_delete(&tree, node);
+		node->key += 1 + (rng64() & 0xffffff);
+		rb_insert(&tree, node);
+	}
+	bench_stop("timer mix", n);
+
+	bench_start();
+	for (i = 0; i < n; i++)
+		rb_delete(&tree, &nodes[i]);
+	bench_stop("delete", n);
+
+	free(nodes);
+}
+
+static void bench_array(unsigned long n, const uint64_t *keys, const uint64_t *probes)
+{
+	uint64_t *sorted = malloc(n * sizeof(*sorted));
+	unsigned long i;
+
+	printf("sorted array, %lu keys :\n", n);
+
+	memcpy(sorted, keys, n * sizeof(*sorted));
+	bench_start();
+	qsort(sorted, n, sizeof(*sorted), cmp_u64);
+	bench_stop("sort (~insert)", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		uint64_t x = keys[rng64() % n];
+		unsigned long lo = 0, hi = n;
+
+		while (lo < hi) {
+			unsigned long mid = (lo + hi) / 2;
+
+			if (sorted[mid] < x)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		blackhole += lo;
+	}
+	bench_stop("lookup hit", n);
+
+	bench_start();
+	for (i = 0; i < n; i++) {
+		uint64_t x = probes[i];
+		unsigned long lo = 0, hi = n;
+
+		while (lo < hi) {
+			unsigned long mid = (lo + hi) / 2;
+
+			if (sorted[mid] < x)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		blackhole += lo;
+	}
+	bench_stop("lookup_ge (miss)", n);
+
+	free(sorted);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long sizes[16] = { 1000, 10000, 100000, 1000000 };
+	int nsizes = 4, s;
+
+	if (argc > 1) {
+		nsizes = 0;
+		while (nsizes < argc - 1 && nsizes < 16) {
+			sizes[nsizes] = strtoul(argv[nsizes + 1], NULL, 0);
+			nsizes++;
+		}
+	}
+
+	perf_init();
+	if (perf_fd < 0)
+		printf("note: perf_event_open() unavailable, cache misses not reported\n");
+
+	for (s = 0; s < nsizes; s++) {
+		unsigned long n = sizes[s];
+		uint64_t *keys = malloc(n * sizeof(*keys));
+		uint64_t *probes = malloc(n * sizeof(*probes));
+		unsigned long i;
+
+		if (!keys || !probes) {
+			printf("out of memory for %lu keys\n", n);
+			free(keys);
+			free(probes);
+			break;
+		}
+
+		/* even keys are inserted, odd ones probe the miss paths */
+		for (i = 0; i < n; i++) {
+			keys[i] = rng64() & ~1ULL;
+			probes[i] = rng64() | 1ULL;
+		}
+
+		bench_eb32(n, keys, probes);
+		bench_eb64(n, keys, probes);
+		bench_ebmb(n, keys, probes);
+		bench_ebst(n, keys, probes);
+		bench_rbtree(n, keys, probes);
+		bench_array(n, keys, probes);
+		printf("\n");
+
+		free(keys);
+		free(probes);
+	}
+
+	if (blackhole == 0x42)
+		printf("\n"); /* never happens, keeps the accumulator alive */
+	return 0;
+}
@@ -34,6 +34,27 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Returns non-zero if the in-memory key at <key> equals <x>. With SSE2 the
+ * 16 bytes are compared in a single vector test (pcmpeqb/pmovmskb) straight
+ * from memory, instead of going through two 64-bit halves and the carry
+ * chain.
+ */
+static inline int eb128_equal_key(const uint128_t *key, const uint128_t x)
+{
+#if defined(__SSE2__)
+	__m128i a = _mm_loadu_si128((const __m128i *)key);
+	__m128i b = _mm_set_epi64x((uint64_t)(x >> 0x40), (uint64_t)x);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF;
+#else
+	return *key == x;
+#endif
+}
+
 /******************************************************************************
 
 	Composes an uint128_t value from two uint64_t values.
@@ -280,7 +301,7 @@ bool eb128i_equal_264(
 
 bool eb128i_greater_or_equal_264(
 	const uint64_t alo, const int64_t ahi,
-	const uint64_t const blo, int64_t bhi
+	const uint64_t blo, const int64_t bhi
 ) {return eb128_compose_264(alo, ahi) >= eb128_compose_264(blo, bhi);}
 
 /******************************************************************************
@@ -329,7 +350,7 @@ int eb128i_cmp_264(
 	const int128_t a = eb128_compose_264(alo, ahi),
 			   b = eb128_compose_264(blo, bhi);
 
-	return (a >= b)? a >= b : -1;
+	return (a >= b)? a > b : -1;
 }
 
 /******************************************************************************
@@ -564,7 +585,7 @@ struct eb128_node *eb128_lookup(struct eb_root *root, uint128_t x)
 		if ((eb_gettag(troot) == EB_LEAF)) {
 			node = container_of(eb_untag(troot, EB_LEAF),
 					    struct eb128_node, node.branches);
-			if (node->key == x)
+			if (eb128_equal_key(&node->key, x))
 				return node;
 			else
 				return NULL;
@@ -572,8 +593,7 @@ struct eb128_node *eb128_lookup(struct eb_root *root, uint128_t x)
 		node = container_of(eb_untag(troot, EB_NODE),
 				    struct eb128_node, node.branches);
 
-		y = node->key ^ x;
-		if (!y) {
+		if (eb128_equal_key(&node->key, x)) {
 			/* Either we found the node which holds the key, or
 			 * we have a dup tree. In the later case, we have to
 			 * walk it down left to get the first entry.
@@ -588,6 +608,7 @@ struct eb128_node *eb128_lookup(struct eb_root *root, uint128_t x)
 			return node;
 		}
 
+		y = node->key ^ x;
 		if ((y >> node->node.bit) >= EB_NODE_BRANCHES)
 			return NULL; /* no more common bits */
 
@@ -613,7 +634,7 @@ struct eb128_node *eb128i_lookup(struct eb_root *root, int128_t x)
 		if ((eb_gettag(troot) == EB_LEAF)) {
 			node = container_of(eb_untag(troot, EB_LEAF),
 					    struct eb128_node, node.branches);
-			if (node->key == (uint128_t)x)
+			if (eb128_equal_key(&node->key, (uint128_t)x))
 				return node;
 			else
 				return NULL;
@@ -621,8 +642,7 @@ struct eb128_node *eb128i_lookup(struct eb_root *root, int128_t x)
 		node = container_of(eb_untag(troot, EB_NODE),
 				    struct eb128_node, node.branches);
 
-		y = node->key ^ x;
-		if (!y) {
+		if (eb128_equal_key(&node->key, (uint128_t)x)) {
 			/* Either we found the node which holds the key, or
 			 * we have a dup tree. In the later case, we have to
 			 * walk it down left to get the first entry.
@@ -637,6 +657,7 @@ struct eb128_node *eb128i_lookup(struct eb_root *root, int128_t x)
 			return node;
 		}
 
+		y = node->key ^ x;
 		if ((y >> node->node.bit) >= EB_NODE_BRANCHES)
 			return NULL; /* no more common bits */
 
@@ -661,6 +682,7 @@ struct eb128_node *eb128_insert(struct eb_root *root, struct eb128_node *new) {
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -729,6 +751,7 @@ struct eb128_node *eb128_insert(struct eb_root *root, struct eb128_node *new) {
 				if (new->key == old->key) {
 					new->node.bit = -1;
 					root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+					EB_THR_LINK(&new->node);
 					return new;
 				}
 			}
@@ -785,6 +808,12 @@ struct eb128_node *eb128_insert(struct eb_root *root, struct eb128_node *new) {
 		root = &old->node.branches;
 #if __SIZEOF_LONG__ >= 16
 		side = (newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
+#elif !defined(EB128_SPLIT_SHIFTS)
+		/* native 128-bit shift : the compiler emits a short branchless
+		 * shrd/cmov sequence, which beats the explicit half-word
+		 * selection kept below as a fallback (-DEB128_SPLIT_SHIFTS).
+		 */
+		side = (uint64_t)(newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
 #elif ULONG_MAX >= UINT64_T_MAX
 		side = newkey;
 		side >>= old_node_bit;
@@ -815,6 +844,8 @@ struct eb128_node *eb128_insert(struct eb_root *root, struct eb128_node *new) {
 	new->node.bit = fls128(new->key ^ old->key) - EB_NODE_BITS;
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
 
+	EB_THR_LINK(&new->node);
+
 	return new;
 }
 
@@ -835,6 +866,7 @@ struct eb128_node *eb128i_insert(struct eb_root *root, struct eb128_node *new) {
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -905,6 +937,7 @@ struct eb128_node *eb128i_insert(struct eb_root *root, struct eb128_node *new) {
 				if (new->key == old->key) {
 					new->node.bit = -1;
 					root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+					EB_THR_LINK(&new->node);
 					return new;
 				}
 			}
@@ -961,6 +994,12 @@ struct eb128_node *eb128i_insert(struct eb_root *root, struct eb128_node *new) {
 		root = &old->node.branches;
 #if __SIZEOF_LONG__ >= 16
 		side = (newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
+#elif !defined(EB128_SPLIT_SHIFTS)
+		/* native 128-bit shift : the compiler emits a short branchless
+		 * shrd/cmov sequence, which beats the explicit half-word
+		 * selection kept below as a fallback (-DEB128_SPLIT_SHIFTS).
+		 */
+		side = (uint64_t)(newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
 #elif ULONG_MAX >= UINT64_T_MAX
 		side = newkey;
 		side >>= old_node_bit;
@@ -991,6 +1030,8 @@ struct eb128_node *eb128i_insert(struct eb_root *root, struct eb128_node *new) {
 	new->node.bit = fls128(new->key ^ old->key) - EB_NODE_BITS;
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
 
+	EB_THR_LINK(&new->node);
+
 	return new;
 }
 
@@ -0,0 +1,598 @@
+/*
+ * Elastic Binary Trees - macros and structures for operations on compact
+ * 32bit nodes.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include <string.h>
+#include "ebtree.h"
+#include "eb32ctree.h"
+
+/* The algorithms below are the exact ports of the generic and eb32 ones, with
+ * every tagged pointer replaced by a tagged 32-bit offset from the arena
+ * base. A branch pair is a uint32_t[2] at the beginning of each node, and the
+ * root pair lives at offset EB32C_ROOT_OFF inside the arena, so the upward
+ * walks keep using the same "left link whose pair has an empty right branch"
+ * root test as the pointer-based trees : the root's right slot only ever
+ * holds 0 or 1 while a node's branches always carry real offsets.
+ */
+
+/* Return a pointer on the branch pair at tagged offset <o> */
+static inline uint32_t *eb32c_pair(struct eb32c_root *root, uint32_t o)
+{
+	return (uint32_t *)(root->base + (o & ~1U));
+}
+
+/* Return the node whose branch pair is at tagged offset <o> */
+static inline struct eb32c_node *eb32c_node_of(struct eb32c_root *root, uint32_t o)
+{
+	return (struct eb32c_node *)(root->base + (o & ~1U));
+}
+
+/* Return the untagged offset of node <node> in the arena of <root> */
+static inline uint32_t eb32c_off(struct eb32c_root *root, const struct eb32c_node *node)
+{
+	return (uint32_t)((const char *)node - root->base);
+}
+
+#define eb32c_gettag(o)		((o) & 1)
+#define eb32c_dotag(o, tag)	((o) | (tag))
+
+/* Walk down starting at link <start> in the specified side. The pointed node
+ * is returned.
+ */
+static struct eb32c_node *eb32c_walk_down(struct eb32c_root *root,
+					  uint32_t start, unsigned int side)
+{
+	while (eb32c_gettag(start) == EB_NODE)
+		start = eb32c_pair(root, start)[side];
+	return eb32c_node_of(root, start);
+}
+
+/* Initialize tree <root> over arena <base>, writing an empty root branch
+ * pair into the arena. If <unique> is non-zero, the tree will reject
+ * duplicate keys just like a root with b[EB_RGHT]==1 does.
+ */
+void eb32c_init(struct eb32c_root *root, void *base, int unique)
+{
+	uint32_t *pair;
+
+	root->base = base;
+	pair = eb32c_pair(root, EB32C_ROOT_OFF);
+	pair[EB_LEFT] = 0;
+	pair[EB_RGHT] = unique ? 1 : 0;
+}
+
+/* Return leftmost node in the tree, or NULL if none */
+struct eb32c_node *eb32c_first(struct eb32c_root *root)
+{
+	uint32_t b = eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT];
+
+	if (!b)
+		return NULL;
+	return eb32c_walk_down(root, b, EB_LEFT);
+}
+
+/* Return rightmost node in the tree, or NULL if none */
+struct eb32c_node *eb32c_last(struct eb32c_root *root)
+{
+	uint32_t b = eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT];
+
+	if (!b)
+		return NULL;
+	return eb32c_walk_down(root, b, EB_RGHT);
+}
+
+/* Return next node in the tree, or NULL if none */
+struct eb32c_node *eb32c_next(struct eb32c_root *root, struct eb32c_node *eb32c)
+{
+	uint32_t t = eb32c->leaf_p;
+
+	while (eb32c_gettag(t) != EB_LEFT)
+		/* Walking up from right branch, so we cannot be below root */
+		t = eb32c_node_of(root, t)->node_p;
+
+	/* Note that <t> cannot be 0 at this stage */
+	t = eb32c_pair(root, t)[EB_RGHT];
+	if ((t & ~1U) == 0)
+		return NULL;	/* we hit the root's right slot */
+	return eb32c_walk_down(root, t, EB_LEFT);
+}
+
+/* Return previous node in the tree, or NULL if none */
+struct eb32c_node *eb32c_prev(struct eb32c_root *root, struct eb32c_node *eb32c)
+{
+	uint32_t t = eb32c->leaf_p;
+
+	while (eb32c_gettag(t) == EB_LEFT) {
+		/* Walking up from left branch. We must ensure that we never
+		 * walk beyond root.
+		 */
+		if (unlikely((eb32c_pair(root, t)[EB_RGHT] & ~1U) == 0))
+			return NULL;
+		t = eb32c_node_of(root, t)->node_p;
+	}
+	/* Note that <t> cannot be 0 at this stage */
+	t = eb32c_pair(root, t)[EB_LEFT];
+	return eb32c_walk_down(root, t, EB_RGHT);
+}
+
+/*
+ * Find the first occurence of a key in the tree <root>. If none can be
+ * found, return NULL.
+ */
+struct eb32c_node *eb32c_lookup(struct eb32c_root *root, uint32_t x)
+{
+	struct eb32c_node *node;
+	uint32_t troot;
+	uint32_t y;
+	int node_bit;
+
+	troot = eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT];
+	if (unlikely(!troot))
+		return NULL;
+
+	while (1) {
+		if ((eb32c_gettag(troot) == EB_LEAF)) {
+			node = eb32c_node_of(root, troot);
+			if (node->key == x)
+				return node;
+			else
+				return NULL;
+		}
+		node = eb32c_node_of(root, troot);
+		node_bit = node->bit;
+
+		y = node->key ^ x;
+		if (!y) {
+			/* Either we found the node which holds the key, or
+			 * we have a dup tree. In the later case, we have to
+			 * walk it down left to get the first entry.
+			 */
+			if (node_bit < 0) {
+				troot = node->b[EB_LEFT];
+				while (eb32c_gettag(troot) != EB_LEAF)
+					troot = eb32c_pair(root, troot)[EB_LEFT];
+				node = eb32c_node_of(root, troot);
+			}
+			return node;
+		}
+
+		if ((y >> node_bit) >= EB_NODE_BRANCHES)
+			return NULL; /* no more common bits */
+
+		troot = node->b[(x >> node_bit) & EB_NODE_BRANCH_MASK];
+	}
+}
+
+/*
+ * Find the last occurrence of the highest key in the tree <root>, which is
+ * equal to or less than <x>. NULL is returned is no key matches.
+ */
+struct eb32c_node *eb32c_lookup_le(struct eb32c_root *root, uint32_t x)
+{
+	struct eb32c_node *node;
+	uint32_t troot;
+
+	troot = eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT];
+	if (unlikely(!troot))
+		return NULL;
+
+	while (1) {
+		if ((eb32c_gettag(troot) == EB_LEAF)) {
+			/* We reached a leaf, which means that the whole upper
+			 * parts were common. We will return either the current
+			 * node or its next one if the former is too small.
+			 */
+			node = eb32c_node_of(root, troot);
+			if (node->key <= x)
+				return node;
+			/* return prev */
+			troot = node->leaf_p;
+			break;
+		}
+		node = eb32c_node_of(root, troot);
+
+		if (node->bit < 0) {
+			/* We're at the top of a dup tree. Either we got a
+			 * matching value and we return the rightmost node, or
+			 * we don't and we skip the whole subtree to return the
+			 * prev node before the subtree.
+			 */
+			if (node->key <= x) {
+				troot = node->b[EB_RGHT];
+				while (eb32c_gettag(troot) != EB_LEAF)
+					troot = eb32c_pair(root, troot)[EB_RGHT];
+				return eb32c_node_of(root, troot);
+			}
+			/* return prev */
+			troot = node->node_p;
+			break;
+		}
+
+		if (((x ^ node->key) >> node->bit) >= EB_NODE_BRANCHES) {
+			/* No more common bits at all. Either this node is too
+			 * small and we need to get its highest value, or it is
+			 * too large, and we need to get the prev value.
+			 */
+			if ((node->key >> node->bit) < (x >> node->bit)) {
+				troot = node->b[EB_RGHT];
+				return eb32c_walk_down(root, troot, EB_RGHT);
+			}
+
+			/* Further values will be too high here, so return the
+			 * prev unique node (if it exists).
+			 */
+			troot = node->node_p;
+			break;
+		}
+		troot = node->b[(x >> node->bit) & EB_NODE_BRANCH_MASK];
+	}
+
+	/* If we get here, it means we want to report previous node before the
+	 * current one which is not above. <troot> is already initialised to
+	 * the parent's branches.
+	 */
+	while (eb32c_gettag(troot) == EB_LEFT) {
+		/* Walking up from left branch. We must ensure that we never
+		 * walk beyond root.
+		 */
+		if (unlikely((eb32c_pair(root, troot)[EB_RGHT] & ~1U) == 0))
+			return NULL;
+		troot = eb32c_node_of(root, troot)->node_p;
+	}
+	/* Note that <troot> cannot be 0 at this stage */
+	troot = eb32c_pair(root, troot)[EB_LEFT];
+	return eb32c_walk_down(root, troot, EB_RGHT);
+}
+
+/*
+ * Find the first occurrence of the lowest key in the tree <root>, which is
+ * equal to or greater than <x>. NULL is returned is no key matches.
+ */
+struct eb32c_node *eb32c_lookup_ge(struct eb32c_root *root, uint32_t x)
+{
+	struct eb32c_node *node;
+	uint32_t troot;
+
+	troot = eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT];
+	if (unlikely(!troot))
+		return NULL;
+
+	while (1) {
+		if ((eb32c_gettag(troot) == EB_LEAF)) {
+			/* We reached a leaf, which means that the whole upper
+			 * parts were common. We will return either the current
+			 * node or its next one if the former is too small.
+			 */
+			node = eb32c_node_of(root, troot);
+			if (node->key >= x)
+				return node;
+			/* return next */
+			troot = node->leaf_p;
+			break;
+		}
+		node = eb32c_node_of(root, troot);
+
+		if (node->bit < 0) {
+			/* We're at the top of a dup tree. Either we got a
+			 * matching value and we return the leftmost node, or
+			 * we don't and we skip the whole subtree to return the
+			 * next node after the subtree.
+			 */
+			if (node->key >= x) {
+				troot = node->b[EB_LEFT];
+				while (eb32c_gettag(troot) != EB_LEAF)
+					troot = eb32c_pair(root, troot)[EB_LEFT];
+				return eb32c_node_of(root, troot);
+			}
+			/* return next */
+			troot = node->node_p;
+			break;
+		}
+
+		if (((x ^ node->key) >> node->bit) >= EB_NODE_BRANCHES) {
+			/* No more common bits at all. Either this node is too
+			 * large and we need to get its lowest value, or it is
+			 * too small, and we need to get the next value.
+			 */
+			if ((node->key >> node->bit) > (x >> node->bit)) {
+				troot = node->b[EB_LEFT];
+				return eb32c_walk_down(root, troot, EB_LEFT);
+			}
+
+			/* Further values will be too low here, so return the
+			 * next unique node (if it exists).
+			 */
+			troot = node->node_p;
+			break;
+		}
+		troot = node->b[(x >> node->bit) & EB_NODE_BRANCH_MASK];
+	}
+
+	/* If we get here, it means we want to report next node after the
+	 * current one which is not below. <troot> is already initialised
+	 * to the parent's branches.
+	 */
+	while (eb32c_gettag(troot) != EB_LEFT)
+		/* Walking up from right branch, so we cannot be below root */
+		troot = eb32c_node_of(root, troot)->node_p;
+
+	/* Note that <troot> cannot be 0 at this stage */
+	troot = eb32c_pair(root, troot)[EB_RGHT];
+	if ((troot & ~1U) == 0)
+		return NULL;
+
+	return eb32c_walk_down(root, troot, EB_LEFT);
+}
+
+/* This function inserts duplicate <new> into the dup subtree headed by <sub>.
+ * Direct port of eb_insert_dup().
+ */
+static struct eb32c_node *eb32c_insert_dup(struct eb32c_root *root,
+					   struct eb32c_node *sub,
+					   struct eb32c_node *new)
+{
+	struct eb32c_node *head = sub;
+	uint32_t new_off = eb32c_off(root, new);
+
+	uint32_t new_left = eb32c_dotag(new_off, EB_LEFT);
+	uint32_t new_rght = eb32c_dotag(new_off, EB_RGHT);
+	uint32_t new_leaf = eb32c_dotag(new_off, EB_LEAF);
+
+	/* first, identify the deepest hole on the right branch */
+	while (eb32c_gettag(head->b[EB_RGHT]) != EB_LEAF) {
+		struct eb32c_node *last = head;
+
+		head = eb32c_node_of(root, head->b[EB_RGHT]);
+		if (head->bit > last->bit + 1)
+			sub = head;	/* there's a hole here */
+	}
+
+	/* Here we have a leaf attached to (head)->b[EB_RGHT] */
+	if (head->bit < -1) {
+		/* A hole exists just before the leaf, we insert there */
+		new->bit = -1;
+		sub = eb32c_node_of(root, head->b[EB_RGHT]);
+		head->b[EB_RGHT] = eb32c_dotag(new_off, EB_NODE);
+
+		new->node_p = sub->leaf_p;
+		new->leaf_p = new_rght;
+		sub->leaf_p = new_left;
+		new->b[EB_LEFT] = eb32c_dotag(eb32c_off(root, sub), EB_LEAF);
+		new->b[EB_RGHT] = new_leaf;
+		return new;
+	} else {
+		int side;
+
+		/* No hole was found before a leaf. We have to insert above
+		 * <sub>. Note that we cannot be certain that <sub> is attached
+		 * to the right of its parent, as this is only true if <sub>
+		 * is inside the dup tree, not at the head.
+		 */
+		new->bit = sub->bit - 1; /* install at the lowest level */
+		side = eb32c_gettag(sub->node_p);
+		eb32c_pair(root, sub->node_p)[side] = eb32c_dotag(new_off, EB_NODE);
+
+		new->node_p = sub->node_p;
+		new->leaf_p = new_rght;
+		sub->node_p = new_left;
+		new->b[EB_LEFT] = eb32c_dotag(eb32c_off(root, sub), EB_NODE);
+		new->b[EB_RGHT] = new_leaf;
+		return new;
+	}
+}
+
+/* Insert eb32c_node <new> into subtree starting at node root <root>.
+ * Only new->key needs be set with the key. The eb32c_node is returned.
+ * If the tree was initialized as unique, the existing node is returned
+ * instead when the key is already present.
+ */
+struct eb32c_node *eb32c_insert(struct eb32c_root *root, struct eb32c_node *new)
+{
+	struct eb32c_node *old;
+	unsigned int side;
+	uint32_t troot, *up_ptr;
+	uint32_t newkey; /* caching the key saves approximately one cycle */
+	uint32_t root_right;
+	uint32_t new_off = eb32c_off(root, new);
+	uint32_t new_left, new_rght, new_leaf;
+	int old_node_bit;
+
+	side = EB_LEFT;
+	troot = eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT];
+	root_right = eb32c_pair(root, EB32C_ROOT_OFF)[EB_RGHT];
+	if (unlikely(!troot)) {
+		/* Tree is empty, insert the leaf part below the left branch */
+		eb32c_pair(root, EB32C_ROOT_OFF)[EB_LEFT] = eb32c_dotag(new_off, EB_LEAF);
+		new->leaf_p = eb32c_dotag(EB32C_ROOT_OFF, EB_LEFT);
+		new->node_p = 0; /* node part unused */
+		return new;
+	}
+
+	/* The tree descent is the same as in eb32_insert() : stop when
+	 * reaching a leaf or when running out of common bits, and remember
+	 * through <up_ptr> which parent link of <old> will have to point to
+	 * <new>.
+	 */
+	newkey = new->key;
+
+	while (1) {
+		if (eb32c_gettag(troot) == EB_LEAF) {
+			/* insert above a leaf */
+			old = eb32c_node_of(root, troot);
+			new->node_p = old->leaf_p;
+			up_ptr = &old->leaf_p;
+			break;
+		}
+
+		/* OK we're walking down this link */
+		old = eb32c_node_of(root, troot);
+		old_node_bit = old->bit;
+
+		/* Stop going down when we don't have common bits anymore. We
+		 * also stop in front of a duplicates tree because it means we
+		 * have to insert above.
+		 */
+
+		if ((old_node_bit < 0) || /* we're above a duplicate tree, stop here */
+		    (((new->key ^ old->key) >> old_node_bit) >= EB_NODE_BRANCHES)) {
+			/* The tree did not contain the key, so we insert <new>
+			 * before the node <old>, and set ->bit to designate
+			 * the lowest bit position in <new> which applies to
+			 * ->b[].
+			 */
+			new->node_p = old->node_p;
+			up_ptr = &old->node_p;
+			break;
+		}
+
+		/* walk down */
+		side = (newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
+		troot = old->b[side];
+	}
+
+	new_left = eb32c_dotag(new_off, EB_LEFT);
+	new_rght = eb32c_dotag(new_off, EB_RGHT);
+	new_leaf = eb32c_dotag(new_off, EB_LEAF);
+
+	/* We need the common higher bits between new->key and old->key. */
+
+	// note that if EB_NODE_BITS > 1, we should check that it's still >= 0
+	new->bit = flsnz(new->key ^ old->key) - EB_NODE_BITS;
+
+	if (new->key == old->key) {
+		new->bit = -1; /* mark as new dup tree, just in case */
+
+		if (root_right) {
+			/* we refuse to duplicate this key if the tree is
+			 * tagged as containing only unique keys.
+			 */
+			return old;
+		}
+
+		if (eb32c_gettag(troot) != EB_LEAF) {
+			/* there was already a dup tree below */
+			return eb32c_insert_dup(root, old, new);
+		}
+		/* otherwise fall through */
+	}
+
+	if (new->key >= old->key) {
+		new->b[EB_LEFT] = troot;
+		new->b[EB_RGHT] = new_leaf;
+		new->leaf_p = new_rght;
+		*up_ptr = new_left;
+	}
+	else {
+		new->b[EB_LEFT] = new_leaf;
+		new->b[EB_RGHT] = troot;
+		new->leaf_p = new_left;
+		*up_ptr = new_rght;
+	}
+
+	/* Now we are inserting <new> between the branch pair designated by
+	 * <new>->node_p and <old>. The parent side is in the tag of node_p,
+	 * which also covers insertions right below the root.
+	 */
+	side = eb32c_gettag(new->node_p);
+	eb32c_pair(root, new->node_p)[side] = eb32c_dotag(new_off, EB_NODE);
+
+	return new;
+}
+
+/* Removes a leaf node from the tree if it was still in it. Marks the node
+ * as unlinked. Direct port of eb_delete().
+ */
+void eb32c_delete(struct eb32c_root *root, struct eb32c_node *eb32c)
+{
+	unsigned int pside, gpside, sibtype;
+	struct eb32c_node *parent;
+	uint32_t *gparent;
+
+	if (!eb32c->leaf_p)
+		return;
+
+	/* we need the parent, our side, and the grand parent */
+	pside = eb32c_gettag(eb32c->leaf_p);
+	parent = eb32c_node_of(root, eb32c->leaf_p);
+
+	/* We likely have to release the parent link, unless it's the root,
+	 * in which case we only set our branch to 0. Note that we can
+	 * only be attached to the root by its left branch.
+	 */
+
+	if ((parent->b[EB_RGHT] & ~1U) == 0) {
+		/* we're just below the root, it's trivial. */
+		parent->b[EB_LEFT] = 0;
+		goto delete_unlink;
+	}
+
+	/* To release our parent, we have to identify our sibling, and reparent
+	 * it directly to/from the grand parent. Note that the sibling can
+	 * either be a link or a leaf.
+	 */
+
+	gpside = eb32c_gettag(parent->node_p);
+	gparent = eb32c_pair(root, parent->node_p);
+
+	gparent[gpside] = parent->b[!pside];
+	sibtype = eb32c_gettag(gparent[gpside]);
+
+	if (sibtype == EB_LEAF) {
+		eb32c_node_of(root, gparent[gpside])->leaf_p =
+			eb32c_dotag((uint32_t)((char *)gparent - root->base), gpside);
+	} else {
+		eb32c_node_of(root, gparent[gpside])->node_p =
+			eb32c_dotag((uint32_t)((char *)gparent - root->base), gpside);
+	}
+	/* Mark the parent unused. Note that we do not check if the parent is
+	 * our own node, but that's not a problem because if it is, it will be
+	 * marked unused at the same time, which we'll use below to know we can
+	 * safely remove it.
+	 */
+	parent->node_p = 0;
+
+	/* The parent node has been detached, and is currently unused. It may
+	 * belong to another node, so we cannot remove it that way. Also, our
+	 * own node part might still be used. so we can use this spare node
+	 * to replace ours if needed.
+	 */
+
+	/* If our link part is unused, we can safely exit now */
+	if (!eb32c->node_p)
+		goto delete_unlink;
+
+	/* From now on, <eb32c> and <parent> are necessarily different, and the
+	 * <eb32c>'s node part is in use. By definition, <parent> is at least
+	 * below <eb32c>, so keeping its key for the bit string is OK.
+	 */
+
+	parent->node_p = eb32c->node_p;
+	parent->b[EB_LEFT] = eb32c->b[EB_LEFT];
+	parent->b[EB_RGHT] = eb32c->b[EB_RGHT];
+	parent->bit = eb32c->bit;
+
+	/* We must now update the new node's parent... */
+	gpside = eb32c_gettag(parent->node_p);
+	gparent = eb32c_pair(root, parent->node_p);
+	gparent[gpside] = eb32c_dotag(eb32c_off(root, parent), EB_NODE);
+
+	/* ... and its branches */
+	for (pside = 0; pside <= 1; pside++) {
+		if (eb32c_gettag(parent->b[pside]) == EB_NODE) {
+			eb32c_node_of(root, parent->b[pside])->node_p =
+				eb32c_dotag(eb32c_off(root, parent), pside);
+		} else {
+			eb32c_node_of(root, parent->b[pside])->leaf_p =
+				eb32c_dotag(eb32c_off(root, parent), pside);
+		}
+	}
+ delete_unlink:
+	/* Now the node has been completely unlinked */
+	eb32c->leaf_p = 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Elastic Binary Trees - macros and structures for operations on compact
+ * 32bit nodes.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EB32CTREE_H
+#define _EB32CTREE_H
+
+#include "ebtree.h"
+#include <stdint.h>
+
+/* This is the compact variant of the eb32 tree : all intra-tree links are
+ * 32-bit byte offsets relative to a per-tree arena base instead of pointers,
+ * so a node weighs 24 bytes instead of 40 on 64-bit platforms. The tagged
+ * low-bit scheme of eb_troot_t carries over to offsets unchanged since nodes
+ * are at least 4-byte aligned within the arena.
+ *
+ * The layout imposes two conventions :
+ *   - a null offset means "no branch", so no node may live at the very
+ *     beginning of the arena ;
+ *   - the root branch pair itself lives inside the arena, at byte offset 4,
+ *     so that parent links can reference it like any other branch pair.
+ * eb32c_init() sets this up ; nodes may be placed anywhere at 4-byte aligned
+ * offsets from EB32C_FIRST_OFF upward, and the whole arena can be moved or
+ * mapped at another address without any fixup.
+ *
+ * All nodes of one tree must come from the same arena, which is why every
+ * function takes the eb32c_root carrying the base. Up to 4GB of arena is
+ * addressable.
+ */
+
+/* byte offset of the root branch pair inside the arena */
+#define EB32C_ROOT_OFF	4
+
+/* lowest offset usable for a node */
+#define EB32C_FIRST_OFF	12
+
+struct eb32c_root {
+	char *base;		/* arena base, links are relative to it */
+};
+
+/* The compact node : same fields as eb_node plus the key, with all links
+ * shrunk to tagged 32-bit offsets. The branch pair must be at the beginning,
+ * parent links point to branch pairs just like in the pointer-based trees.
+ */
+struct eb32c_node {
+	uint32_t b[EB_NODE_BRANCHES];	/* branches : tagged offsets */
+	uint32_t node_p;		/* parent of the node part */
+	uint32_t leaf_p;		/* parent of the leaf part */
+	short bit;			/* link's bit position */
+	uint32_t key;
+};
+
+/*
+ * Exported functions and macros.
+ */
+
+/* Initialize tree <root> over arena <base>, writing an empty root branch
+ * pair into the arena. If <unique> is non-zero, the tree will reject
+ * duplicate keys just like a root with b[EB_RGHT]==1 does.
+ */
+extern void eb32c_init(struct eb32c_root *root, void *base, int unique);
+
+/* Return leftmost node in the tree, or NULL if none */
+extern struct eb32c_node *eb32c_first(struct eb32c_root *root);
+
+/* Return rightmost node in the tree, or NULL if none */
+extern struct eb32c_node *eb32c_last(struct eb32c_root *root);
+
+/* Return next node in the tree, or NULL if none */
+extern struct eb32c_node *eb32c_next(struct eb32c_root *root, struct eb32c_node *eb32c);
+
+/* Return previous node in the tree, or NULL if none */
+extern struct eb32c_node *eb32c_prev(struct eb32c_root *root, struct eb32c_node *eb32c);
+
+/* Delete node from the tree if it was linked in. Mark the node unused. */
+extern void eb32c_delete(struct eb32c_root *root, struct eb32c_node *eb32c);
+
+/*
+ * Find the first occurence of a key in the tree <root>. If none can be
+ * found, return NULL.
+ */
+extern struct eb32c_node *eb32c_lookup(struct eb32c_root *root, uint32_t x);
+
+/*
+ * Find the last occurrence of the highest key in the tree <root>, which is
+ * equal to or less than <x>. NULL is returned is no key matches.
+ */
+extern struct eb32c_node *eb32c_lookup_le(struct eb32c_root *root, uint32_t x);
+
+/*
+ * Find the first occurrence of the lowest key in the tree <root>, which is
+ * equal to or greater than <x>. NULL is returned is no key matches.
+ */
+extern struct eb32c_node *eb32c_lookup_ge(struct eb32c_root *root, uint32_t x);
+
+/* Insert eb32c_node <new> into subtree starting at node root <root>.
+ * Only new->key needs be set with the key. The eb32c_node is returned.
+ * If the tree was initialized as unique, the existing node is returned
+ * instead when the key is already present.
+ */
+extern struct eb32c_node *eb32c_insert(struct eb32c_root *root, struct eb32c_node *new);
+
+#endif /* _EB32CTREE_H */
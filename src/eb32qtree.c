@@ -0,0 +1,318 @@
+/*
+ * Elastic Binary Trees - exported functions for operating on 32bit nodes
+ * with four branches per node.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include "eb32qtree.h"
+
+#define EB32Q_LEAF 0
+#define EB32Q_NODE 1
+
+static inline int eb32q_tag(const struct eb32q_node *branch)
+{
+	return (unsigned long)branch & 1;
+}
+
+static inline struct eb32q_node *eb32q_untag(const struct eb32q_node *branch)
+{
+	return (struct eb32q_node *)((unsigned long)branch & ~1UL);
+}
+
+static inline struct eb32q_node *eb32q_dotag(const struct eb32q_node *node, int tag)
+{
+	return (struct eb32q_node *)((unsigned long)node + tag);
+}
+
+/* The root is recognized by the sentinel its second branch permanently
+ * holds : no real node may carry this value, which would be a node-tagged
+ * NULL branch.
+ */
+static inline int eb32q_is_root(const struct eb32q_node *up)
+{
+	return up->b[1] == (struct eb32q_node *)1;
+}
+
+/* Return the branch slot of <up> holding the tagged pointer <branch>, which
+ * must be present. With four slots the scan is at most three compares, which
+ * spares a tag wide enough to encode the slot in the parent pointers.
+ */
+static inline unsigned int eb32q_slot(const struct eb32q_node *up,
+				      const struct eb32q_node *branch)
+{
+	unsigned int i = 0;
+
+	while (up->b[i] != branch)
+		i++;
+	return i;
+}
+
+/* Push the unused node part <part> onto the tree's spare list */
+static inline void eb32q_part_free(struct eb32q_root *root, struct eb32q_node *part)
+{
+	part->bit = -1;
+	part->free_prev = NULL;
+	part->free_next = root->free;
+	if (root->free)
+		root->free->free_prev = part;
+	root->free = part;
+}
+
+/* Remove the spare node part <part> from the tree's spare list */
+static inline void eb32q_part_unlink(struct eb32q_root *root, struct eb32q_node *part)
+{
+	if (part->free_prev)
+		part->free_prev->free_next = part->free_next;
+	else
+		root->free = part->free_next;
+	if (part->free_next)
+		part->free_next->free_prev = part->free_prev;
+}
+
+/* Take one spare node part from the tree's spare list, which must not be
+ * empty : a tree of n leaves owns n parts and uses at most n - 1.
+ */
+static inline struct eb32q_node *eb32q_part_pick(struct eb32q_root *root)
+{
+	struct eb32q_node *part = root->free;
+
+	root->free = part->free_next;
+	if (root->free)
+		root->free->free_prev = NULL;
+	return part;
+}
+
+/* Walk down from tagged branch <start>, always taking the lowest populated
+ * branch when <side> is 0 or the highest when <side> is 3, and return the
+ * leaf found.
+ */
+static struct eb32q_node *eb32q_walk_down(struct eb32q_node *start, unsigned int side)
+{
+	struct eb32q_node *node;
+	unsigned int i;
+
+	while (eb32q_tag(start) == EB32Q_NODE) {
+		node = eb32q_untag(start);
+		i = side;
+		while (!node->b[i])
+			i = side ? i - 1 : i + 1;
+		start = node->b[i];
+	}
+	return eb32q_untag(start);
+}
+
+/* Return leftmost node in the tree, or NULL if none */
+struct eb32q_node *eb32q_first(struct eb32q_root *root)
+{
+	if (!root->b[0])
+		return NULL;
+	return eb32q_walk_down(root->b[0], 0);
+}
+
+/* Return rightmost node in the tree, or NULL if none */
+struct eb32q_node *eb32q_last(struct eb32q_root *root)
+{
+	if (!root->b[0])
+		return NULL;
+	return eb32q_walk_down(root->b[0], 3);
+}
+
+/* Return next node in the tree, or NULL if none */
+struct eb32q_node *eb32q_next(struct eb32q_node *eb32q)
+{
+	struct eb32q_node *t = eb32q_dotag(eb32q, EB32Q_LEAF);
+	struct eb32q_node *up = eb32q->leaf_up;
+	unsigned int i;
+
+	while (!eb32q_is_root(up)) {
+		for (i = eb32q_slot(up, t) + 1; i < 4; i++)
+			if (up->b[i])
+				return eb32q_walk_down(up->b[i], 0);
+		t = eb32q_dotag(up, EB32Q_NODE);
+		up = up->node_up;
+	}
+	return NULL;
+}
+
+/* Return previous node in the tree, or NULL if none */
+struct eb32q_node *eb32q_prev(struct eb32q_node *eb32q)
+{
+	struct eb32q_node *t = eb32q_dotag(eb32q, EB32Q_LEAF);
+	struct eb32q_node *up = eb32q->leaf_up;
+	unsigned int i;
+
+	while (!eb32q_is_root(up)) {
+		for (i = eb32q_slot(up, t); i > 0; i--)
+			if (up->b[i - 1])
+				return eb32q_walk_down(up->b[i - 1], 3);
+		t = eb32q_dotag(up, EB32Q_NODE);
+		up = up->node_up;
+	}
+	return NULL;
+}
+
+/* Return the node containing key <x>, or NULL if not found. The descent
+ * consumes two key bits per level, so it performs at most half the dependent
+ * loads of a regular eb32 lookup.
+ */
+struct eb32q_node *eb32q_lookup(struct eb32q_root *root, uint32_t x)
+{
+	struct eb32q_node *cur = root->b[0];
+	struct eb32q_node *node;
+
+	while (cur) {
+		if (eb32q_tag(cur) == EB32Q_LEAF) {
+			node = eb32q_untag(cur);
+			return node->key == x ? node : NULL;
+		}
+		node = eb32q_untag(cur);
+		if (node->bit < 30 &&
+		    ((x ^ node->nkey) >> (node->bit + 2)) != 0)
+			return NULL; /* the key diverges above this digit */
+		cur = node->b[(x >> node->bit) & 3];
+	}
+	return NULL;
+}
+
+/* Insert node <new> into tree <root>, with new->key already set, and return
+ * it. If the key was already present, the existing node is returned instead
+ * and <new> is left unlinked.
+ */
+struct eb32q_node *eb32q_insert(struct eb32q_root *root, struct eb32q_node *new)
+{
+	struct eb32q_node *up = (struct eb32q_node *)root;
+	struct eb32q_node *node, *cur;
+	unsigned int slot = 0;
+	unsigned int down;
+	uint32_t okey;
+	int bit;
+
+	cur = root->b[0];
+	if (!cur) {
+		/* Tree is empty, the leaf takes the root branch and the node
+		 * part remains spare.
+		 */
+		root->b[0] = eb32q_dotag(new, EB32Q_LEAF);
+		new->leaf_up = up;
+		eb32q_part_free(root, new);
+		return new;
+	}
+
+	while (eb32q_tag(cur) == EB32Q_NODE) {
+		node = eb32q_untag(cur);
+		if (node->bit < 30 &&
+		    ((new->key ^ node->nkey) >> (node->bit + 2)) != 0)
+			break; /* the key diverges above this digit */
+
+		down = (new->key >> node->bit) & 3;
+		if (!node->b[down]) {
+			/* Free branch : the leaf fits right here and the node
+			 * part remains spare. This is where four-branch nodes
+			 * save parts against regular trees.
+			 */
+			node->b[down] = eb32q_dotag(new, EB32Q_LEAF);
+			new->leaf_up = node;
+			eb32q_part_free(root, new);
+			return new;
+		}
+		up = node;
+		slot = down;
+		cur = node->b[down];
+	}
+
+	/* <cur> is either a leaf, or a node whose prefix diverges from the
+	 * key. Split above it on the digit covering the first differing bit,
+	 * using <new>'s own node part.
+	 */
+	node = eb32q_untag(cur);
+	if (eb32q_tag(cur) == EB32Q_LEAF) {
+		if (node->key == new->key)
+			return node;
+		okey = node->key;
+	} else
+		okey = node->nkey;
+
+	bit = (flsnz(new->key ^ okey) - 1) & ~1;
+	new->bit = bit;
+	new->nkey = new->key;
+	new->b[0] = new->b[1] = new->b[2] = new->b[3] = NULL;
+	new->b[(new->key >> bit) & 3] = eb32q_dotag(new, EB32Q_LEAF);
+	new->b[(okey >> bit) & 3] = cur;
+	new->leaf_up = new;
+	if (eb32q_tag(cur) == EB32Q_NODE)
+		node->node_up = new;
+	else
+		node->leaf_up = new;
+	new->node_up = up;
+	up->b[slot] = eb32q_dotag(new, EB32Q_NODE);
+	return new;
+}
+
+/* Delete the leaf of <eb32q> from tree <root> if it was linked in, and mark
+ * the node unused. A node keeping a single branch after the removal is
+ * collapsed into its parent. The leaf's own node part is then released :
+ * either it was spare and leaves the spare list, or it serves as a node
+ * somewhere else in the tree and its contents migrate into a spare part,
+ * which the count of parts against nodes guarantees to exist.
+ */
+void eb32q_delete(struct eb32q_root *root, struct eb32q_node *eb32q)
+{
+	struct eb32q_node *up, *node, *child, *spare;
+	unsigned int i, count;
+
+	up = eb32q->leaf_up;
+	if (!up)
+		return;
+
+	/* detach the leaf from its parent */
+	up->b[eb32q_slot(up, eb32q_dotag(eb32q, EB32Q_LEAF))] = NULL;
+
+	if (!eb32q_is_root(up)) {
+		count = 0;
+		child = NULL;
+		for (i = 0; i < 4; i++)
+			if (up->b[i]) {
+				child = up->b[i];
+				count++;
+			}
+		if (count == 1) {
+			/* the node keeps a single branch : collapse it into
+			 * its parent and spare its part */
+			struct eb32q_node *gup = up->node_up;
+
+			gup->b[eb32q_slot(gup, eb32q_dotag(up, EB32Q_NODE))] = child;
+			if (eb32q_tag(child) == EB32Q_NODE)
+				eb32q_untag(child)->node_up = gup;
+			else
+				eb32q_untag(child)->leaf_up = gup;
+			eb32q_part_free(root, up);
+		}
+	}
+
+	/* release the leaf's own node part */
+	if (eb32q->bit == -1)
+		eb32q_part_unlink(root, eb32q);
+	else {
+		spare = eb32q_part_pick(root);
+		for (i = 0; i < 4; i++) {
+			spare->b[i] = eb32q->b[i];
+			if (!spare->b[i])
+				continue;
+			if (eb32q_tag(spare->b[i]) == EB32Q_NODE)
+				eb32q_untag(spare->b[i])->node_up = spare;
+			else
+				eb32q_untag(spare->b[i])->leaf_up = spare;
+		}
+		spare->bit = eb32q->bit;
+		spare->nkey = eb32q->nkey;
+		spare->node_up = eb32q->node_up;
+		node = spare->node_up;
+		node->b[eb32q_slot(node, eb32q_dotag(eb32q, EB32Q_NODE))] =
+			eb32q_dotag(spare, EB32Q_NODE);
+	}
+	eb32q->leaf_up = NULL;
+}
@@ -0,0 +1,95 @@
+/*
+ * Elastic Binary Trees - macros and structures for operating on 32bit nodes
+ * with four branches per node.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EB32QTREE_H
+#define _EB32QTREE_H
+
+#include "ebtree.h"
+
+/* The design notes in ebtree.h observe that the regular layout is limited to
+ * only two branches per node, and that wider nodes would cut the height. The
+ * eb32q tree implements this for 32-bit keys : each node consumes a two-bit
+ * digit of the key, aligned on even bit positions, so a descent takes at
+ * most 32 dependent loads instead of 64. Latency-bound deep trees are the
+ * target; the price is a bigger node and a more complex deletion.
+ *
+ * The node still carries both a leaf part and a node part, but with four
+ * branches a tree of n leaves may use fewer than n - 1 node parts, so parts
+ * are no longer implicitly tied to the structure : unused ones are kept on a
+ * per-tree spare list, and deleting a leaf whose part serves elsewhere
+ * migrates that part into a spare one. This is also why the delete operation
+ * takes the root. Since the prefix guarding a node can thus outlive the leaf
+ * that brought it, each node part stores its own prefix representative
+ * instead of borrowing a leaf's key.
+ *
+ * Branch pointers use the same tagging convention as regular trees : bit 0
+ * set designates a node part, clear a leaf part, and NULL an absent branch.
+ * The root only uses its first branch; its second holds a small sentinel so
+ * that the climb loops can recognize it.
+ *
+ * Keys are always unique in an eb32q tree : there is no duplicate subtree,
+ * and inserting an already present key returns the existing node, like an
+ * insertion refused by a unique regular tree.
+ */
+struct eb32q_node {
+	struct eb32q_node *b[4];     /* node part : the four tagged branches */
+	struct eb32q_node *node_up;  /* node part : parent node part */
+	struct eb32q_node *leaf_up;  /* leaf part : parent node part, NULL = unlinked */
+	struct eb32q_node *free_next;/* next part in the tree's spare list */
+	struct eb32q_node *free_prev;/* previous part in the tree's spare list */
+	uint32_t key;                /* the leaf's key */
+	uint32_t nkey;               /* node part : prefix representative */
+	int bit;                     /* node part : low bit of its digit, -1 = spare */
+};
+
+/* The root of an eb32q tree : the single used branch, the sentinel marking
+ * the root for the climb loops, and the head of the spare part list. The
+ * first fields mirror struct eb32q_node so that parent pointers can
+ * designate the root like any node.
+ */
+struct eb32q_root {
+	struct eb32q_node *b[4];
+	struct eb32q_node *free;
+};
+
+#define EB32Q_ROOT							\
+	(struct eb32q_root) {						\
+		.b = { NULL, (struct eb32q_node *)1, NULL, NULL },	\
+		.free = NULL,						\
+	}
+
+#define EB32Q_TREE_HEAD(name)						\
+	struct eb32q_root name = EB32Q_ROOT
+
+/* Return leftmost node in the tree, or NULL if none */
+extern struct eb32q_node *eb32q_first(struct eb32q_root *root);
+
+/* Return rightmost node in the tree, or NULL if none */
+extern struct eb32q_node *eb32q_last(struct eb32q_root *root);
+
+/* Return next node in the tree, or NULL if none */
+extern struct eb32q_node *eb32q_next(struct eb32q_node *eb32q);
+
+/* Return previous node in the tree, or NULL if none */
+extern struct eb32q_node *eb32q_prev(struct eb32q_node *eb32q);
+
+/* Delete node from the tree if it was linked in. Mark the node unused. */
+extern void eb32q_delete(struct eb32q_root *root, struct eb32q_node *eb32q);
+
+/* Return the node containing key <x>, or NULL if not found. */
+extern struct eb32q_node *eb32q_lookup(struct eb32q_root *root, uint32_t x);
+
+/* Insert node <new>, with new->key already set, and return it. If the key
+ * was already present, the existing node is returned instead and <new> is
+ * left unlinked.
+ */
+extern struct eb32q_node *eb32q_insert(struct eb32q_root *root, struct eb32q_node *new);
+
+#endif /* _EB32QTREE_H */
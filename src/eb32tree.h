@@ -11,6 +11,7 @@
 #define _EB32TREE_H
 
 #include "ebtree.h"
+#include "ebstats.h"
 #include <stdint.h>
 
 
@@ -34,6 +35,12 @@ struct eb32_node {
  * are generally called at most once or twice in a program.
  */
 
+/* The hottest functions are also provided as static inline definitions at the
+ * end of this file when EB_INLINE is defined, so that call sites avoid the PLT
+ * indirection of the shared library and the descents can specialize into their
+ * callers (see the __eb32_lookup() block).
+ */
+#ifndef EB_INLINE
 /* Return leftmost node in the tree, or NULL if none */
 extern struct eb32_node *eb32_first(struct eb_root *root);
 
@@ -45,6 +52,7 @@ extern struct eb32_node *eb32_next(struct eb32_node *eb32);
 
 /* Return previous node in the tree, or NULL if none */
 extern struct eb32_node *eb32_prev(struct eb32_node *eb32);
+#endif
 
 /* Return next node in the tree, skipping duplicates, or NULL if none */
 extern struct eb32_node *eb32_next_unique(struct eb32_node *eb32);
@@ -61,13 +69,93 @@ extern void eb32_delete(struct eb32_node *eb32);
  * The following functions are not inlined by default. They are declared
  * in eb32tree.c, which simply relies on their inline version.
  */
+#ifndef EB_INLINE
 extern struct eb32_node *eb32_lookup(struct eb_root *root, uint32_t x);
+#endif
 extern struct eb32_node *eb32i_lookup(struct eb_root *root, int32_t x);
 extern struct eb32_node *eb32_lookup_le(struct eb_root *root, uint32_t x);
 extern struct eb32_node *eb32_lookup_ge(struct eb_root *root, uint32_t x);
+#ifndef EB_INLINE
 extern struct eb32_node *eb32_insert(struct eb_root *root, struct eb32_node *new);
+#endif
 extern struct eb32_node *eb32i_insert(struct eb_root *root, struct eb32_node *new);
 
+/* Insert eb32_node <new> into cached tree <root>, maintaining the cached
+ * extremum pointers. Only new->key needs be set with the key. The eb32_node
+ * is returned.
+ */
+extern struct eb32_node *eb32_insert_cached(struct eb_root_cached *root, struct eb32_node *new);
+
+/* Append duplicate <new> right after <tail>, which must be the last entry
+ * inserted with the same key (typically the node returned by the previous
+ * insert or append of that key), in amortized constant time. FIFO walk order
+ * of the duplicates is preserved. Falls back to a regular insert when <tail>
+ * does not apply.
+ */
+extern struct eb32_node *eb32_append_dup(struct eb_root *root, struct eb32_node *tail, struct eb32_node *new);
+
+/* Insert eb32_node <new> into tree <root>, starting the descent from leaf
+ * <hint> instead of the root. <hint> should carry a key close to new->key,
+ * typically the node returned by the previous insertion, which makes sorted
+ * or locally-clustered insertion streams amortized constant time. Falls back
+ * to a regular insert when <hint> does not help. Same return convention as
+ * eb32_insert().
+ */
+extern struct eb32_node *eb32_insert_hint(struct eb_root *root, struct eb32_node *hint, struct eb32_node *new);
+
+/* Change the key of <node>, linked in tree <root>, to <new_key>. When the new
+ * key keeps the leaf in its current position (a small delta usually does),
+ * this is a single store ; otherwise the node is deleted and re-inserted.
+ * Returns the node holding <new_key>, which only differs from <node> when the
+ * tree holds unique keys and <new_key> was already there.
+ */
+extern struct eb32_node *eb32_update(struct eb_root *root, struct eb32_node *node, uint32_t new_key);
+
+/* Visit in key order every node of tree <root> whose key lies within
+ * [<lo>, <hi>], both included, calling <cb> with the node and <ctx> for each.
+ * The walk stops early when <cb> returns non-zero, and the next node is
+ * prefetched before the callback runs. The callback may safely delete the
+ * visited node. Returns the number of nodes visited.
+ */
+extern size_t eb32_walk_range(struct eb_root *root, uint32_t lo, uint32_t hi,
+			      int (*cb)(struct eb32_node *node, void *ctx), void *ctx);
+
+#ifdef EB_AUGMENT
+/* Order statistics over the subtree counts maintained under EB_AUGMENT (see
+ * ebtree.h). eb32_rank() returns the number of leaves whose key is strictly
+ * lower than <x> ; eb32_select() returns the <k>-th leaf in key order,
+ * zero-based, or NULL when fewer than <k>+1 leaves exist. Both are a single
+ * descent. The total leaf count is given by eb_count().
+ */
+extern unsigned int eb32_rank(struct eb_root *root, uint32_t x);
+extern struct eb32_node *eb32_select(struct eb_root *root, unsigned int k);
+#endif
+
+/* Build a tree from <n> nodes pre-sorted by ascending key, in a single linear
+ * pass. The tree must either be empty or only contain keys lower than or
+ * equal to the first key of the array. Returns the number of nodes actually
+ * linked.
+ */
+extern unsigned int eb32_load_sorted(struct eb_root *root, struct eb32_node * const *nodes, unsigned int n);
+
+/* Look up the <n> keys of <keys> and store the resulting nodes into
+ * <results> (NULL when not found, the first duplicate otherwise). Up to 8
+ * descents are interleaved so that their memory latencies overlap.
+ */
+extern void eb32_lookup_multi(struct eb_root *root, const uint32_t *keys, struct eb32_node **results, unsigned int n);
+
+/* Detach all the leaves whose key is lower than or equal to <x> in a single
+ * operation, and return them chained in ascending key order, to be walked
+ * with eb32_chain_next(). The nodes are marked unlinked exactly as
+ * eb32_delete() would.
+ */
+extern struct eb32_node *eb32_delete_le(struct eb_root *root, uint32_t x);
+
+/* Return the node following <node> in a chain returned by eb32_delete_le(),
+ * or NULL once the chain is exhausted.
+ */
+extern struct eb32_node *eb32_chain_next(struct eb32_node *node);
+
 /*
  * The following functions are less likely to be used directly, because their
  * code is larger. The non-inlined version is preferred.
@@ -75,21 +163,11 @@ extern struct eb32_node *eb32i_insert(struct eb_root *root, struct eb32_node *ne
 
 /* Delete node from the tree if it was linked in. Mark the node unused. */
 extern void eb32_delete(struct eb32_node *eb32);
-/*
- * Find the first occurence of a key in the tree <root>. If none can be
- * found, return NULL.
- */
-extern struct eb32_node *eb32_lookup(struct eb_root *root, uint32_t x);
 /*
  * Find the first occurence of a signed key in the tree <root>. If none can
  * be found, return NULL.
  */
 extern struct eb32_node *eb32i_lookup(struct eb_root *root, int32_t x);
-/* Insert eb32_node <new> into subtree starting at node root <root>.
- * Only new->key needs be set with the key. The eb32_node is returned.
- * If root->b[EB_RGHT]==1, the tree may only contain unique keys.
- */
-extern struct eb32_node *eb32_insert(struct eb_root *root, struct eb32_node *new);
 
 /* Insert eb32_node <new> into subtree starting at node root <root>, using
  * signed keys. Only new->key needs be set with the key. The eb32_node
@@ -97,4 +175,245 @@ extern struct eb32_node *eb32_insert(struct eb_root *root, struct eb32_node *new
  */
 extern struct eb32_node *eb32i_insert(struct eb_root *root, struct eb32_node *new);
 
+/* The bodies of eb32_lookup() and eb32_insert() live here so that, with
+ * EB_INLINE defined, call sites get static inline definitions of the public
+ * names : the descents then inline and specialize into their callers (a
+ * known-unique tree loses its duplicate branches, for instance) instead of
+ * paying a PLT call into the shared library. The exported functions of
+ * eb32tree.c are thin wrappers around these, so both flavours always behave
+ * identically. Code meant to stay binary-compatible with the library (eg the
+ * D bindings) must not define EB_INLINE.
+ */
+
+/*
+ * Find the first occurence of a key in the tree <root>. If none can be
+ * found, return NULL.
+ */
+static forceinline struct eb32_node *__eb32_lookup(struct eb_root *root, uint32_t x)
+{
+	struct eb32_node *node;
+	eb_troot_t *troot;
+	uint32_t y;
+	int node_bit;
+
+	EB_STATS_DESCENT(root);
+
+	troot = root->b[EB_LEFT];
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	while (1) {
+		EB_STATS_DOWN();
+		if ((eb_gettag(troot) == EB_LEAF)) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb32_node, node.branches);
+			EB_STATS_LOOKUP();
+			if (node->key == x)
+				return node;
+			else
+				return NULL;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct eb32_node, node.branches);
+		node_bit = node->node.bit;
+
+		y = node->key ^ x;
+		if (!y) {
+			/* Either we found the node which holds the key, or
+			 * we have a dup tree. In the later case, we have to
+			 * walk it down left to get the first entry.
+			 */
+			if (node_bit < 0) {
+				troot = node->node.branches.b[EB_LEFT];
+				while (eb_gettag(troot) != EB_LEAF)
+					troot = (eb_untag(troot, EB_NODE))->b[EB_LEFT];
+				node = container_of(eb_untag(troot, EB_LEAF),
+						    struct eb32_node, node.branches);
+			}
+			EB_STATS_LOOKUP();
+			return node;
+		}
+
+		if ((y >> node_bit) >= EB_NODE_BRANCHES) {
+			EB_STATS_LOOKUP();
+			return NULL; /* no more common bits */
+		}
+
+		troot = node->node.branches.b[(x >> node_bit) & EB_NODE_BRANCH_MASK];
+	}
+}
+
+/* Insert eb32_node <new> into subtree starting at node root <root>.
+ * Only new->key needs be set with the key. The eb32_node is returned.
+ * If root->b[EB_RGHT]==1, the tree may only contain unique keys.
+ */
+static forceinline struct eb32_node *__eb32_insert(struct eb_root *root, struct eb32_node *new) {
+	struct eb32_node *old;
+	unsigned int side;
+	eb_troot_t *troot, **up_ptr;
+	uint32_t newkey; /* caching the key saves approximately one cycle */
+	eb_troot_t *root_right = root;
+	eb_troot_t *new_left, *new_rght;
+	eb_troot_t *new_leaf;
+	int old_node_bit;
+
+	EB_STATS_DESCENT(root);
+
+	side = EB_LEFT;
+	troot = root->b[EB_LEFT];
+	root_right = root->b[EB_RGHT];
+	if (unlikely(troot == NULL)) {
+		/* Tree is empty, insert the leaf part below the left branch */
+		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
+		new->node.leaf_p = eb_dotag(root, EB_LEFT);
+		new->node.node_p = NULL; /* node part unused */
+		EB_STATS_INSERT();
+		EB_SIZE_LINK(&new->node);
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	/* The tree descent is fairly easy :
+	 *  - first, check if we have reached a leaf node
+	 *  - second, check if we have gone too far
+	 *  - third, reiterate
+	 * Everywhere, we use <new> for the node node we are inserting, <root>
+	 * for the node we attach it to, and <old> for the node we are
+	 * displacing below <new>. <troot> will always point to the future node
+	 * (tagged with its type). <side> carries the side the node <new> is
+	 * attached to below its parent, which is also where previous node
+	 * was attached. <newkey> carries the key being inserted.
+	 */
+	newkey = new->key;
+
+	while (1) {
+		EB_STATS_DOWN();
+		if (eb_gettag(troot) == EB_LEAF) {
+			/* insert above a leaf */
+			old = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb32_node, node.branches);
+			new->node.node_p = old->node.leaf_p;
+			up_ptr = &old->node.leaf_p;
+			break;
+		}
+
+		/* OK we're walking down this link */
+		old = container_of(eb_untag(troot, EB_NODE),
+				    struct eb32_node, node.branches);
+		old_node_bit = old->node.bit;
+
+		/* Stop going down when we don't have common bits anymore. We
+		 * also stop in front of a duplicates tree because it means we
+		 * have to insert above.
+		 */
+
+		if ((old_node_bit < 0) || /* we're above a duplicate tree, stop here */
+		    (((new->key ^ old->key) >> old_node_bit) >= EB_NODE_BRANCHES)) {
+			/* The tree did not contain the key, so we insert <new> before the node
+			 * <old>, and set ->bit to designate the lowest bit position in <new>
+			 * which applies to ->branches.b[].
+			 */
+			new->node.node_p = old->node.node_p;
+			up_ptr = &old->node.node_p;
+			break;
+		}
+
+		/* walk down */
+		root = &old->node.branches;
+		side = (newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
+		troot = root->b[side];
+	}
+
+	new_left = eb_dotag(&new->node.branches, EB_LEFT);
+	new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+	new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+
+	/* We need the common higher bits between new->key and old->key.
+	 * What differences are there between new->key and the node here ?
+	 * NOTE that bit(new) is always < bit(root) because highest
+	 * bit of new->key and old->key are identical here (otherwise they
+	 * would sit on different branches).
+	 */
+
+	// note that if EB_NODE_BITS > 1, we should check that it's still >= 0
+	new->node.bit = flsnz(new->key ^ old->key) - EB_NODE_BITS;
+
+	if (new->key == old->key) {
+		new->node.bit = -1; /* mark as new dup tree, just in case */
+
+		if (likely(eb_gettag(root_right))) {
+			/* we refuse to duplicate this key if the tree is
+			 * tagged as containing only unique keys.
+			 */
+			return old;
+		}
+
+		if (eb_gettag(troot) != EB_LEAF) {
+			/* there was already a dup tree below */
+			struct eb_node *ret;
+			ret = eb_insert_dup(&old->node, &new->node);
+			EB_STATS_INSERT();
+			return container_of(ret, struct eb32_node, node);
+		}
+		/* otherwise fall through */
+	}
+
+	if (new->key >= old->key) {
+		new->node.branches.b[EB_LEFT] = troot;
+		new->node.branches.b[EB_RGHT] = new_leaf;
+		new->node.leaf_p = new_rght;
+		*up_ptr = new_left;
+	}
+	else {
+		new->node.branches.b[EB_LEFT] = new_leaf;
+		new->node.branches.b[EB_RGHT] = troot;
+		new->node.leaf_p = new_left;
+		*up_ptr = new_rght;
+	}
+
+	/* Ok, now we are inserting <new> between <root> and <old>. <old>'s
+	 * parent is already set to <new>, and the <root>'s branch is still in
+	 * <side>. Update the root's leaf till we have it. Note that we can also
+	 * find the side by checking the side of new->node.node_p.
+	 */
+
+	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_STATS_INSERT();
+	EB_SIZE_LINK(&new->node);
+	EB_THR_LINK(&new->node);
+	return new;
+}
+
+#ifdef EB_INLINE
+static forceinline struct eb32_node *eb32_first(struct eb_root *root)
+{
+	return container_of(__eb_first(root), struct eb32_node, node);
+}
+
+static forceinline struct eb32_node *eb32_last(struct eb_root *root)
+{
+	return container_of(__eb_last(root), struct eb32_node, node);
+}
+
+static forceinline struct eb32_node *eb32_next(struct eb32_node *eb32)
+{
+	return container_of(__eb_next(&eb32->node), struct eb32_node, node);
+}
+
+static forceinline struct eb32_node *eb32_prev(struct eb32_node *eb32)
+{
+	return container_of(__eb_prev(&eb32->node), struct eb32_node, node);
+}
+
+static forceinline struct eb32_node *eb32_lookup(struct eb_root *root, uint32_t x)
+{
+	return __eb32_lookup(root, x);
+}
+
+static forceinline struct eb32_node *eb32_insert(struct eb_root *root, struct eb32_node *new)
+{
+	return __eb32_insert(root, new);
+}
+#endif /* EB_INLINE */
+
 #endif /* _EB32_TREE_H */
@@ -9,8 +9,10 @@
 
 #include "eb64tree.h"
 #include "ebtree.h"
+#include "ebstats.h"
 #include <stdint.h>
 #include <limits.h>
+#include <string.h>
 
 /* Return the structure of type <type> whose member <member> points to <ptr> */
 #define eb64_entry(ptr, type, member) container_of(ptr, type, member)
@@ -21,29 +23,36 @@
  * are generally called at most once or twice in a program.
  */
 
+/* The functions below down to eb64_insert() are thin wrappers around the
+ * static inline bodies of ebtree.h/eb64tree.h, which EB_INLINE consumers call
+ * directly. They are compiled out when this file itself is built into an
+ * EB_INLINE consumer, where the header definitions take their place.
+ */
+#ifndef EB_INLINE
 /* Return leftmost node in the tree, or NULL if none */
 inline struct eb64_node *eb64_first(struct eb_root *root)
 {
-	return eb64_entry(eb_first(root), struct eb64_node, node);
+	return eb64_entry(__eb_first(root), struct eb64_node, node);
 }
 
 /* Return rightmost node in the tree, or NULL if none */
 inline struct eb64_node *eb64_last(struct eb_root *root)
 {
-	return eb64_entry(eb_last(root), struct eb64_node, node);
+	return eb64_entry(__eb_last(root), struct eb64_node, node);
 }
 
 /* Return next node in the tree, or NULL if none */
 inline struct eb64_node *eb64_next(struct eb64_node *eb64)
 {
-	return eb64_entry(eb_next(&eb64->node), struct eb64_node, node);
+	return eb64_entry(__eb_next(&eb64->node), struct eb64_node, node);
 }
 
 /* Return previous node in the tree, or NULL if none */
 inline struct eb64_node *eb64_prev(struct eb64_node *eb64)
 {
-	return eb64_entry(eb_prev(&eb64->node), struct eb64_node, node);
+	return eb64_entry(__eb_prev(&eb64->node), struct eb64_node, node);
 }
+#endif /* EB_INLINE */
 
 /* Return next node in the tree, skipping duplicates, or NULL if none */
 inline struct eb64_node *eb64_next_unique(struct eb64_node *eb64)
@@ -69,50 +78,12 @@ inline void eb64_delete(struct eb64_node *eb64)
  * Find the first occurence of a key in the tree <root>. If none can be
  * found, return NULL.
  */
+#ifndef EB_INLINE
 struct eb64_node *eb64_lookup(struct eb_root *root, uint64_t x)
 {
-	struct eb64_node *node;
-	eb_troot_t *troot;
-	uint64_t y;
-
-	troot = root->b[EB_LEFT];
-	if (unlikely(troot == NULL))
-		return NULL;
-
-	while (1) {
-		if ((eb_gettag(troot) == EB_LEAF)) {
-			node = container_of(eb_untag(troot, EB_LEAF),
-					    struct eb64_node, node.branches);
-			if (node->key == x)
-				return node;
-			else
-				return NULL;
-		}
-		node = container_of(eb_untag(troot, EB_NODE),
-				    struct eb64_node, node.branches);
-
-		y = node->key ^ x;
-		if (!y) {
-			/* Either we found the node which holds the key, or
-			 * we have a dup tree. In the later case, we have to
-			 * walk it down left to get the first entry.
-			 */
-			if (node->node.bit < 0) {
-				troot = node->node.branches.b[EB_LEFT];
-				while (eb_gettag(troot) != EB_LEAF)
-					troot = (eb_untag(troot, EB_NODE))->b[EB_LEFT];
-				node = container_of(eb_untag(troot, EB_LEAF),
-						    struct eb64_node, node.branches);
-			}
-			return node;
-		}
-
-		if ((y >> node->node.bit) >= EB_NODE_BRANCHES)
-			return NULL; /* no more common bits */
-
-		troot = node->node.branches.b[(x >> node->node.bit) & EB_NODE_BRANCH_MASK];
-	}
+	return __eb64_lookup(root, x);
 }
+#endif
 
 /*
  * Find the first occurence of a signed key in the tree <root>. If none can
@@ -125,14 +96,18 @@ struct eb64_node *eb64i_lookup(struct eb_root *root, int64_t x)
 	uint64_t key = x ^ (1ULL << 63);
 	uint64_t y;
 
+	EB_STATS_DESCENT(root);
+
 	troot = root->b[EB_LEFT];
 	if (unlikely(troot == NULL))
 		return NULL;
 
 	while (1) {
+		EB_STATS_DOWN();
 		if ((eb_gettag(troot) == EB_LEAF)) {
 			node = container_of(eb_untag(troot, EB_LEAF),
 					    struct eb64_node, node.branches);
+			EB_STATS_LOOKUP();
 			if (node->key == (uint64_t)x)
 				return node;
 			else
@@ -154,11 +129,14 @@ struct eb64_node *eb64i_lookup(struct eb_root *root, int64_t x)
 				node = container_of(eb_untag(troot, EB_LEAF),
 						    struct eb64_node, node.branches);
 			}
+			EB_STATS_LOOKUP();
 			return node;
 		}
 
-		if ((y >> node->node.bit) >= EB_NODE_BRANCHES)
+		if ((y >> node->node.bit) >= EB_NODE_BRANCHES) {
+			EB_STATS_LOOKUP();
 			return NULL; /* no more common bits */
+		}
 
 		troot = node->node.branches.b[(key >> node->node.bit) & EB_NODE_BRANCH_MASK];
 	}
@@ -168,7 +146,18 @@ struct eb64_node *eb64i_lookup(struct eb_root *root, int64_t x)
  * Only new->key needs be set with the key. The eb64_node is returned.
  * If root->b[EB_RGHT]==1, the tree may only contain unique keys.
  */
-struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
+#ifndef EB_INLINE
+struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new)
+{
+	return __eb64_insert(root, new);
+}
+#endif
+
+/* Insert eb64_node <new> into subtree starting at node root <root>, using
+ * signed keys. Only new->key needs be set with the key. The eb64_node
+ * is returned. If root->b[EB_RGHT]==1, the tree may only contain unique keys.
+ */
+struct eb64_node *eb64i_insert(struct eb_root *root, struct eb64_node *new) {
 	struct eb64_node *old;
 	unsigned int side;
 	eb_troot_t *troot;
@@ -176,6 +165,8 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 	eb_troot_t *root_right = root;
 	int old_node_bit;
 
+	EB_STATS_DESCENT(root);
+
 	side = EB_LEFT;
 	troot = root->b[EB_LEFT];
 	root_right = root->b[EB_RGHT];
@@ -184,6 +175,9 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_STATS_INSERT();
+		EB_SIZE_LINK(&new->node);
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -196,11 +190,14 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 	 * displacing below <new>. <troot> will always point to the future node
 	 * (tagged with its type). <side> carries the side the node <new> is
 	 * attached to below its parent, which is also where previous node
-	 * was attached. <newkey> carries the key being inserted.
+	 * was attached. <newkey> carries a high bit shift of the key being
+	 * inserted in order to have negative keys stored before positive
+	 * ones.
 	 */
-	newkey = new->key;
+	newkey = new->key ^ (1ULL << 63);
 
 	while (1) {
+		EB_STATS_DOWN();
 		if (unlikely(eb_gettag(troot) == EB_LEAF)) {
 			eb_troot_t *new_left, *new_rght;
 			eb_troot_t *new_leaf, *old_leaf;
@@ -231,7 +228,7 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 			   The last two cases can easily be partially merged.
 			*/
 			 
-			if (new->key < old->key) {
+			if ((int64_t)new->key < (int64_t)old->key) {
 				new->node.leaf_p = new_left;
 				old->node.leaf_p = new_rght;
 				new->node.branches.b[EB_LEFT] = new_leaf;
@@ -252,6 +249,9 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 				if (new->key == old->key) {
 					new->node.bit = -1;
 					root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+					EB_STATS_INSERT();
+					EB_SIZE_LINK(&new->node);
+					EB_THR_LINK(&new->node);
 					return new;
 				}
 			}
@@ -284,13 +284,13 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 
 			new->node.node_p = old->node.node_p;
 
-			if (new->key < old->key) {
+			if ((int64_t)new->key < (int64_t)old->key) {
 				new->node.leaf_p = new_left;
 				old->node.node_p = new_rght;
 				new->node.branches.b[EB_LEFT] = new_leaf;
 				new->node.branches.b[EB_RGHT] = old_node;
 			}
-			else if (new->key > old->key) {
+			else if ((int64_t)new->key > (int64_t)old->key) {
 				old->node.node_p = new_left;
 				new->node.leaf_p = new_rght;
 				new->node.branches.b[EB_LEFT] = old_node;
@@ -299,6 +299,7 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 			else {
 				struct eb_node *ret;
 				ret = eb_insert_dup(&old->node, &new->node);
+				EB_STATS_INSERT();
 				return container_of(ret, struct eb64_node, node);
 			}
 			break;
@@ -336,48 +337,108 @@ struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new) {
 	new->node.bit = fls64(new->key ^ old->key) - EB_NODE_BITS;
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
 
+	EB_STATS_INSERT();
+	EB_SIZE_LINK(&new->node);
+	EB_THR_LINK(&new->node);
 	return new;
 }
 
-/* Insert eb64_node <new> into subtree starting at node root <root>, using
- * signed keys. Only new->key needs be set with the key. The eb64_node
- * is returned. If root->b[EB_RGHT]==1, the tree may only contain unique keys.
+/* Insert eb64_node <new> into cached tree <root>, maintaining the cached
+ * extremum pointers. Only new->key needs be set with the key. The eb64_node
+ * is returned. Since duplicates are always appended after the existing
+ * entries with the same key, <new> becomes the new rightmost leaf whenever
+ * its key is greater than or equal to the current one.
  */
-struct eb64_node *eb64i_insert(struct eb_root *root, struct eb64_node *new) {
+struct eb64_node *eb64_insert_cached(struct eb_root_cached *root, struct eb64_node *new)
+{
+	struct eb64_node *ret;
+
+	ret = eb64_insert(&root->root, new);
+	if (ret != new)
+		return ret; /* unique tree, existing node returned, no change */
+
+	if (!root->first || new->key < container_of(root->first, struct eb64_node, node)->key)
+		root->first = &new->node;
+	if (!root->last || new->key >= container_of(root->last, struct eb64_node, node)->key)
+		root->last = &new->node;
+	return new;
+}
+
+/* Append duplicate <new> right after <tail>, which must be the last entry
+ * inserted with the same key, ie the node returned by the previous insert or
+ * append of that key. This preserves the FIFO walk order that eb64_next()
+ * guarantees on duplicates, while the bottom-up relinking skips the descent
+ * of the duplicate subtree, so a run of appends under a hot key costs
+ * amortized constant time instead of O(log D). When <tail> is NULL, not
+ * linked anymore, or carries another key, this falls back to a regular
+ * insert, which also takes care of trees tagged as unique. The node actually
+ * linked is returned.
+ */
+struct eb64_node *eb64_append_dup(struct eb_root *root, struct eb64_node *tail, struct eb64_node *new)
+{
+	if (!tail || !tail->node.leaf_p || tail->key != new->key ||
+	    eb_gettag(root->b[EB_RGHT]))
+		return eb64_insert(root, new);
+	return container_of(eb_insert_dup_tail(&tail->node, &new->node),
+			    struct eb64_node, node);
+}
+
+/* Insert eb64_node <new> into tree <root>, starting from leaf <hint> instead
+ * of descending from the root. <hint> should carry a key close to new->key,
+ * typically the node returned by the previous insertion or a lookup around
+ * the same place. We climb the parent links from <hint> until we reach the
+ * node whose prefix covers new->key, then run the regular descent from there,
+ * so a sorted or locally-clustered insertion stream only touches a few nodes
+ * around the previous position instead of the whole path from the root. When
+ * <hint> is NULL, not linked in a tree, or so far away that the climb ends at
+ * the root, this falls back to a plain eb64_insert(). The return convention
+ * is the one of eb64_insert().
+ */
+struct eb64_node *eb64_insert_hint(struct eb_root *root, struct eb64_node *hint,
+				   struct eb64_node *new)
+{
 	struct eb64_node *old;
 	unsigned int side;
 	eb_troot_t *troot;
-	uint64_t newkey; /* caching the key saves approximately one cycle */
-	eb_troot_t *root_right = root;
-	int old_node_bit;
+	eb_troot_t *root_right;
+	eb_troot_t *t;
+	struct eb_root *up;
+
+	EB_STATS_DESCENT(root);
+
+	if (unlikely(!hint || !hint->node.leaf_p))
+		return eb64_insert(root, new);
 
-	side = EB_LEFT;
-	troot = root->b[EB_LEFT];
 	root_right = root->b[EB_RGHT];
-	if (unlikely(troot == NULL)) {
-		/* Tree is empty, insert the leaf part below the left branch */
-		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
-		new->node.leaf_p = eb_dotag(root, EB_LEFT);
-		new->node.node_p = NULL; /* node part unused */
-		return new;
+
+	/* Climb from <hint> to the first node covering new->key, ie agreeing
+	 * with it on all the bits above its own. Duplicate nodes (bit < 0)
+	 * are skipped, their head is covered like any other node.
+	 */
+	t = hint->node.leaf_p;
+	while (1) {
+		side = eb_gettag(t);
+		up = eb_untag(t, side);
+		if (side == EB_LEFT && eb_clrtag(up->b[EB_RGHT]) == NULL) {
+			/* we reached the root : the hint saved nothing */
+			return eb64_insert(root, new);
+		}
+		old = container_of(eb_root_to_node(up), struct eb64_node, node);
+		if (old->node.bit >= 0 &&
+		    ((new->key ^ old->key) >> old->node.bit) < EB_NODE_BRANCHES)
+			break;
+		t = old->node.node_p;
 	}
 
-	/* The tree descent is fairly easy :
-	 *  - first, check if we have reached a leaf node
-	 *  - second, check if we have gone too far
-	 *  - third, reiterate
-	 * Everywhere, we use <new> for the node node we are inserting, <root>
-	 * for the node we attach it to, and <old> for the node we are
-	 * displacing below <new>. <troot> will always point to the future node
-	 * (tagged with its type). <side> carries the side the node <new> is
-	 * attached to below its parent, which is also where previous node
-	 * was attached. <newkey> carries a high bit shift of the key being
-	 * inserted in order to have negative keys stored before positive
-	 * ones.
+	/* Descend from the covering node like eb64_insert() does from the
+	 * root ; <old>'s subtree necessarily contains new->key's position.
 	 */
-	newkey = new->key ^ (1ULL << 63);
+	up = &old->node.branches;
+	side = (new->key >> old->node.bit) & EB_NODE_BRANCH_MASK;
+	troot = up->b[side];
 
 	while (1) {
+		EB_STATS_DOWN();
 		if (unlikely(eb_gettag(troot) == EB_LEAF)) {
 			eb_troot_t *new_left, *new_rght;
 			eb_troot_t *new_leaf, *old_leaf;
@@ -392,65 +453,37 @@ struct eb64_node *eb64i_insert(struct eb_root *root, struct eb64_node *new) {
 
 			new->node.node_p = old->node.leaf_p;
 
-			/* Right here, we have 3 possibilities :
-			   - the tree does not contain the key, and we have
-			     new->key < old->key. We insert new above old, on
-			     the left ;
-
-			   - the tree does not contain the key, and we have
-			     new->key > old->key. We insert new above old, on
-			     the right ;
-
-			   - the tree does contain the key, which implies it
-			     is alone. We add the new key next to it as a
-			     first duplicate.
-
-			   The last two cases can easily be partially merged.
-			*/
-			 
-			if ((int64_t)new->key < (int64_t)old->key) {
+			if (new->key < old->key) {
 				new->node.leaf_p = new_left;
-				old->node.leaf_p = new_rght;
 				new->node.branches.b[EB_LEFT] = new_leaf;
 				new->node.branches.b[EB_RGHT] = old_leaf;
+				eb_pstore(old->node.leaf_p, new_rght);
 			} else {
-				/* we may refuse to duplicate this key if the tree is
-				 * tagged as containing only unique keys.
-				 */
 				if ((new->key == old->key) && eb_gettag(root_right))
 					return old;
 
-				/* new->key >= old->key, new goes the right */
-				old->node.leaf_p = new_left;
 				new->node.leaf_p = new_rght;
 				new->node.branches.b[EB_LEFT] = old_leaf;
 				new->node.branches.b[EB_RGHT] = new_leaf;
+				eb_pstore(old->node.leaf_p, new_left);
 
 				if (new->key == old->key) {
 					new->node.bit = -1;
-					root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+					eb_pstore(up->b[side], eb_dotag(&new->node.branches, EB_NODE));
+					EB_STATS_INSERT();
+					EB_SIZE_LINK(&new->node);
+					EB_THR_LINK(&new->node);
 					return new;
 				}
 			}
 			break;
 		}
 
-		/* OK we're walking down this link */
 		old = container_of(eb_untag(troot, EB_NODE),
 				    struct eb64_node, node.branches);
-		old_node_bit = old->node.bit;
 
-		/* Stop going down when we don't have common bits anymore. We
-		 * also stop in front of a duplicates tree because it means we
-		 * have to insert above.
-		 */
-
-		if ((old_node_bit < 0) || /* we're above a duplicate tree, stop here */
-		    (((new->key ^ old->key) >> old_node_bit) >= EB_NODE_BRANCHES)) {
-			/* The tree did not contain the key, so we insert <new> before the node
-			 * <old>, and set ->bit to designate the lowest bit position in <new>
-			 * which applies to ->branches.b[].
-			 */
+		if ((old->node.bit < 0) ||
+		    (((new->key ^ old->key) >> old->node.bit) >= EB_NODE_BRANCHES)) {
 			eb_troot_t *new_left, *new_rght;
 			eb_troot_t *new_leaf, *old_node;
 
@@ -461,61 +494,90 @@ struct eb64_node *eb64i_insert(struct eb_root *root, struct eb64_node *new) {
 
 			new->node.node_p = old->node.node_p;
 
-			if ((int64_t)new->key < (int64_t)old->key) {
+			if (new->key < old->key) {
 				new->node.leaf_p = new_left;
-				old->node.node_p = new_rght;
 				new->node.branches.b[EB_LEFT] = new_leaf;
 				new->node.branches.b[EB_RGHT] = old_node;
+				eb_pstore(old->node.node_p, new_rght);
 			}
-			else if ((int64_t)new->key > (int64_t)old->key) {
-				old->node.node_p = new_left;
+			else if (new->key > old->key) {
 				new->node.leaf_p = new_rght;
 				new->node.branches.b[EB_LEFT] = old_node;
 				new->node.branches.b[EB_RGHT] = new_leaf;
+				eb_pstore(old->node.node_p, new_left);
 			}
 			else {
 				struct eb_node *ret;
 				ret = eb_insert_dup(&old->node, &new->node);
+				EB_STATS_INSERT();
 				return container_of(ret, struct eb64_node, node);
 			}
 			break;
 		}
 
 		/* walk down */
-		root = &old->node.branches;
-#if ULONG_MAX >= UINT64_T_MAX
-		side = (newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
-#else
-		side = newkey;
-		side >>= old_node_bit;
-		if (old_node_bit >= 0x20) {
-			side = newkey >> 0x20;
-			side >>= old_node_bit & 0x1F;
-		}
-		side &= EB_NODE_BRANCH_MASK;
-#endif
-		troot = root->b[side];
+		up = &old->node.branches;
+		side = (new->key >> old->node.bit) & EB_NODE_BRANCH_MASK;
+		troot = up->b[side];
 	}
 
-	/* Ok, now we are inserting <new> between <root> and <old>. <old>'s
-	 * parent is already set to <new>, and the <root>'s branch is still in
-	 * <side>. Update the root's leaf till we have it. Note that we can also
-	 * find the side by checking the side of new->node.node_p.
-	 */
-
-	/* We need the common higher bits between new->key and old->key.
-	 * What differences are there between new->key and the node here ?
-	 * NOTE that bit(new) is always < bit(root) because highest
-	 * bit of new->key and old->key are identical here (otherwise they
-	 * would sit on different branches).
-	 */
-	// note that if EB_NODE_BITS > 1, we should check that it's still >= 0
 	new->node.bit = fls64(new->key ^ old->key) - EB_NODE_BITS;
-	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	eb_pstore(up->b[side], eb_dotag(&new->node.branches, EB_NODE));
 
+	EB_STATS_INSERT();
+	EB_SIZE_LINK(&new->node);
+	EB_THR_LINK(&new->node);
 	return new;
 }
 
+/* Change the key of <node>, linked in tree <root>, to <new_key>. The leaf's
+ * position only depends on the bits covered by its parent's split bit, so
+ * when none of them changes (a small nudge of a timer for instance), the key
+ * is updated with a single store and no link is touched. The node part never
+ * constrains this check : it always sits on its own leaf's path, with a bit
+ * not lower than the parent's, so its prefix is preserved whenever the leaf's
+ * is. Under a duplicate head (bit < 0) only an equal key may stay in place.
+ * In all other cases the node moves through a regular delete()+insert() pair.
+ * The node holding <new_key> is returned ; it only differs from <node> when
+ * the tree holds unique keys and <new_key> was already there. Passing an
+ * unlinked node is valid and equivalent to setting the key then inserting.
+ */
+struct eb64_node *eb64_update(struct eb_root *root, struct eb64_node *node, uint64_t new_key)
+{
+	eb_troot_t *t = node->node.leaf_p;
+	struct eb_node *parent;
+	unsigned int side;
+
+	if (unlikely(!t)) {
+		node->key = new_key;
+		return eb64_insert(root, node);
+	}
+
+	side = eb_gettag(t);
+	if (side == EB_LEFT &&
+	    unlikely(eb_clrtag((eb_untag(t, EB_LEFT))->b[EB_RGHT]) == NULL)) {
+		/* single leaf below the root : any key fits */
+		eb_pstore(node->key, new_key);
+		return node;
+	}
+
+	parent = eb_root_to_node(eb_untag(t, side));
+	if (parent->bit >= 0 ?
+	    ((node->key ^ new_key) >> parent->bit) == 0 :
+	    node->key == new_key) {
+		/* same side of the same split : the leaf does not move. No
+		 * other key in the tree shares the bits above the parent's,
+		 * so this cannot silently create a duplicate either.
+		 */
+		eb_pstore(node->key, new_key);
+		return node;
+	}
+
+	eb_delete(&node->node);
+	node->key = new_key;
+	return eb64_insert(root, node);
+}
+
 /*
  * Find the last occurrence of the highest key in the tree <root>, which is
  * equal to or less than <x>. NULL is returned is no key matches.
@@ -524,8 +586,10 @@ struct eb64_node *eb64_lookup_le(struct eb_root *root, uint64_t x)
 {
 	struct eb64_node *node;
 	eb_troot_t *troot;
+	int node_bit;
 
-	troot = root->b[EB_LEFT];
+ restart:
+	troot = eb_pload(root->b[EB_LEFT]);
 	if (unlikely(troot == NULL))
 		return NULL;
 
@@ -540,13 +604,14 @@ struct eb64_node *eb64_lookup_le(struct eb_root *root, uint64_t x)
 			if (node->key <= x)
 				return node;
 			/* return prev */
-			troot = node->node.leaf_p;
+			troot = eb_pload(node->node.leaf_p);
 			break;
 		}
 		node = container_of(eb_untag(troot, EB_NODE),
 				    struct eb64_node, node.branches);
+		node_bit = eb_pload(node->node.bit);
 
-		if (node->node.bit < 0) {
+		if (node_bit < 0) {
 			/* We're at the top of a dup tree. Either we got a
 			 * matching value and we return the rightmost node, or
 			 * we don't and we skip the whole subtree to return the
@@ -556,34 +621,36 @@ struct eb64_node *eb64_lookup_le(struct eb_root *root, uint64_t x)
 			 * tree.
 			 */
 			if (node->key <= x) {
-				troot = node->node.branches.b[EB_RGHT];
+				troot = eb_pload(node->node.branches.b[EB_RGHT]);
 				while (eb_gettag(troot) != EB_LEAF)
-					troot = (eb_untag(troot, EB_NODE))->b[EB_RGHT];
-				return container_of(eb_untag(troot, EB_LEAF),
+					troot = eb_pload((eb_untag(troot, EB_NODE))->b[EB_RGHT]);
+				node = container_of(eb_untag(troot, EB_LEAF),
 						    struct eb64_node, node.branches);
+				goto ret_node;
 			}
 			/* return prev */
-			troot = node->node.node_p;
+			troot = eb_pload(node->node.node_p);
 			break;
 		}
 
-		if (((x ^ node->key) >> node->node.bit) >= EB_NODE_BRANCHES) {
+		if (((x ^ node->key) >> node_bit) >= EB_NODE_BRANCHES) {
 			/* No more common bits at all. Either this node is too
 			 * small and we need to get its highest value, or it is
 			 * too large, and we need to get the prev value.
 			 */
-			if ((node->key >> node->node.bit) < (x >> node->node.bit)) {
-				troot = node->node.branches.b[EB_RGHT];
-				return eb64_entry(eb_walk_down(troot, EB_RGHT), struct eb64_node, node);
+			if ((node->key >> node_bit) < (x >> node_bit)) {
+				troot = eb_pload(node->node.branches.b[EB_RGHT]);
+				node = eb64_entry(eb_walk_down(troot, EB_RGHT), struct eb64_node, node);
+				goto ret_node;
 			}
 
 			/* Further values will be too high here, so return the prev
 			 * unique node (if it exists).
 			 */
-			troot = node->node.node_p;
+			troot = eb_pload(node->node.node_p);
 			break;
 		}
-		troot = node->node.branches.b[(x >> node->node.bit) & EB_NODE_BRANCH_MASK];
+		troot = eb_pload(node->node.branches.b[(x >> node_bit) & EB_NODE_BRANCH_MASK]);
 	}
 
 	/* If we get here, it means we want to report previous node before the
@@ -591,16 +658,31 @@ struct eb64_node *eb64_lookup_le(struct eb_root *root, uint64_t x)
 	 * the parent's branches.
 	 */
 	while (eb_gettag(troot) == EB_LEFT) {
+		/* A NULL parent here means the node we climbed from was just
+		 * detached by a concurrent writer, so the position we were
+		 * tracking does not exist anymore and we redo the lookup.
+		 */
+		if (unlikely(troot == NULL))
+			goto restart;
 		/* Walking up from left branch. We must ensure that we never
 		 * walk beyond root.
 		 */
-		if (unlikely(eb_clrtag((eb_untag(troot, EB_LEFT))->b[EB_RGHT]) == NULL))
+		if (unlikely(eb_clrtag(eb_pload((eb_untag(troot, EB_LEFT))->b[EB_RGHT])) == NULL))
 			return NULL;
-		troot = (eb_root_to_node(eb_untag(troot, EB_LEFT)))->node_p;
+		troot = eb_pload((eb_root_to_node(eb_untag(troot, EB_LEFT)))->node_p);
 	}
 	/* Note that <troot> cannot be NULL at this stage */
-	troot = (eb_untag(troot, EB_RGHT))->b[EB_LEFT];
+	troot = eb_pload((eb_untag(troot, EB_RGHT))->b[EB_LEFT]);
 	node = eb64_entry(eb_walk_down(troot, EB_RGHT), struct eb64_node, node);
+ ret_node:
+	/* The subtree we walked down may have been transplanted under us by
+	 * a concurrent writer, and then it may hold keys which do not match
+	 * the bounds we tracked during the descent, so we re-check the found
+	 * key and redo the lookup when it does not qualify. This never
+	 * triggers for the lock-protected walks.
+	 */
+	if (unlikely(!node || node->key > x))
+		goto restart;
 	return node;
 }
 
@@ -612,8 +694,10 @@ struct eb64_node *eb64_lookup_ge(struct eb_root *root, uint64_t x)
 {
 	struct eb64_node *node;
 	eb_troot_t *troot;
+	int node_bit;
 
-	troot = root->b[EB_LEFT];
+ restart:
+	troot = eb_pload(root->b[EB_LEFT]);
 	if (unlikely(troot == NULL))
 		return NULL;
 
@@ -628,13 +712,14 @@ struct eb64_node *eb64_lookup_ge(struct eb_root *root, uint64_t x)
 			if (node->key >= x)
 				return node;
 			/* return next */
-			troot = node->node.leaf_p;
+			troot = eb_pload(node->node.leaf_p);
 			break;
 		}
 		node = container_of(eb_untag(troot, EB_NODE),
 				    struct eb64_node, node.branches);
+		node_bit = eb_pload(node->node.bit);
 
-		if (node->node.bit < 0) {
+		if (node_bit < 0) {
 			/* We're at the top of a dup tree. Either we got a
 			 * matching value and we return the leftmost node, or
 			 * we don't and we skip the whole subtree to return the
@@ -644,34 +729,36 @@ struct eb64_node *eb64_lookup_ge(struct eb_root *root, uint64_t x)
 			 * tree.
 			 */
 			if (node->key >= x) {
-				troot = node->node.branches.b[EB_LEFT];
+				troot = eb_pload(node->node.branches.b[EB_LEFT]);
 				while (eb_gettag(troot) != EB_LEAF)
-					troot = (eb_untag(troot, EB_NODE))->b[EB_LEFT];
-				return container_of(eb_untag(troot, EB_LEAF),
+					troot = eb_pload((eb_untag(troot, EB_NODE))->b[EB_LEFT]);
+				node = container_of(eb_untag(troot, EB_LEAF),
 						    struct eb64_node, node.branches);
+				goto ret_node;
 			}
 			/* return next */
-			troot = node->node.node_p;
+			troot = eb_pload(node->node.node_p);
 			break;
 		}
 
-		if (((x ^ node->key) >> node->node.bit) >= EB_NODE_BRANCHES) {
+		if (((x ^ node->key) >> node_bit) >= EB_NODE_BRANCHES) {
 			/* No more common bits at all. Either this node is too
 			 * large and we need to get its lowest value, or it is too
 			 * small, and we need to get the next value.
 			 */
-			if ((node->key >> node->node.bit) > (x >> node->node.bit)) {
-				troot = node->node.branches.b[EB_LEFT];
-				return eb64_entry(eb_walk_down(troot, EB_LEFT), struct eb64_node, node);
+			if ((node->key >> node_bit) > (x >> node_bit)) {
+				troot = eb_pload(node->node.branches.b[EB_LEFT]);
+				node = eb64_entry(eb_walk_down(troot, EB_LEFT), struct eb64_node, node);
+				goto ret_node;
 			}
 
 			/* Further values will be too low here, so return the next
 			 * unique node (if it exists).
 			 */
-			troot = node->node.node_p;
+			troot = eb_pload(node->node.node_p);
 			break;
 		}
-		troot = node->node.branches.b[(x >> node->node.bit) & EB_NODE_BRANCH_MASK];
+		troot = eb_pload(node->node.branches.b[(x >> node_bit) & EB_NODE_BRANCH_MASK]);
 	}
 
 	/* If we get here, it means we want to report next node after the
@@ -680,13 +767,782 @@ struct eb64_node *eb64_lookup_ge(struct eb_root *root, uint64_t x)
 	 */
 	while (eb_gettag(troot) != EB_LEFT)
 		/* Walking up from right branch, so we cannot be below root */
-		troot = (eb_root_to_node(eb_untag(troot, EB_RGHT)))->node_p;
+		troot = eb_pload((eb_root_to_node(eb_untag(troot, EB_RGHT)))->node_p);
 
-	/* Note that <troot> cannot be NULL at this stage */
-	troot = (eb_untag(troot, EB_LEFT))->b[EB_RGHT];
+	/* A NULL here, which carries the EB_LEFT tag, means the node we
+	 * climbed from was just detached by a concurrent writer, so the
+	 * position we were tracking does not exist anymore and we redo
+	 * the lookup. This cannot happen to the lock-protected walks.
+	 */
+	if (unlikely(troot == NULL))
+		goto restart;
+
+	troot = eb_pload((eb_untag(troot, EB_LEFT))->b[EB_RGHT]);
 	if (eb_clrtag(troot) == NULL)
 		return NULL;
 
 	node = eb64_entry(eb_walk_down(troot, EB_LEFT), struct eb64_node, node);
+ ret_node:
+	/* The subtree we walked down may have been transplanted under us by
+	 * a concurrent writer, and then it may hold keys which do not match
+	 * the bounds we tracked during the descent, so we re-check the found
+	 * key and redo the lookup when it does not qualify. This never
+	 * triggers for the lock-protected walks.
+	 */
+	if (unlikely(!node || node->key < x))
+		goto restart;
 	return node;
 }
+
+/* In-order successor of <eb64>, with the hops of eb_next() and eb_walk_down()
+ * flattened here so that the range walk below does not pay two library calls
+ * per visited node.
+ */
+static inline struct eb64_node *__eb64_walk_next(struct eb64_node *eb64)
+{
+	eb_troot_t *t = eb64->node.leaf_p;
+
+	while (eb_gettag(t) != EB_LEFT)
+		/* Walking up from right branch, so we cannot be below root */
+		t = (eb_root_to_node(eb_untag(t, EB_RGHT)))->node_p;
+
+	/* Note that <t> cannot be NULL at this stage */
+	t = (eb_untag(t, EB_LEFT))->b[EB_RGHT];
+	if (eb_clrtag(t) == NULL)
+		return NULL;
+	while (eb_gettag(t) == EB_NODE)
+		t = (eb_untag(t, EB_NODE))->b[EB_LEFT];
+	return eb64_entry(eb_root_to_node(eb_untag(t, EB_LEAF)),
+			  struct eb64_node, node);
+}
+
+/* Visit in key order every node of tree <root> whose key lies within
+ * [<lo>, <hi>], both included, calling <cb> with the node and <ctx> for each.
+ * The walk stops early when <cb> returns non-zero. The successor is computed
+ * and prefetched before the callback runs, so its memory latency overlaps
+ * with the callback's work, and the per-node iteration cost stays inside this
+ * function instead of going through eb64_next() calls. The callback may
+ * safely delete the visited node (not any other one). Returns the number of
+ * nodes visited.
+ */
+size_t eb64_walk_range(struct eb_root *root, uint64_t lo, uint64_t hi,
+		       int (*cb)(struct eb64_node *node, void *ctx), void *ctx)
+{
+	struct eb64_node *node, *next;
+	size_t count = 0;
+
+	node = eb64_lookup_ge(root, lo);
+	while (node && node->key <= hi) {
+		next = __eb64_walk_next(node);
+		if (next)
+			__builtin_prefetch(next, 0);
+		count++;
+		if (cb(node, ctx) != 0)
+			break;
+		node = next;
+	}
+	return count;
+}
+
+#ifdef EB_AUGMENT
+/* Return the number of leaves in tree <root> whose key is strictly lower
+ * than <x>, in one descent, using the subtree counts maintained under
+ * EB_AUGMENT. Duplicates all count. eb64_select() applied to the result
+ * returns the first occurrence of <x> when it is present.
+ */
+unsigned int eb64_rank(struct eb_root *root, uint64_t x)
+{
+	struct eb64_node *node;
+	eb_troot_t *troot = root->b[EB_LEFT];
+	unsigned int rank = 0;
+
+	if (unlikely(troot == NULL))
+		return 0;
+
+	while (1) {
+		if (eb_gettag(troot) == EB_LEAF) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb64_node, node.branches);
+			return rank + (node->key < x);
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct eb64_node, node.branches);
+
+		if (node->node.bit < 0 ||
+		    ((x ^ node->key) >> node->node.bit) >= EB_NODE_BRANCHES) {
+			/* All the keys below diverge from <x> above this
+			 * node's bit (or all equal its key for a dup head),
+			 * so they all compare to <x> like the node's key.
+			 */
+			return rank + ((node->key < x) ? node->node.size : 0);
+		}
+
+		if ((x >> node->node.bit) & EB_NODE_BRANCH_MASK) {
+			/* going right : the whole left branch is lower */
+			rank += __eb_branch_size(node->node.branches.b[EB_LEFT]);
+			troot = node->node.branches.b[EB_RGHT];
+		}
+		else
+			troot = node->node.branches.b[EB_LEFT];
+	}
+}
+
+/* Return the <k>-th leaf of tree <root> in key order, zero-based, or NULL
+ * when the tree holds no more than <k> leaves. One descent, steered by the
+ * subtree counts maintained under EB_AUGMENT. Combined with eb_count(), this
+ * directly yields percentiles over a live tree.
+ */
+struct eb64_node *eb64_select(struct eb_root *root, unsigned int k)
+{
+	struct eb64_node *node;
+	eb_troot_t *troot = root->b[EB_LEFT];
+	unsigned int lcount;
+
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	while (1) {
+		if (eb_gettag(troot) == EB_LEAF) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb64_node, node.branches);
+			return k ? NULL : node;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct eb64_node, node.branches);
+		if (k >= node->node.size)
+			return NULL;
+
+		lcount = __eb_branch_size(node->node.branches.b[EB_LEFT]);
+		if (k < lcount)
+			troot = node->node.branches.b[EB_LEFT];
+		else {
+			k -= lcount;
+			troot = node->node.branches.b[EB_RGHT];
+		}
+	}
+}
+#endif /* EB_AUGMENT */
+
+/* Append node <new>, whose key is greater than or equal to every key currently
+ * in the tree, right of rightmost leaf <last> (NULL if the tree is empty).
+ * Instead of descending from the root, we climb the right spine from <last>
+ * until we find the node above which <new> diverges, which makes a sorted
+ * insertion stream O(1) amortized. Returns <new>, or the existing node if the
+ * key was already present in a unique tree.
+ */
+static struct eb64_node *__eb64_append(struct eb_root *root, struct eb64_node *last,
+				       struct eb64_node *new)
+{
+	struct eb_node *up;
+	struct eb_root *r;
+	eb_troot_t *t, *sub;
+	eb_troot_t *new_left, *new_rght, *new_leaf;
+	unsigned int side;
+	int newbit;
+
+	if (unlikely(!last)) {
+		/* Tree is empty, insert the leaf part below the left branch */
+		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
+		new->node.leaf_p = eb_dotag(root, EB_LEFT);
+		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	new_left = eb_dotag(&new->node.branches, EB_LEFT);
+	new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+	new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+
+	if (new->key == last->key) {
+		/* we may refuse to duplicate this key if the tree is
+		 * tagged as containing only unique keys.
+		 */
+		if (eb_gettag(root->b[EB_RGHT]))
+			return last;
+
+		/* Look for the head of the duplicate subtree <last> may
+		 * belong to. It is the highest node with a negative bit
+		 * above the leaf.
+		 */
+		up = NULL;
+		t = last->node.leaf_p;
+		while (1) {
+			side = eb_gettag(t);
+			r = eb_untag(t, side);
+			if (eb_clrtag(r->b[EB_RGHT]) == NULL)
+				break; /* reached the tree root */
+			if (eb_root_to_node(r)->bit >= 0)
+				break;
+			up = eb_root_to_node(r);
+			t = up->node_p;
+		}
+
+		if (up) {
+			struct eb_node *ret;
+			ret = eb_insert_dup(up, &new->node);
+			return container_of(ret, struct eb64_node, node);
+		}
+
+		/* <last> is alone, add the new key next to it as a first
+		 * duplicate, on the right.
+		 */
+		t = last->node.leaf_p;
+		new->node.node_p = t;
+		new->node.leaf_p = new_rght;
+		last->node.leaf_p = new_left;
+		new->node.branches.b[EB_LEFT] = eb_dotag(&last->node.branches, EB_LEAF);
+		new->node.branches.b[EB_RGHT] = new_leaf;
+		new->node.bit = -1;
+		side = eb_gettag(t);
+		eb_untag(t, side)->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+		EB_SIZE_LINK(&new->node);
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	/* <new> is strictly greater than every key in the tree. All keys in
+	 * the subtree we will displace share the bits above <newbit> with
+	 * <last>, so comparing against <last> is enough.
+	 */
+	newbit = fls64(new->key ^ last->key) - EB_NODE_BITS;
+
+	t = last->node.leaf_p;
+	while (1) {
+		side = eb_gettag(t);
+		r = eb_untag(t, side);
+		if (eb_clrtag(r->b[EB_RGHT]) == NULL)
+			break; /* reached the tree root */
+		if (eb_root_to_node(r)->bit >= newbit)
+			break;
+		t = eb_root_to_node(r)->node_p;
+	}
+
+	/* Insert above the branch we climbed from : the displaced subtree
+	 * goes to the left of <new> and the new leaf to the right.
+	 */
+	sub = r->b[side];
+	new->node.branches.b[EB_LEFT] = sub;
+	new->node.branches.b[EB_RGHT] = new_leaf;
+	new->node.leaf_p = new_rght;
+	new->node.node_p = t;
+	new->node.bit = newbit;
+
+	if (eb_gettag(sub) == EB_LEAF)
+		eb_root_to_node(eb_untag(sub, EB_LEAF))->leaf_p = new_left;
+	else
+		eb_root_to_node(eb_untag(sub, EB_NODE))->node_p = new_left;
+
+	r->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_SIZE_LINK(&new->node);
+	EB_THR_LINK(&new->node);
+	return new;
+}
+
+/* Build a tree from <n> nodes pre-sorted by ascending key, in a single linear
+ * pass instead of one full root-to-leaf descent per key. The tree must either
+ * be empty or only contain keys lower than or equal to the first key of the
+ * array. Only the keys need be set in the nodes. Returns the number of nodes
+ * actually linked; in a unique tree, duplicates are skipped and marked
+ * unlinked (NULL leaf_p), like a regular refused insertion.
+ */
+unsigned int eb64_load_sorted(struct eb_root *root, struct eb64_node * const *nodes,
+			      unsigned int n)
+{
+	struct eb64_node *last;
+	unsigned int i, count = 0;
+
+	last = eb64_last(root);
+	for (i = 0; i < n; i++) {
+		if (__eb64_append(root, last, nodes[i]) != nodes[i]) {
+			nodes[i]->node.leaf_p = NULL; /* mark unlinked */
+			continue;
+		}
+		last = nodes[i];
+		count++;
+	}
+	return count;
+}
+
+/* Clone tree <src>, whose items are <item_size> bytes each with their
+ * eb64_node located <node_off> bytes inside, into the caller-provided buffer
+ * <arena> of <arena_size> bytes, linking the copies into tree <dst> which
+ * must be empty. The items are copied in a single in-order walk and laid out
+ * sequentially in key order, so the clone is at once a point-in-time snapshot
+ * of <src> and a layout which walks and descents traverse mostly
+ * sequentially : writers only need to be held off for the duration of this
+ * call instead of a whole report over the tree. If <dst> is tagged unique,
+ * duplicates of <src> are skipped like refused insertions. Returns the number
+ * of items cloned, or -1 if the arena is too small to receive them all, in
+ * which case <dst> is left untouched.
+ */
+int eb64_clone(struct eb_root *src, struct eb_root *dst, void *arena,
+	       size_t arena_size, size_t item_size, size_t node_off)
+{
+	struct eb64_node *node, *last, *new;
+	char *pos = arena;
+	size_t count = 0;
+	int linked = 0;
+
+	/* reserve the room upfront so that no failure may happen once the
+	 * copy has started
+	 */
+	for (node = eb64_first(src); node; node = eb64_next(node))
+		count++;
+	if (count * item_size > arena_size)
+		return -1;
+
+	last = NULL;
+	for (node = eb64_first(src); node; node = eb64_next(node)) {
+		memcpy(pos, (const char *)node - node_off, item_size);
+		new = (struct eb64_node *)(pos + node_off);
+		if (__eb64_append(dst, last, new) != new)
+			continue; /* duplicate refused by a unique <dst> */
+		last = new;
+		pos += item_size;
+		linked++;
+	}
+	return linked;
+}
+
+/* Move the node part stored in <old> into the free storage <spare>, fixing
+ * its parent slot and the parent pointers of both of its branches. This is
+ * used when the storage serving a live node part belongs to a leaf being
+ * detached from the tree.
+ */
+static void eb64_transplant_node(struct eb_node *old, struct eb_node *spare)
+{
+	eb_troot_t *t;
+	unsigned int side;
+
+	spare->branches = old->branches;
+	spare->bit = old->bit;
+	spare->node_p = old->node_p;
+
+	t = spare->node_p;
+	side = eb_gettag(t);
+	eb_untag(t, side)->b[side] = eb_dotag(&spare->branches, EB_NODE);
+
+	for (side = 0; side <= 1; side++) {
+		t = spare->branches.b[side];
+		if (eb_gettag(t) == EB_LEAF)
+			eb_root_to_node(eb_untag(t, EB_LEAF))->leaf_p =
+				eb_dotag(&spare->branches, side);
+		else
+			eb_root_to_node(eb_untag(t, EB_NODE))->node_p =
+				eb_dotag(&spare->branches, side);
+	}
+}
+
+/* Append all the leaves of detached subtree <troot> to the chain defined by
+ * <head>/<tail>, in ascending key order. The chain is linked through the
+ * node_p field and the leaves are marked unlinked (NULL leaf_p). The node
+ * parts found inside the subtree are marked unused since they leave with it.
+ * At most one leaf of the subtree may have its storage serving a node part
+ * which remains in the tree; it is then re-homed into <spare>, the storage
+ * freed by the splice which detached the subtree. <spare> is NULL when the
+ * whole tree is being detached, in which case no node part can remain.
+ * Returns the storage which was re-homed into <spare>, or NULL.
+ */
+static struct eb_node *eb64_chain_subtree(eb_troot_t *troot, struct eb_node *spare,
+					struct eb64_node **head, struct eb64_node **tail)
+{
+	/* A subtree may not be deeper than one level per key bit plus one
+	 * level per dup tree stage, whose count is also bounded by the number
+	 * of key bits.
+	 */
+	eb_troot_t *stack[2 * 64 + 4];
+	struct eb64_node *seg, *segtail, *node, *next;
+	struct eb_node *moved = NULL;
+	int sp = 0;
+
+	seg = segtail = NULL;
+	stack[sp++] = troot;
+	while (sp) {
+		eb_troot_t *t = stack[--sp];
+
+		if (eb_gettag(t) == EB_NODE) {
+			struct eb_node *n = eb_root_to_node(eb_untag(t, EB_NODE));
+
+			/* this node part leaves with the subtree, mark its
+			 * storage unused so that its owner is not mistaken
+			 * for one serving a remaining node part.
+			 */
+			n->node_p = NULL;
+			stack[sp++] = n->branches.b[EB_RGHT];
+			stack[sp++] = n->branches.b[EB_LEFT];
+			continue;
+		}
+
+		/* pushing the right branch before the left one makes the
+		 * leaves pop in ascending key order.
+		 */
+		node = container_of(eb_untag(t, EB_LEAF),
+				    struct eb64_node, node.branches);
+		if (segtail)
+			segtail->node.leaf_p = (eb_troot_t *)node;
+		else
+			seg = node;
+		segtail = node;
+		node->node.leaf_p = NULL;
+	}
+
+	/* Second pass on the new segment : the only leaf whose storage still
+	 * serves a node part in the tree (if any) gets it moved to <spare>,
+	 * then the chain is converted to its exported form.
+	 */
+	for (node = seg; node; node = next) {
+		next = (struct eb64_node *)node->node.leaf_p;
+		if (node->node.node_p && spare) {
+			eb64_transplant_node(&node->node, spare);
+			moved = &node->node;
+			spare = NULL;
+		}
+		node->node.leaf_p = NULL;
+		node->node.node_p = (eb_troot_t *)next;
+	}
+
+	if (*tail)
+		(*tail)->node.node_p = (eb_troot_t *)seg;
+	else
+		*head = seg;
+	*tail = segtail;
+	return moved;
+}
+
+/* Detach branch <side> of node part <m> along with all the leaves it holds,
+ * replace <m> by its other branch in its parent slot, and append the detached
+ * leaves to the chain. <m>'s storage is freed by the operation and serves to
+ * re-home a possibly remaining node part owned by a detached leaf, in which
+ * case the node part's previous storage is returned so that the caller can
+ * refresh any pointer it would keep to it.
+ */
+static struct eb_node *eb64_detach_branch(struct eb_node *m, unsigned int side,
+					struct eb64_node **head, struct eb64_node **tail)
+{
+	eb_troot_t *t = m->branches.b[side];
+	eb_troot_t *other = m->branches.b[!side];
+	unsigned int upside = eb_gettag(m->node_p);
+	struct eb_root *up = eb_untag(m->node_p, upside);
+
+	up->b[upside] = other;
+	if (eb_gettag(other) == EB_LEAF)
+		eb_root_to_node(eb_untag(other, EB_LEAF))->leaf_p =
+			eb_dotag(up, upside);
+	else
+		eb_root_to_node(eb_untag(other, EB_NODE))->node_p =
+			eb_dotag(up, upside);
+
+	m->node_p = NULL; /* <m>'s storage is now free */
+	return eb64_chain_subtree(t, m, head, tail);
+}
+
+/* Detach from the tree, in a single operation, all the leaves whose key is
+ * lower than or equal to <x>, and return them chained in ascending key order,
+ * to be walked with eb64_chain_next(). The nodes are marked unlinked exactly
+ * as eb64_delete() would, so they may be freed or reinserted by the caller.
+ * Whole subtrees are cut along the descent path, which makes the operation
+ * O(K + log N) for K expired keys instead of K full descents.
+ */
+struct eb64_node *eb64_delete_le(struct eb_root *root, uint64_t x)
+{
+	struct eb64_node *head = NULL, *tail = NULL;
+	struct eb64_node *node, *last;
+	struct eb_root *r;
+	eb_troot_t *t;
+	unsigned int side;
+	uint64_t left_max, mask;
+
+	if (unlikely(root->b[EB_LEFT] == NULL))
+		return NULL;
+
+	last = eb64_last(root);
+	if (last->key <= x) {
+		/* everything expires at once, the tree simply becomes empty */
+		t = root->b[EB_LEFT];
+		root->b[EB_LEFT] = NULL;
+		eb64_chain_subtree(t, NULL, &head, &tail);
+		return head;
+	}
+
+	/* From now on at least one leaf remains, so every detached branch
+	 * hangs below a node which can be spliced out.
+	 */
+	r = root;
+	side = EB_LEFT;
+	while (1) {
+		t = r->b[side];
+		if (eb_gettag(t) == EB_LEAF) {
+			node = container_of(eb_untag(t, EB_LEAF),
+					    struct eb64_node, node.branches);
+			if (node->key > x)
+				break;
+			/* last expired leaf; <r> cannot be the root here
+			 * since at least one leaf remains.
+			 */
+			eb64_detach_branch(eb_root_to_node(r), side, &head, &tail);
+			break;
+		}
+
+		node = container_of(eb_untag(t, EB_NODE),
+				    struct eb64_node, node.branches);
+
+		if (node->node.bit < 0) {
+			/* dup tree : all of its keys are equal to its owner's */
+			if (node->key > x)
+				break;
+			eb64_detach_branch(eb_root_to_node(r), side, &head, &tail);
+			break;
+		}
+
+		/* highest key of the left branch, based on the prefix this
+		 * subtree shares with the node's owner.
+		 */
+		mask = ((uint64_t)2 << node->node.bit) - 1;
+		left_max = (node->key & ~mask) | (mask >> 1);
+
+		if (left_max <= x) {
+			/* the whole left branch expires; cut it, splice the
+			 * node out and go on with its promoted right branch,
+			 * which may still hold expired keys. If the node part
+			 * owning our current slot was re-homed into the
+			 * spliced storage, follow it there.
+			 */
+			struct eb_node *moved;
+
+			moved = eb64_detach_branch(&node->node, EB_LEFT, &head, &tail);
+			if (moved && r == &moved->branches)
+				r = &node->node.branches;
+			if (left_max == x)
+				break; /* right branch is entirely above <x> */
+			continue;
+		}
+		/* only the left branch may hold expired keys */
+		r = &node->node.branches;
+		side = EB_LEFT;
+	}
+#ifdef EB_THREADED
+	/* the detached leaves form a prefix of the key order : disconnect the
+	 * neighbor thread at the boundary with the remaining leaves.
+	 */
+	if (tail) {
+		if (tail->node.thr_next)
+			tail->node.thr_next->thr_prev = NULL;
+		tail->node.thr_next = NULL;
+	}
+#endif
+	return head;
+}
+
+/* Return the node following <node> in a chain returned by eb64_delete_le(),
+ * or NULL once the chain is exhausted.
+ */
+struct eb64_node *eb64_chain_next(struct eb64_node *node)
+{
+	return (struct eb64_node *)node->node.node_p;
+}
+
+/* Look up the <n> keys from array <keys> and store the resulting nodes into
+ * array <results> (NULL when a key is not found, the first duplicate
+ * otherwise, as with eb64_lookup). Up to 8 descents are interleaved and each
+ * one prefetches its next branch while the others make progress, so that the
+ * memory latencies of independent lookups overlap instead of adding up. This
+ * considerably helps on trees larger than the cache.
+ */
+void eb64_lookup_multi(struct eb_root *root, const uint64_t *keys,
+		       struct eb64_node **results, unsigned int n)
+{
+	struct {
+		eb_troot_t *troot;
+		unsigned int idx;
+	} st[8];
+	unsigned int nb, next, slot;
+
+	if (unlikely(root->b[EB_LEFT] == NULL)) {
+		for (next = 0; next < n; next++)
+			results[next] = NULL;
+		return;
+	}
+
+	/* prime the pipeline */
+	nb = 0;
+	next = 0;
+	while (nb < 8 && next < n) {
+		st[nb].troot = root->b[EB_LEFT];
+		st[nb].idx = next++;
+		nb++;
+	}
+
+	slot = 0;
+	while (nb) {
+		eb_troot_t *troot = st[slot].troot;
+		uint64_t x = keys[st[slot].idx];
+		struct eb64_node *node, *res;
+		uint64_t y;
+		int done = 0;
+
+		if (eb_gettag(troot) == EB_LEAF) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb64_node, node.branches);
+			res = (node->key == x) ? node : NULL;
+			done = 1;
+		} else {
+			node = container_of(eb_untag(troot, EB_NODE),
+					    struct eb64_node, node.branches);
+			y = node->key ^ x;
+			if (!y && node->node.bit >= 0) {
+				/* the node part's owner holds the key */
+				res = node;
+				done = 1;
+			} else if (!y) {
+				/* dup tree, walk down left to the first leaf */
+				troot = node->node.branches.b[EB_LEFT];
+			} else if ((y >> node->node.bit) >= EB_NODE_BRANCHES) {
+				res = NULL; /* no more common bits */
+				done = 1;
+			} else {
+				troot = node->node.branches.b[(x >> node->node.bit) & EB_NODE_BRANCH_MASK];
+			}
+
+			if (!done) {
+				__builtin_prefetch(eb_untag(troot, eb_gettag(troot)), 0);
+				st[slot].troot = troot;
+			}
+		}
+
+		if (done) {
+			results[st[slot].idx] = res;
+			if (next < n) {
+				/* refill the slot with the next pending key */
+				st[slot].troot = root->b[EB_LEFT];
+				st[slot].idx = next++;
+			} else {
+				nb--;
+				st[slot] = st[nb];
+			}
+		}
+
+		slot++;
+		if (slot >= nb)
+			slot = 0;
+	}
+}
+
+/* Recursively fill the frozen entries in in-order sequence of the Eytzinger
+ * layout, so that slot <k>'s subtree receives consecutive keys. <node> is the
+ * next tree node to consume, and the one following the filled subtree is
+ * returned.
+ */
+static struct eb64_node *eb64_freeze_fill(struct eb64_frozen *frz, size_t k,
+					  struct eb64_node *node)
+{
+	if (k > frz->count)
+		return node;
+	node = eb64_freeze_fill(frz, k * 2, node);
+	frz->entries[k].key = node->key;
+	frz->entries[k].data = node;
+	node = eb64_next(node);
+	return eb64_freeze_fill(frz, k * 2 + 1, node);
+}
+
+/* Convert the tree <root> into the read-only frozen form <frz> : a
+ * contiguous, pointer-free array of 16-byte {key, data} entries in 1-based
+ * breadth-first (Eytzinger) order, where data points to the original node.
+ * The tree becomes empty and its nodes are marked unlinked but must be
+ * preserved by the caller until eb64_thaw() rebuilds the tree from them
+ * (or eb64_frozen_release() drops the index). Lookups in the frozen form
+ * walk a branch-free array instead of chasing pointers. Returns 0 on
+ * success, -1 on allocation failure, in which case the tree is untouched.
+ */
+int eb64_freeze(struct eb_root *root, struct eb64_frozen *frz)
+{
+	struct eb64_node *node;
+	size_t count = 0;
+
+	for (node = eb64_first(root); node; node = eb64_next(node))
+		count++;
+
+	frz->count = count;
+	frz->entries = NULL;
+	if (!count)
+		return 0;
+
+	frz->entries = malloc((count + 1) * sizeof(*frz->entries));
+	if (!frz->entries)
+		return -1;
+
+	eb64_freeze_fill(frz, 1, eb64_first(root));
+
+	for (count = 1; count <= frz->count; count++)
+		((struct eb64_node *)frz->entries[count].data)->node.leaf_p = NULL;
+	root->b[EB_LEFT] = NULL;
+	return 0;
+}
+
+/* Return the node carrying the lowest key greater than or equal to <x> in
+ * the frozen index <frz>, or NULL if none. Each round halves the candidate
+ * range with a single predictable access pattern, and equal keys are
+ * returned in insertion order like eb64_lookup_ge().
+ */
+struct eb64_node *eb64_frozen_lookup_ge(const struct eb64_frozen *frz, uint64_t x)
+{
+	size_t k = 1, res = 0;
+
+	while (k <= frz->count) {
+		if (frz->entries[k].key >= x) {
+			res = k;
+			k = k * 2;
+		} else {
+			k = k * 2 + 1;
+		}
+	}
+	return res ? frz->entries[res].data : NULL;
+}
+
+/* Return the node carrying key <x> in the frozen index <frz> (the first one
+ * in case of duplicates), or NULL if none.
+ */
+struct eb64_node *eb64_frozen_lookup(const struct eb64_frozen *frz, uint64_t x)
+{
+	struct eb64_node *node = eb64_frozen_lookup_ge(frz, x);
+
+	return (node && node->key == x) ? node : NULL;
+}
+
+/* Relink the nodes of slot <k>'s subtree into <root> in ascending key order,
+ * keeping track of the rightmost linked node in <last>.
+ */
+static void eb64_thaw_walk(struct eb_root *root, const struct eb64_frozen *frz,
+			   size_t k, struct eb64_node **last)
+{
+	struct eb64_node *node;
+
+	if (k > frz->count)
+		return;
+	eb64_thaw_walk(root, frz, k * 2, last);
+	node = frz->entries[k].data;
+	if (__eb64_append(root, *last, node) == node)
+		*last = node;
+	else
+		node->node.leaf_p = NULL; /* refused duplicate in a unique tree */
+	eb64_thaw_walk(root, frz, k * 2 + 1, last);
+}
+
+/* Rebuild the mutable tree <root>, which must be empty, from the frozen
+ * index <frz>, and release the index. Since the frozen entries are already
+ * in key order, the nodes are relinked in a single linear pass.
+ */
+void eb64_thaw(struct eb_root *root, struct eb64_frozen *frz)
+{
+	struct eb64_node *last = NULL;
+
+	eb64_thaw_walk(root, frz, 1, &last);
+	eb64_frozen_release(frz);
+}
+
+/* Release the frozen index <frz> without relinking its nodes. */
+void eb64_frozen_release(struct eb64_frozen *frz)
+{
+	free(frz->entries);
+	frz->entries = NULL;
+	frz->count = 0;
+}
@@ -11,7 +11,9 @@
 #define _EB64TREE_H
 
 #include "ebtree.h"
+#include "ebstats.h"
 #include <stdint.h>
+#include <limits.h>
 
 #define EB64_ROOT	EB_ROOT
 #define EB64_TREE_HEAD	EB_TREE_HEAD
@@ -32,6 +34,12 @@ struct eb64_node {
  * are generally called at most once or twice in a program.
  */
 
+/* The hottest functions are also provided as static inline definitions at the
+ * end of this file when EB_INLINE is defined, so that call sites avoid the PLT
+ * indirection of the shared library and the descents can specialize into their
+ * callers (see the __eb64_lookup() block).
+ */
+#ifndef EB_INLINE
 /* Return leftmost node in the tree, or NULL if none */
 extern struct eb64_node *eb64_first(struct eb_root *root);
 
@@ -43,6 +51,7 @@ extern struct eb64_node *eb64_next(struct eb64_node *eb64);
 
 /* Return previous node in the tree, or NULL if none */
 extern struct eb64_node *eb64_prev(struct eb64_node *eb64);
+#endif
 
 /* Return next node in the tree, skipping duplicates, or NULL if none */
 extern struct eb64_node *eb64_next_unique(struct eb64_node *eb64);
@@ -58,7 +67,9 @@ extern void eb64_delete(struct eb64_node *eb64);
  * return NULL.
  */
 
+#ifndef EB_INLINE
 extern struct eb64_node *eb64_lookup(struct eb_root *root, uint64_t x);
+#endif
 
 /*
  * Find the first occurence of a signed key in the tree <root>. If none can
@@ -86,7 +97,9 @@ extern struct eb64_node *eb64_lookup_ge(struct eb_root *root, uint64_t x);
  * If root->b[EB_RGHT]==1, the tree may only contain unique keys.
  */
 
+#ifndef EB_INLINE
 extern struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new);
+#endif
 
 /* Insert eb64_node <new> into subtree starting at node root <root>, using
  * signed keys. Only new->key needs be set with the key. The eb64_node
@@ -95,4 +108,444 @@ extern struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new
 
 extern struct eb64_node *eb64i_insert(struct eb_root *root, struct eb64_node *new);
 
+/* Insert eb64_node <new> into cached tree <root>, maintaining the cached
+ * extremum pointers. Only new->key needs be set with the key. The eb64_node
+ * is returned.
+ */
+
+extern struct eb64_node *eb64_insert_cached(struct eb_root_cached *root, struct eb64_node *new);
+
+/* Append duplicate <new> right after <tail>, which must be the last entry
+ * inserted with the same key (typically the node returned by the previous
+ * insert or append of that key), in amortized constant time. FIFO walk order
+ * of the duplicates is preserved. Falls back to a regular insert when <tail>
+ * does not apply.
+ */
+
+extern struct eb64_node *eb64_append_dup(struct eb_root *root, struct eb64_node *tail, struct eb64_node *new);
+
+/* Insert eb64_node <new> into tree <root>, starting the descent from leaf
+ * <hint> instead of the root. <hint> should carry a key close to new->key,
+ * typically the node returned by the previous insertion, which makes sorted
+ * or locally-clustered insertion streams amortized constant time. Falls back
+ * to a regular insert when <hint> does not help. Same return convention as
+ * eb64_insert().
+ */
+extern struct eb64_node *eb64_insert_hint(struct eb_root *root, struct eb64_node *hint, struct eb64_node *new);
+
+/* Change the key of <node>, linked in tree <root>, to <new_key>. When the new
+ * key keeps the leaf in its current position (a small delta usually does),
+ * this is a single store ; otherwise the node is deleted and re-inserted.
+ * Returns the node holding <new_key>, which only differs from <node> when the
+ * tree holds unique keys and <new_key> was already there.
+ */
+extern struct eb64_node *eb64_update(struct eb_root *root, struct eb64_node *node, uint64_t new_key);
+
+/* Visit in key order every node of tree <root> whose key lies within
+ * [<lo>, <hi>], both included, calling <cb> with the node and <ctx> for each.
+ * The walk stops early when <cb> returns non-zero, and the next node is
+ * prefetched before the callback runs. The callback may safely delete the
+ * visited node. Returns the number of nodes visited.
+ */
+extern size_t eb64_walk_range(struct eb_root *root, uint64_t lo, uint64_t hi,
+			      int (*cb)(struct eb64_node *node, void *ctx), void *ctx);
+
+#ifdef EB_AUGMENT
+/* Order statistics over the subtree counts maintained under EB_AUGMENT (see
+ * ebtree.h). eb64_rank() returns the number of leaves whose key is strictly
+ * lower than <x> ; eb64_select() returns the <k>-th leaf in key order,
+ * zero-based, or NULL when fewer than <k>+1 leaves exist. Both are a single
+ * descent. The total leaf count is given by eb_count().
+ */
+extern unsigned int eb64_rank(struct eb_root *root, uint64_t x);
+extern struct eb64_node *eb64_select(struct eb_root *root, unsigned int k);
+#endif
+
+/* Build a tree from <n> nodes pre-sorted by ascending key, in a single linear
+ * pass. The tree must either be empty or only contain keys lower than or
+ * equal to the first key of the array. Returns the number of nodes actually
+ * linked.
+ */
+
+extern unsigned int eb64_load_sorted(struct eb_root *root, struct eb64_node * const *nodes, unsigned int n);
+
+/* Deep copy tree <src>, whose items are <item_size> bytes each with their
+ * eb64_node located <node_off> bytes inside, into the caller-provided buffer
+ * <arena> of <arena_size> bytes, linking the copies in key order into the
+ * empty tree <dst>. Returns the number of items cloned, or -1 if the arena
+ * is too small.
+ */
+
+extern int eb64_clone(struct eb_root *src, struct eb_root *dst, void *arena, size_t arena_size, size_t item_size, size_t node_off);
+
+/* Look up the <n> keys of <keys> and store the resulting nodes into
+ * <results> (NULL when not found, the first duplicate otherwise). Up to 8
+ * descents are interleaved so that their memory latencies overlap.
+ */
+
+extern void eb64_lookup_multi(struct eb_root *root, const uint64_t *keys, struct eb64_node **results, unsigned int n);
+
+/* Detach all the leaves whose key is lower than or equal to <x> in a single
+ * operation, and return them chained in ascending key order, to be walked
+ * with eb64_chain_next(). The nodes are marked unlinked exactly as
+ * eb64_delete() would.
+ */
+
+extern struct eb64_node *eb64_delete_le(struct eb_root *root, uint64_t x);
+
+/* Return the node following <node> in a chain returned by eb64_delete_le(),
+ * or NULL once the chain is exhausted.
+ */
+
+extern struct eb64_node *eb64_chain_next(struct eb64_node *node);
+
+/* One entry of a frozen tree : just the key and the pointer to the original
+ * node, 16 bytes instead of a full eb64_node.
+ */
+struct eb64_frozen_entry {
+	uint64_t key;
+	void *data;
+};
+
+/* A frozen (read-only) tree : a contiguous array of entries in 1-based
+ * breadth-first (Eytzinger) order, built by eb64_freeze(). Entry 0 is unused.
+ */
+struct eb64_frozen {
+	size_t count;
+	struct eb64_frozen_entry *entries;
+};
+
+/* Convert tree <root> into the frozen form <frz>, emptying the tree. The
+ * nodes must be preserved until eb64_thaw() relinks them. Returns 0 on
+ * success, -1 on allocation failure.
+ */
+
+extern int eb64_freeze(struct eb_root *root, struct eb64_frozen *frz);
+
+/* Return the node carrying key <x> in the frozen index (first duplicate),
+ * or NULL if none.
+ */
+
+extern struct eb64_node *eb64_frozen_lookup(const struct eb64_frozen *frz, uint64_t x);
+
+/* Return the node carrying the lowest key greater than or equal to <x> in
+ * the frozen index, or NULL if none.
+ */
+
+extern struct eb64_node *eb64_frozen_lookup_ge(const struct eb64_frozen *frz, uint64_t x);
+
+/* Rebuild the empty tree <root> from the frozen index <frz> in a single
+ * linear pass, and release the index.
+ */
+
+extern void eb64_thaw(struct eb_root *root, struct eb64_frozen *frz);
+
+/* Release the frozen index <frz> without relinking its nodes. */
+
+extern void eb64_frozen_release(struct eb64_frozen *frz);
+
+/* The bodies of eb64_lookup() and eb64_insert() live here so that, with
+ * EB_INLINE defined, call sites get static inline definitions of the public
+ * names : the descents then inline and specialize into their callers (a
+ * known-unique tree loses its duplicate branches, for instance) instead of
+ * paying a PLT call into the shared library. The exported functions of
+ * eb64tree.c are thin wrappers around these, so both flavours always behave
+ * identically. Code meant to stay binary-compatible with the library (eg the
+ * D bindings) must not define EB_INLINE.
+ */
+
+/*
+ * Find the first occurence of a key in the tree <root>. If none can be
+ * found, return NULL.
+ */
+static forceinline struct eb64_node *__eb64_lookup(struct eb_root *root, uint64_t x)
+{
+	struct eb64_node *node;
+	eb_troot_t *troot;
+	uint64_t y;
+	int node_bit;
+
+	EB_STATS_DESCENT(root);
+
+ restart:
+	troot = eb_pload(root->b[EB_LEFT]);
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	while (1) {
+		EB_STATS_DOWN();
+		if ((eb_gettag(troot) == EB_LEAF)) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb64_node, node.branches);
+			EB_STATS_LOOKUP();
+			if (node->key == x)
+				return node;
+			else
+				return NULL;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct eb64_node, node.branches);
+		node_bit = eb_pload(node->node.bit);
+
+		y = node->key ^ x;
+		if (!y) {
+			/* Either we found the node which holds the key, or
+			 * we have a dup tree. In the later case, we have to
+			 * walk it down left to get the first entry.
+			 */
+			if (node_bit < 0) {
+				troot = eb_pload(node->node.branches.b[EB_LEFT]);
+				while (eb_gettag(troot) != EB_LEAF)
+					troot = eb_pload((eb_untag(troot, EB_NODE))->b[EB_LEFT]);
+				node = container_of(eb_untag(troot, EB_LEAF),
+						    struct eb64_node, node.branches);
+				/* the subtree may have been transplanted under
+				 * us by a concurrent writer, in which case the
+				 * leaf we landed on does not carry our key and
+				 * we redo the lookup.
+				 */
+				if (unlikely(node->key != x))
+					goto restart;
+			}
+			EB_STATS_LOOKUP();
+			return node;
+		}
+
+		if ((y >> node_bit) >= EB_NODE_BRANCHES) {
+			EB_STATS_LOOKUP();
+			return NULL; /* no more common bits */
+		}
+
+		troot = eb_pload(node->node.branches.b[(x >> node_bit) & EB_NODE_BRANCH_MASK]);
+	}
+}
+
+/* Insert eb64_node <new> into subtree starting at node root <root>.
+ * Only new->key needs be set with the key. The eb64_node is returned.
+ * If root->b[EB_RGHT]==1, the tree may only contain unique keys.
+ */
+static forceinline struct eb64_node *__eb64_insert(struct eb_root *root, struct eb64_node *new) {
+	struct eb64_node *old;
+	unsigned int side;
+	eb_troot_t *troot;
+	uint64_t newkey; /* caching the key saves approximately one cycle */
+	eb_troot_t *root_right = root;
+	int old_node_bit;
+
+	EB_STATS_DESCENT(root);
+
+	side = EB_LEFT;
+	troot = root->b[EB_LEFT];
+	root_right = root->b[EB_RGHT];
+	if (unlikely(troot == NULL)) {
+		/* Tree is empty, insert the leaf part below the left branch.
+		 * The node is fully initialized before the branch is published
+		 * so that a lockless reader never sees a partial node.
+		 */
+		new->node.leaf_p = eb_dotag(root, EB_LEFT);
+		new->node.node_p = NULL; /* node part unused */
+		eb_pstore(root->b[EB_LEFT], eb_dotag(&new->node.branches, EB_LEAF));
+		EB_STATS_INSERT();
+		EB_SIZE_LINK(&new->node);
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	/* The tree descent is fairly easy :
+	 *  - first, check if we have reached a leaf node
+	 *  - second, check if we have gone too far
+	 *  - third, reiterate
+	 * Everywhere, we use <new> for the node node we are inserting, <root>
+	 * for the node we attach it to, and <old> for the node we are
+	 * displacing below <new>. <troot> will always point to the future node
+	 * (tagged with its type). <side> carries the side the node <new> is
+	 * attached to below its parent, which is also where previous node
+	 * was attached. <newkey> carries the key being inserted.
+	 */
+	newkey = new->key;
+
+	while (1) {
+		EB_STATS_DOWN();
+		if (unlikely(eb_gettag(troot) == EB_LEAF)) {
+			eb_troot_t *new_left, *new_rght;
+			eb_troot_t *new_leaf, *old_leaf;
+
+			old = container_of(eb_untag(troot, EB_LEAF),
+					    struct eb64_node, node.branches);
+
+			new_left = eb_dotag(&new->node.branches, EB_LEFT);
+			new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+			new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+			old_leaf = eb_dotag(&old->node.branches, EB_LEAF);
+
+			new->node.node_p = old->node.leaf_p;
+
+			/* Right here, we have 3 possibilities :
+			   - the tree does not contain the key, and we have
+			     new->key < old->key. We insert new above old, on
+			     the left ;
+
+			   - the tree does not contain the key, and we have
+			     new->key > old->key. We insert new above old, on
+			     the right ;
+
+			   - the tree does contain the key, which implies it
+			     is alone. We add the new key next to it as a
+			     first duplicate.
+
+			   The last two cases can easily be partially merged.
+
+			   In all cases, <new>'s branches are set before
+			   <old>'s parent is re-pointed at them, because a
+			   lockless reader climbing from <old> may cross them
+			   before the node is even published in the tree.
+			*/
+
+			if (new->key < old->key) {
+				new->node.leaf_p = new_left;
+				new->node.branches.b[EB_LEFT] = new_leaf;
+				new->node.branches.b[EB_RGHT] = old_leaf;
+				eb_pstore(old->node.leaf_p, new_rght);
+			} else {
+				/* we may refuse to duplicate this key if the tree is
+				 * tagged as containing only unique keys.
+				 */
+				if ((new->key == old->key) && eb_gettag(root_right))
+					return old;
+
+				/* new->key >= old->key, new goes the right */
+				new->node.leaf_p = new_rght;
+				new->node.branches.b[EB_LEFT] = old_leaf;
+				new->node.branches.b[EB_RGHT] = new_leaf;
+				eb_pstore(old->node.leaf_p, new_left);
+
+				if (new->key == old->key) {
+					new->node.bit = -1;
+					eb_pstore(root->b[side], eb_dotag(&new->node.branches, EB_NODE));
+					EB_STATS_INSERT();
+					EB_SIZE_LINK(&new->node);
+					EB_THR_LINK(&new->node);
+					return new;
+				}
+			}
+			break;
+		}
+
+		/* OK we're walking down this link */
+		old = container_of(eb_untag(troot, EB_NODE),
+				    struct eb64_node, node.branches);
+		old_node_bit = old->node.bit;
+
+		/* Stop going down when we don't have common bits anymore. We
+		 * also stop in front of a duplicates tree because it means we
+		 * have to insert above.
+		 */
+
+		if ((old_node_bit < 0) || /* we're above a duplicate tree, stop here */
+		    (((new->key ^ old->key) >> old_node_bit) >= EB_NODE_BRANCHES)) {
+			/* The tree did not contain the key, so we insert <new> before the node
+			 * <old>, and set ->bit to designate the lowest bit position in <new>
+			 * which applies to ->branches.b[].
+			 */
+			eb_troot_t *new_left, *new_rght;
+			eb_troot_t *new_leaf, *old_node;
+
+			new_left = eb_dotag(&new->node.branches, EB_LEFT);
+			new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+			new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+			old_node = eb_dotag(&old->node.branches, EB_NODE);
+
+			new->node.node_p = old->node.node_p;
+
+			if (new->key < old->key) {
+				new->node.leaf_p = new_left;
+				new->node.branches.b[EB_LEFT] = new_leaf;
+				new->node.branches.b[EB_RGHT] = old_node;
+				eb_pstore(old->node.node_p, new_rght);
+			}
+			else if (new->key > old->key) {
+				new->node.leaf_p = new_rght;
+				new->node.branches.b[EB_LEFT] = old_node;
+				new->node.branches.b[EB_RGHT] = new_leaf;
+				eb_pstore(old->node.node_p, new_left);
+			}
+			else {
+				struct eb_node *ret;
+				ret = eb_insert_dup(&old->node, &new->node);
+				EB_STATS_INSERT();
+				return container_of(ret, struct eb64_node, node);
+			}
+			break;
+		}
+
+		/* walk down */
+		root = &old->node.branches;
+#if ULONG_MAX >= UINT64_T_MAX
+		side = (newkey >> old_node_bit) & EB_NODE_BRANCH_MASK;
+#else
+		side = newkey;
+		side >>= old_node_bit;
+		if (old_node_bit >= 0x20) {
+			side = newkey >> 0x20;
+			side >>= old_node_bit & 0x1F;
+		}
+		side &= EB_NODE_BRANCH_MASK;
+#endif
+		troot = root->b[side];
+	}
+
+	/* Ok, now we are inserting <new> between <root> and <old>. <old>'s
+	 * parent is already set to <new>, and the <root>'s branch is still in
+	 * <side>. Update the root's leaf till we have it. Note that we can also
+	 * find the side by checking the side of new->node.node_p.
+	 */
+
+	/* We need the common higher bits between new->key and old->key.
+	 * What differences are there between new->key and the node here ?
+	 * NOTE that bit(new) is always < bit(root) because highest
+	 * bit of new->key and old->key are identical here (otherwise they
+	 * would sit on different branches).
+	 */
+	// note that if EB_NODE_BITS > 1, we should check that it's still >= 0
+	new->node.bit = fls64(new->key ^ old->key) - EB_NODE_BITS;
+	eb_pstore(root->b[side], eb_dotag(&new->node.branches, EB_NODE));
+
+	EB_STATS_INSERT();
+	EB_SIZE_LINK(&new->node);
+	EB_THR_LINK(&new->node);
+	return new;
+}
+
+#ifdef EB_INLINE
+static forceinline struct eb64_node *eb64_first(struct eb_root *root)
+{
+	return container_of(__eb_first(root), struct eb64_node, node);
+}
+
+static forceinline struct eb64_node *eb64_last(struct eb_root *root)
+{
+	return container_of(__eb_last(root), struct eb64_node, node);
+}
+
+static forceinline struct eb64_node *eb64_next(struct eb64_node *eb64)
+{
+	return container_of(__eb_next(&eb64->node), struct eb64_node, node);
+}
+
+static forceinline struct eb64_node *eb64_prev(struct eb64_node *eb64)
+{
+	return container_of(__eb_prev(&eb64->node), struct eb64_node, node);
+}
+
+static forceinline struct eb64_node *eb64_lookup(struct eb_root *root, uint64_t x)
+{
+	return __eb64_lookup(root, x);
+}
+
+static forceinline struct eb64_node *eb64_insert(struct eb_root *root, struct eb64_node *new)
+{
+	return __eb64_insert(root, new);
+}
+#endif /* EB_INLINE */
+
 #endif /* int64_tEB64_TREE_H */
@@ -131,6 +131,7 @@ struct ebpt_node *ebim_insert(struct eb_root *root, struct ebpt_node *new, unsig
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -203,6 +204,7 @@ struct ebpt_node *ebim_insert(struct eb_root *root, struct ebpt_node *new, unsig
 				if (diff == 0) {
 					new->node.bit = -1;
 					root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+					EB_THR_LINK(&new->node);
 					return new;
 				}
 			}
@@ -283,5 +285,6 @@ struct ebpt_node *ebim_insert(struct eb_root *root, struct ebpt_node *new, unsig
 	 */
 	new->node.bit = bit;
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_THR_LINK(&new->node);
 	return new;
 }
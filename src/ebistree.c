@@ -121,6 +121,7 @@ struct ebpt_node *ebis_insert(struct eb_root *root, struct ebpt_node *new)
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -186,6 +187,7 @@ struct ebpt_node *ebis_insert(struct eb_root *root, struct ebpt_node *new)
 				new->node.branches.b[EB_RGHT] = new_leaf;
 				new->node.bit = -1;
 				root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+				EB_THR_LINK(&new->node);
 				return new;
 			}
 
@@ -289,6 +291,7 @@ struct ebpt_node *ebis_insert(struct eb_root *root, struct ebpt_node *new)
 	 */
 	new->node.bit = bit;
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_THR_LINK(&new->node);
 	return new;
 }
 
@@ -0,0 +1,129 @@
+/*
+ * Elastic Binary Trees - stride-table front end for longest prefix matching.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include <stdlib.h>
+#include "eblpm.h"
+
+#define EBMB_LPM_SLOTS 65536
+
+/* Return the index of the slot designated by the first 16 bits of <key> */
+static inline unsigned int ebmb_lpm_index(const unsigned char *key)
+{
+	return ((unsigned int)key[0] << 8) | key[1];
+}
+
+int ebmb_lpm_init(struct ebmb_lpm *lpm, unsigned int keylen, int unique)
+{
+	unsigned int i;
+
+	if (keylen < 2)
+		return -1;
+
+	lpm->slots = calloc(EBMB_LPM_SLOTS, sizeof(*lpm->slots));
+	if (!lpm->slots)
+		return -1;
+
+	lpm->scratch = calloc(1, keylen);
+	if (!lpm->scratch) {
+		free(lpm->slots);
+		lpm->slots = NULL;
+		return -1;
+	}
+
+	lpm->keylen = keylen;
+	lpm->shorter.b[EB_LEFT] = NULL;
+	lpm->shorter.b[EB_RGHT] = unique ? (eb_troot_t *)1 : NULL;
+	if (unique)
+		for (i = 0; i < EBMB_LPM_SLOTS; i++)
+			lpm->slots[i].root.b[EB_RGHT] = (eb_troot_t *)1;
+	return 0;
+}
+
+void ebmb_lpm_destroy(struct ebmb_lpm *lpm)
+{
+	free(lpm->slots);
+	lpm->slots = NULL;
+	free(lpm->scratch);
+	lpm->scratch = NULL;
+}
+
+struct ebmb_node *ebmb_lpm_insert(struct ebmb_lpm *lpm, struct ebmb_node *new)
+{
+	struct ebmb_node *ret;
+	unsigned int idx, count;
+
+	if (new->node.pfx >= 16) {
+		idx = ebmb_lpm_index(new->key);
+		return ebmb_insert_prefix(&lpm->slots[idx].root, new, lpm->keylen);
+	}
+
+	ret = ebmb_insert_prefix(&lpm->shorter, new, lpm->keylen);
+	if (ret != new)
+		return ret;
+
+	/* The prefix covers an aligned power-of-two range of slots; it
+	 * becomes their cached match when it is longer than the current
+	 * one. A duplicate keeps the first occurrence, as a lookup would.
+	 */
+	idx = ebmb_lpm_index(new->key);
+	count = 1U << (16 - new->node.pfx);
+	while (count--) {
+		struct ebmb_lpm_slot *slot = &lpm->slots[idx++];
+
+		if (!slot->best || slot->best->node.pfx < new->node.pfx)
+			slot->best = new;
+	}
+	return new;
+}
+
+void ebmb_lpm_delete(struct ebmb_lpm *lpm, struct ebmb_node *node)
+{
+	unsigned int idx, count, pfx;
+
+	if (!node->node.leaf_p)
+		return;
+
+	pfx = node->node.pfx;
+	ebmb_delete(node);
+	if (pfx >= 16)
+		return;
+
+	/* Recompute the cached match of the slots which pointed to the node
+	 * from the remaining shorter prefixes. Slots caching a longer (or
+	 * surviving duplicate) prefix are left untouched.
+	 */
+	idx = ebmb_lpm_index(node->key);
+	count = 1U << (16 - pfx);
+	while (count--) {
+		if (lpm->slots[idx].best == node) {
+			lpm->scratch[0] = idx >> 8;
+			lpm->scratch[1] = idx;
+			lpm->slots[idx].best =
+				ebmb_lookup_longest(&lpm->shorter, lpm->scratch);
+		}
+		idx++;
+	}
+}
+
+struct ebmb_node *ebmb_lpm_lookup(struct ebmb_lpm *lpm, const void *x)
+{
+	struct ebmb_lpm_slot *slot;
+	struct ebmb_node *ret;
+
+	slot = &lpm->slots[ebmb_lpm_index(x)];
+	if (slot->root.b[EB_LEFT]) {
+		/* any match here is at least 16 bits long, thus longer than
+		 * the cached one
+		 */
+		ret = ebmb_lookup_longest(&slot->root, x);
+		if (ret)
+			return ret;
+	}
+	return slot->best;
+}
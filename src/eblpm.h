@@ -0,0 +1,72 @@
+/*
+ * Elastic Binary Trees - stride-table front end for longest prefix matching.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBLPM_H
+#define _EBLPM_H
+
+#include "ebmbtree.h"
+
+/* An LPM table accelerates ebmb_lookup_longest() with the classic DIR-24-8
+ * trick, here with a 16-bit first stride : a 2^16-entry table indexed by the
+ * first 16 bits of the looked-up key routes each lookup straight to a small
+ * per-slot prefix tree, skipping the top 16 levels of the bit-by-bit descent.
+ * Prefixes of 16 bits or more go to the tree of the slot designated by their
+ * first two key bytes; shorter prefixes go to one shared tree, and every slot
+ * additionally caches the longest of these shorter prefixes covering it. A
+ * lookup thus indexes the table, walks the slot's shallow tree, and falls
+ * back to the cached entry, which resolves most lookups in a few memory
+ * references regardless of the table size.
+ *
+ * The cached entries are maintained incrementally : inserting or deleting a
+ * prefix shorter than 16 bits visits the 2^(16-pfx) slots it covers, which
+ * makes short-prefix updates slower than plain ebmb_insert_prefix() in
+ * exchange for the fast lookups. The nodes are regular ebmb_nodes with
+ * key/pfx set as for ebmb_insert_prefix(); all keys use the same length,
+ * fixed at init time, of at least two bytes.
+ */
+struct ebmb_lpm_slot {
+	struct eb_root root;         /* prefixes of 16 bits or more */
+	struct ebmb_node *best;      /* longest shorter prefix covering the slot */
+};
+
+struct ebmb_lpm {
+	unsigned int keylen;         /* the fixed key length, in bytes */
+	struct eb_root shorter;      /* prefixes shorter than 16 bits */
+	struct ebmb_lpm_slot *slots; /* 2^16 slots indexed by the first 16 key bits */
+	unsigned char *scratch;      /* keylen bytes used to recompute the caches */
+};
+
+/*
+ * Exported functions and macros.
+ */
+
+/* Initialize <lpm> for keys of <keylen> bytes. If <unique> is non-zero the
+ * trees only accept unique keys. Returns 0 on success, -1 on allocation
+ * failure or if <keylen> is shorter than the two bytes the stride consumes.
+ */
+extern int ebmb_lpm_init(struct ebmb_lpm *lpm, unsigned int keylen, int unique);
+
+/* Release the memory held by <lpm>. The trees must already be empty. */
+extern void ebmb_lpm_destroy(struct ebmb_lpm *lpm);
+
+/* Insert node <new>, with new->key and new->node.pfx already set, into <lpm>
+ * and return it. If the tree is unique and the prefix was already present,
+ * the existing node is returned instead and <new> is left unlinked.
+ */
+extern struct ebmb_node *ebmb_lpm_insert(struct ebmb_lpm *lpm, struct ebmb_node *new);
+
+/* Delete node <node> from <lpm> if it was linked in. Mark the node unused. */
+extern void ebmb_lpm_delete(struct ebmb_lpm *lpm, struct ebmb_node *node);
+
+/* Find the first occurrence of the longest prefix matching key <x>, which
+ * must be at least keylen bytes long, or NULL if none covers it.
+ */
+extern struct ebmb_node *ebmb_lpm_lookup(struct ebmb_lpm *lpm, const void *x);
+
+#endif /* _EBLPM_H */
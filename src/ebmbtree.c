@@ -183,6 +183,7 @@ struct ebmb_node *ebmb_insert(struct eb_root *root, struct ebmb_node *new, unsig
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -303,9 +304,215 @@ struct ebmb_node *ebmb_insert(struct eb_root *root, struct ebmb_node *new, unsig
 	 */
 
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_THR_LINK(&new->node);
 	return new;
 }
 
+/*
+ * Find the last occurrence of the highest key in the tree <root>, which is
+ * equal to or less than <x> in memcmp() order over <len> bytes. NULL is
+ * returned is no key matches. As with ebmb_lookup(), <len> must match the
+ * length used for all keys in the tree. Only valid for trees built with
+ * ebmb_insert(), not for prefix trees.
+ */
+struct ebmb_node *ebmb_lookup_le(struct eb_root *root, const void *x, unsigned int len)
+{
+	struct ebmb_node *node;
+	eb_troot_t *troot;
+	int node_bit, bit;
+	unsigned int side;
+
+	troot = root->b[EB_LEFT];
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	bit = 0;
+	while (1) {
+		if ((eb_gettag(troot) == EB_LEAF)) {
+			/* We reached a leaf, which means that the whole upper
+			 * parts were common. We will return either the current
+			 * node or its prev one if the former is too large.
+			 */
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct ebmb_node, node.branches);
+			if (memcmp(node->key, x, len) <= 0)
+				return node;
+			/* return prev */
+			troot = node->node.leaf_p;
+			break;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct ebmb_node, node.branches);
+
+		node_bit = node->node.bit;
+		if (node_bit < 0) {
+			/* We're at the top of a dup tree. Either we got a
+			 * matching value and we return the rightmost node, or
+			 * we don't and we skip the whole subtree to return the
+			 * prev node before the subtree.
+			 */
+			if (memcmp(node->key, x, len) <= 0) {
+				troot = node->node.branches.b[EB_RGHT];
+				while (eb_gettag(troot) != EB_LEAF)
+					troot = (eb_untag(troot, EB_NODE))->b[EB_RGHT];
+				return container_of(eb_untag(troot, EB_LEAF),
+						    struct ebmb_node, node.branches);
+			}
+			/* return prev */
+			troot = node->node.node_p;
+			break;
+		}
+
+		/* The subtree only contains keys agreeing with node->key on
+		 * the first <node_bit> bits. Check whether <x> diverges from
+		 * them before that, in which case the whole subtree sits on
+		 * one side of <x>.
+		 */
+		bit = equal_bits(x, node->key, bit, node_bit);
+		if (bit < node_bit) {
+			if (cmp_bits(x, node->key, bit) > 0) {
+				/* all the keys here are smaller, get the
+				 * highest one.
+				 */
+				troot = node->node.branches.b[EB_RGHT];
+				return ebmb_entry(eb_walk_down(troot, EB_RGHT), struct ebmb_node, node);
+			}
+			/* Further values will be too high here, so return the
+			 * prev unique node (if it exists).
+			 */
+			troot = node->node.node_p;
+			break;
+		}
+		/* no need to compare the bit we're descending around */
+		bit = node_bit + 1;
+
+		/* walk down */
+		side = node_bit & 7;
+		side ^= 7;
+		side = (((const unsigned char *)x)[node_bit >> 3] >> side) & 1;
+		troot = node->node.branches.b[side];
+	}
+
+	/* If we get here, it means we want to report previous node before the
+	 * current one which is not above. <troot> is already initialised to
+	 * the parent's branches.
+	 */
+	while (eb_gettag(troot) == EB_LEFT) {
+		/* Walking up from left branch. We must ensure that we never
+		 * walk beyond root.
+		 */
+		if (unlikely(eb_clrtag((eb_untag(troot, EB_LEFT))->b[EB_RGHT]) == NULL))
+			return NULL;
+		troot = (eb_root_to_node(eb_untag(troot, EB_LEFT)))->node_p;
+	}
+	/* Note that <troot> cannot be NULL at this stage */
+	troot = (eb_untag(troot, EB_RGHT))->b[EB_LEFT];
+	node = ebmb_entry(eb_walk_down(troot, EB_RGHT), struct ebmb_node, node);
+	return node;
+}
+
+/*
+ * Find the first occurrence of the lowest key in the tree <root>, which is
+ * equal to or greater than <x> in memcmp() order over <len> bytes. NULL is
+ * returned is no key matches. As with ebmb_lookup(), <len> must match the
+ * length used for all keys in the tree. Only valid for trees built with
+ * ebmb_insert(), not for prefix trees.
+ */
+struct ebmb_node *ebmb_lookup_ge(struct eb_root *root, const void *x, unsigned int len)
+{
+	struct ebmb_node *node;
+	eb_troot_t *troot;
+	int node_bit, bit;
+	unsigned int side;
+
+	troot = root->b[EB_LEFT];
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	bit = 0;
+	while (1) {
+		if ((eb_gettag(troot) == EB_LEAF)) {
+			/* We reached a leaf, which means that the whole upper
+			 * parts were common. We will return either the current
+			 * node or its next one if the former is too small.
+			 */
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct ebmb_node, node.branches);
+			if (memcmp(node->key, x, len) >= 0)
+				return node;
+			/* return next */
+			troot = node->node.leaf_p;
+			break;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct ebmb_node, node.branches);
+
+		node_bit = node->node.bit;
+		if (node_bit < 0) {
+			/* We're at the top of a dup tree. Either we got a
+			 * matching value and we return the leftmost node, or
+			 * we don't and we skip the whole subtree to return the
+			 * next node after the subtree.
+			 */
+			if (memcmp(node->key, x, len) >= 0) {
+				troot = node->node.branches.b[EB_LEFT];
+				while (eb_gettag(troot) != EB_LEAF)
+					troot = (eb_untag(troot, EB_NODE))->b[EB_LEFT];
+				return container_of(eb_untag(troot, EB_LEAF),
+						    struct ebmb_node, node.branches);
+			}
+			/* return next */
+			troot = node->node.node_p;
+			break;
+		}
+
+		/* The subtree only contains keys agreeing with node->key on
+		 * the first <node_bit> bits. Check whether <x> diverges from
+		 * them before that, in which case the whole subtree sits on
+		 * one side of <x>.
+		 */
+		bit = equal_bits(x, node->key, bit, node_bit);
+		if (bit < node_bit) {
+			if (cmp_bits(x, node->key, bit) < 0) {
+				/* all the keys here are greater, get the
+				 * lowest one.
+				 */
+				troot = node->node.branches.b[EB_LEFT];
+				return ebmb_entry(eb_walk_down(troot, EB_LEFT), struct ebmb_node, node);
+			}
+			/* Further values will be too low here, so return the
+			 * next unique node (if it exists).
+			 */
+			troot = node->node.node_p;
+			break;
+		}
+		/* no need to compare the bit we're descending around */
+		bit = node_bit + 1;
+
+		/* walk down */
+		side = node_bit & 7;
+		side ^= 7;
+		side = (((const unsigned char *)x)[node_bit >> 3] >> side) & 1;
+		troot = node->node.branches.b[side];
+	}
+
+	/* If we get here, it means we want to report next node after the
+	 * current one which is not below. <troot> is already initialised
+	 * to the parent's branches.
+	 */
+	while (eb_gettag(troot) != EB_LEFT)
+		/* Walking up from right branch, so we cannot be below root */
+		troot = (eb_root_to_node(eb_untag(troot, EB_RGHT)))->node_p;
+
+	/* Note that <troot> cannot be NULL at this stage */
+	troot = (eb_untag(troot, EB_LEFT))->b[EB_RGHT];
+	if (eb_clrtag(troot) == NULL)
+		return NULL;
+
+	node = ebmb_entry(eb_walk_down(troot, EB_LEFT), struct ebmb_node, node);
+	return node;
+}
+
 
 /* Find the first occurence of the longest prefix matching a key <x> in the
  * tree <root>. It's the caller's responsibility to ensure that key <x> is at
@@ -520,6 +727,7 @@ struct ebmb_node *ebmb_insert_prefix(struct eb_root *root, struct ebmb_node *new
 		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
 		new->node.leaf_p = eb_dotag(root, EB_LEFT);
 		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
 		return new;
 	}
 
@@ -731,5 +939,152 @@ struct ebmb_node *ebmb_insert_prefix(struct eb_root *root, struct ebmb_node *new
 	}
 
 	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_THR_LINK(&new->node);
 	return new;
 }
+
+/* Append node <new>, whose key is greater than or equal to every key currently
+ * in the tree, right of rightmost leaf <last> (NULL if the tree is empty).
+ * Instead of descending from the root, we climb the right spine from <last>
+ * until we find the node above which <new> diverges, which makes a sorted
+ * insertion stream O(1) amortized. Note that the bit values here work in the
+ * opposite direction from the scalar trees: they grow from the root towards
+ * the leaves. Returns <new>, or the existing node if the key was already
+ * present in a unique tree.
+ */
+static struct ebmb_node *__ebmb_append(struct eb_root *root, struct ebmb_node *last,
+				       struct ebmb_node *new, unsigned int len)
+{
+	struct eb_node *up;
+	struct eb_root *r;
+	eb_troot_t *t, *sub;
+	eb_troot_t *new_left, *new_rght, *new_leaf;
+	unsigned int side;
+	int newbit;
+
+	if (unlikely(!last)) {
+		/* Tree is empty, insert the leaf part below the left branch */
+		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
+		new->node.leaf_p = eb_dotag(root, EB_LEFT);
+		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	new_left = eb_dotag(&new->node.branches, EB_LEFT);
+	new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+	new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+
+	len <<= 3;
+	newbit = equal_bits(new->key, last->key, 0, len);
+
+	if (newbit == (int)len) {
+		/* key was already there */
+
+		/* we may refuse to duplicate this key if the tree is
+		 * tagged as containing only unique keys.
+		 */
+		if (eb_gettag(root->b[EB_RGHT]))
+			return last;
+
+		/* Look for the head of the duplicate subtree <last> may
+		 * belong to. It is the highest node with a negative bit
+		 * above the leaf.
+		 */
+		up = NULL;
+		t = last->node.leaf_p;
+		while (1) {
+			side = eb_gettag(t);
+			r = eb_untag(t, side);
+			if (eb_clrtag(r->b[EB_RGHT]) == NULL)
+				break; /* reached the tree root */
+			if (eb_root_to_node(r)->bit >= 0)
+				break;
+			up = eb_root_to_node(r);
+			t = up->node_p;
+		}
+
+		if (up) {
+			struct eb_node *ret;
+			ret = eb_insert_dup(up, &new->node);
+			return container_of(ret, struct ebmb_node, node);
+		}
+
+		/* <last> is alone, add the new key next to it as a first
+		 * duplicate, on the right.
+		 */
+		t = last->node.leaf_p;
+		new->node.node_p = t;
+		new->node.leaf_p = new_rght;
+		last->node.leaf_p = new_left;
+		new->node.branches.b[EB_LEFT] = eb_dotag(&last->node.branches, EB_LEAF);
+		new->node.branches.b[EB_RGHT] = new_leaf;
+		new->node.bit = -1;
+		side = eb_gettag(t);
+		eb_untag(t, side)->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	/* <new> is strictly greater than every key in the tree. All keys in
+	 * the subtree we will displace share at least <newbit> bits with
+	 * <last>, so comparing against <last> is enough. We climb while the
+	 * nodes split deeper than <newbit> (larger bit) or are duplicates.
+	 */
+	t = last->node.leaf_p;
+	while (1) {
+		side = eb_gettag(t);
+		r = eb_untag(t, side);
+		if (eb_clrtag(r->b[EB_RGHT]) == NULL)
+			break; /* reached the tree root */
+		if (eb_root_to_node(r)->bit >= 0 &&
+		    eb_root_to_node(r)->bit <= newbit)
+			break;
+		t = eb_root_to_node(r)->node_p;
+	}
+
+	/* Insert above the branch we climbed from : the displaced subtree
+	 * goes to the left of <new> and the new leaf to the right.
+	 */
+	sub = r->b[side];
+	new->node.branches.b[EB_LEFT] = sub;
+	new->node.branches.b[EB_RGHT] = new_leaf;
+	new->node.leaf_p = new_rght;
+	new->node.node_p = t;
+	new->node.bit = newbit;
+
+	if (eb_gettag(sub) == EB_LEAF)
+		eb_root_to_node(eb_untag(sub, EB_LEAF))->leaf_p = new_left;
+	else
+		eb_root_to_node(eb_untag(sub, EB_NODE))->node_p = new_left;
+
+	r->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_THR_LINK(&new->node);
+	return new;
+}
+
+/* Build a tree from <n> nodes of <len> bytes each, pre-sorted by ascending
+ * key (memcmp() order), in a single linear pass instead of one full
+ * root-to-leaf descent per key. The tree must either be empty or only contain
+ * keys lower than or equal to the first key of the array. Only the keys need
+ * be set in the nodes. Returns the number of nodes actually linked; in a
+ * unique tree, duplicates are skipped and marked unlinked (NULL leaf_p), like
+ * a regular refused insertion.
+ */
+unsigned int ebmb_load_sorted(struct eb_root *root, struct ebmb_node * const *nodes,
+			      unsigned int n, unsigned int len)
+{
+	struct ebmb_node *last;
+	unsigned int i, count = 0;
+
+	last = ebmb_last(root);
+	for (i = 0; i < n; i++) {
+		if (__ebmb_append(root, last, nodes[i], len) != nodes[i]) {
+			nodes[i]->node.leaf_p = NULL; /* mark unlinked */
+			continue;
+		}
+		last = nodes[i];
+		count++;
+	}
+	return count;
+}
@@ -62,9 +62,26 @@ extern void ebmb_delete(struct ebmb_node *ebmb);
  */
 extern struct ebmb_node *ebmb_lookup(struct eb_root *root, const void *x, unsigned int len);
 extern struct ebmb_node *ebmb_insert(struct eb_root *root, struct ebmb_node *new, unsigned int len);
+
+/* Find the last occurrence of the highest key which is equal to or less than
+ * <x> in memcmp() order over <len> bytes, or the first occurrence of the
+ * lowest key equal to or greater than <x>, in a single descent. NULL is
+ * returned if no key matches. <len> must match the length used for all keys
+ * in the tree. Only valid for trees built with ebmb_insert(), not for prefix
+ * trees.
+ */
+extern struct ebmb_node *ebmb_lookup_le(struct eb_root *root, const void *x, unsigned int len);
+extern struct ebmb_node *ebmb_lookup_ge(struct eb_root *root, const void *x, unsigned int len);
 extern struct ebmb_node *ebmb_lookup_longest(struct eb_root *root, const void *x);
 extern struct ebmb_node *ebmb_lookup_prefix(struct eb_root *root, const void *x, unsigned int pfx);
 extern struct ebmb_node *ebmb_insert_prefix(struct eb_root *root, struct ebmb_node *new, unsigned int len);
 
+/* Build a tree from <n> nodes of <len> bytes each, pre-sorted by ascending
+ * key (memcmp() order), in a single linear pass. The tree must either be
+ * empty or only contain keys lower than or equal to the first key of the
+ * array. Returns the number of nodes actually linked.
+ */
+extern unsigned int ebmb_load_sorted(struct eb_root *root, struct ebmb_node * const *nodes, unsigned int n, unsigned int len);
+
 #endif /* _EBMBTREE_H */
 
@@ -0,0 +1,224 @@
+/*
+ * Elastic Binary Trees - parallel construction of 64-bit key trees.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "ebparallel.h"
+
+/* One slice of the sorted input, covering a distinct top-bits prefix of the
+ * key space, and the private tree it is loaded into. Since two slices never
+ * share a bit prefix, their subtrees never interleave and the workers touch
+ * no common state at all.
+ */
+struct eb64_build_part {
+	struct eb64_node * const *nodes; /* slice of the sorted input */
+	unsigned int n;                  /* number of nodes in the slice */
+	unsigned int count;              /* nodes actually linked */
+	char spawned;                    /* a thread was started for this slice */
+	struct eb_root root;             /* private root the slice is built in */
+};
+
+static void *eb64_build_worker(void *arg)
+{
+	struct eb64_build_part *part = arg;
+
+	part->count = eb64_load_sorted(&part->root, part->nodes, part->n);
+	return NULL;
+}
+
+/* Attach the tree of non-empty slice <part> to the right of the final tree
+ * <root>, whose rightmost leaf is <last> (NULL if it is still empty). All of
+ * the slice's keys are strictly greater than the keys already in place and
+ * diverge from them within the top partitioning bits, above any bit used
+ * inside the slice's own tree, so a single node part is enough to join both
+ * trees. We reuse the node part of the slice's first leaf, the only one a
+ * tree loaded from scratch never consumes. The climb from <last> is the same
+ * as in a sorted append. Returns the new rightmost leaf.
+ */
+static struct eb64_node *eb64_build_stitch(struct eb_root *root, struct eb64_node *last,
+					   struct eb64_build_part *part)
+{
+	struct eb64_node *first, *plast;
+	struct eb_root *r;
+	eb_troot_t *t, *sub, *top;
+	unsigned int side, i;
+	int newbit;
+
+	top = part->root.b[EB_LEFT];
+	first = part->nodes[0]; /* always linked : its tree started empty */
+
+	/* the slice's rightmost leaf; the last entries may be refused
+	 * duplicates in a unique tree.
+	 */
+	i = part->n;
+	while (!part->nodes[--i]->node.leaf_p)
+		;
+	plast = part->nodes[i];
+
+	if (!last) {
+		/* first non-empty slice : move its tree under the final root */
+		root->b[EB_LEFT] = top;
+		if (eb_gettag(top) == EB_LEAF)
+			eb_root_to_node(eb_untag(top, EB_LEAF))->leaf_p = eb_dotag(root, EB_LEFT);
+		else
+			eb_root_to_node(eb_untag(top, EB_NODE))->node_p = eb_dotag(root, EB_LEFT);
+		return plast;
+	}
+
+	newbit = fls64(first->key ^ last->key) - EB_NODE_BITS;
+
+	/* climb the right spine from <last> until we find the node above
+	 * which the slice diverges, as in __eb64_append().
+	 */
+	t = last->node.leaf_p;
+	while (1) {
+		side = eb_gettag(t);
+		r = eb_untag(t, side);
+		if (eb_clrtag(r->b[EB_RGHT]) == NULL)
+			break; /* reached the tree root */
+		if (eb_root_to_node(r)->bit >= newbit)
+			break;
+		t = eb_root_to_node(r)->node_p;
+	}
+
+	/* Insert the join node above the branch we climbed from : the
+	 * displaced subtree goes to its left and the slice's tree to its
+	 * right.
+	 */
+	sub = r->b[side];
+	first->node.branches.b[EB_LEFT] = sub;
+	first->node.branches.b[EB_RGHT] = top;
+	first->node.node_p = t;
+	first->node.bit = newbit;
+
+	if (eb_gettag(sub) == EB_LEAF)
+		eb_root_to_node(eb_untag(sub, EB_LEAF))->leaf_p = eb_dotag(&first->node.branches, EB_LEFT);
+	else
+		eb_root_to_node(eb_untag(sub, EB_NODE))->node_p = eb_dotag(&first->node.branches, EB_LEFT);
+
+	if (eb_gettag(top) == EB_LEAF)
+		eb_root_to_node(eb_untag(top, EB_LEAF))->leaf_p = eb_dotag(&first->node.branches, EB_RGHT);
+	else
+		eb_root_to_node(eb_untag(top, EB_NODE))->node_p = eb_dotag(&first->node.branches, EB_RGHT);
+
+	r->b[side] = eb_dotag(&first->node.branches, EB_NODE);
+
+#ifdef EB_AUGMENT
+	/* the slice's tree carries its own counts; seed the join node from
+	 * its branches and add the slice's leaves to every node above.
+	 */
+	first->node.size = __eb_branch_size(first->node.branches.b[EB_LEFT]) +
+			   __eb_branch_size(first->node.branches.b[EB_RGHT]);
+	t = first->node.node_p;
+	while (1) {
+		side = eb_gettag(t);
+		r = eb_untag(t, side);
+		if (eb_clrtag(r->b[EB_RGHT]) == NULL)
+			break; /* reached the tree root */
+		eb_root_to_node(r)->size += part->count;
+		t = eb_root_to_node(r)->node_p;
+	}
+#endif
+
+#ifdef EB_THREADED
+	/* each slice threaded its own leaves while loading; join the two
+	 * trees' threads at the boundary.
+	 */
+	last->node.thr_next = &first->node;
+	first->node.thr_prev = &last->node;
+#endif
+	return plast;
+}
+
+/* Build a tree from <n> nodes pre-sorted by ascending key, sliced by the top
+ * key bits over up to <nthreads> threads. See ebparallel.h for the contract.
+ */
+unsigned int eb64_build_parallel(struct eb_root *root, struct eb64_node * const *nodes,
+				 unsigned int n, unsigned int nthreads)
+{
+	struct eb64_build_part *parts;
+	pthread_t *tids;
+	struct eb64_node *last;
+	unsigned int npart, shift, i, beg, count;
+	eb_troot_t *unique;
+
+	if (!n)
+		return 0;
+
+	/* one slice per thread, rounded up to a power of two so that each
+	 * slice covers a fixed top-bits prefix.
+	 */
+	if (nthreads > 64)
+		nthreads = 64;
+	npart = 1;
+	shift = 64;
+	while (npart < nthreads) {
+		npart <<= 1;
+		shift--;
+	}
+
+	if (npart == 1)
+		return eb64_load_sorted(root, nodes, n);
+
+	parts = calloc(npart, sizeof(*parts));
+	tids = calloc(npart, sizeof(*tids));
+	if (!parts || !tids) {
+		free(parts);
+		free(tids);
+		return eb64_load_sorted(root, nodes, n);
+	}
+
+	/* slice the input by the top key bits; the slices keep the input
+	 * order so each one is itself sorted, and they inherit the root's
+	 * unique-keys tag since equal keys always fall in the same slice.
+	 */
+	unique = root->b[EB_RGHT];
+	beg = 0;
+	for (i = 0; i < npart; i++) {
+		unsigned int end = beg;
+
+		while (end < n && (nodes[end]->key >> shift) == i)
+			end++;
+		parts[i].nodes = nodes + beg;
+		parts[i].n = end - beg;
+		parts[i].root.b[EB_RGHT] = unique;
+		beg = end;
+	}
+
+	/* load each non-empty slice; the last one runs on the calling thread,
+	 * and a failed thread creation simply degrades to running the slice
+	 * here as well.
+	 */
+	for (i = 0; i < npart; i++) {
+		if (!parts[i].n)
+			continue;
+		if (i == npart - 1 ||
+		    pthread_create(&tids[i], NULL, eb64_build_worker, &parts[i]) != 0)
+			eb64_build_worker(&parts[i]);
+		else
+			parts[i].spawned = 1;
+	}
+	for (i = 0; i < npart; i++)
+		if (parts[i].spawned)
+			pthread_join(tids[i], NULL);
+
+	/* stitch the slice trees together in ascending key order */
+	last = NULL;
+	count = 0;
+	for (i = 0; i < npart; i++) {
+		if (!parts[i].n)
+			continue;
+		last = eb64_build_stitch(root, last, &parts[i]);
+		count += parts[i].count;
+	}
+
+	free(parts);
+	free(tids);
+	return count;
+}
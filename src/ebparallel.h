@@ -0,0 +1,32 @@
+/*
+ * Elastic Binary Trees - parallel construction of 64-bit key trees.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBPARALLEL_H
+#define _EBPARALLEL_H
+
+#include "eb64tree.h"
+
+/* Build a tree from <n> nodes pre-sorted by ascending key, like
+ * eb64_load_sorted(), but sliced over up to <nthreads> threads. The input is
+ * partitioned by the top key bits, each slice is loaded into its own subtree
+ * with no shared state since subtrees over disjoint bit prefixes never
+ * interleave, and the slice roots are then stitched together under a small
+ * top tree of spare node parts. The tree <root> must be empty ; only its
+ * unique-keys tag is honoured. Only the keys need be set in the nodes.
+ * Returns the number of nodes actually linked ; in a unique tree, duplicates
+ * are skipped and marked unlinked (NULL leaf_p), like a regular refused
+ * insertion. The caller must link against the POSIX threads library. Note
+ * that the top-bits split makes the balance depend on the key distribution ;
+ * keys sharing their upper bits will pile up in few slices.
+ */
+extern unsigned int eb64_build_parallel(struct eb_root *root,
+					struct eb64_node * const *nodes,
+					unsigned int n, unsigned int nthreads);
+
+#endif /* _EBPARALLEL_H */
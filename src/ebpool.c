@@ -0,0 +1,340 @@
+/*
+ * Elastic Binary Trees - slab allocator for tree nodes.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+/* When nodes come straight from malloc(), logically adjacent leaves end up
+ * scattered across the heap and every level of a descent costs a cache miss.
+ * This module hands out fixed-size items from large slabs so that nodes
+ * allocated together stay together, and optionally re-packs a whole tree
+ * into key order so that walks and descents mostly touch sequential memory.
+ */
+
+#define _GNU_SOURCE /* for MAP_ANONYMOUS and syscall() */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#include "ebpool.h"
+
+/* Size of one slab including its header. Large enough to amortize the
+ * malloc() overhead, small enough not to waste much on the last slab.
+ */
+#define EB_POOL_SLAB_SIZE	65536
+
+/* Slab size of the huge page backings : one 2MB page each */
+#define EB_POOL_HUGE_SLAB_SIZE	(2UL * 1024 * 1024)
+
+/* Get a slab from the pool's backing, or from malloc() without one */
+static inline void *eb_pool_slab_get(struct eb_pool *pool)
+{
+	if (pool->backing)
+		return pool->backing->alloc(pool->slab_size, pool->backing->ctx);
+	return malloc(pool->slab_size);
+}
+
+/* Return slab <slab> to the pool's backing, or to free() without one */
+static inline void eb_pool_slab_put(struct eb_pool *pool, struct eb_pool_slab *slab)
+{
+	if (pool->backing)
+		pool->backing->release(slab, pool->slab_size, pool->backing->ctx);
+	else
+		free(slab);
+}
+
+/* Map <size> anonymous bytes, on huge pages if <huge> is non-zero and the
+ * system grants them, falling back to regular pages otherwise (on which the
+ * kernel may still assemble transparent huge pages). Returns NULL on failure.
+ */
+static void *eb_pool_mmap(size_t size, int huge)
+{
+	void *area = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (huge)
+		area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#else
+	(void)huge;
+#endif
+	if (area == MAP_FAILED)
+		area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return area != MAP_FAILED ? area : NULL;
+}
+
+static void *eb_pool_huge_alloc(size_t size, void *ctx)
+{
+	(void)ctx;
+	return eb_pool_mmap(size, 1);
+}
+
+static void eb_pool_mmap_release(void *area, size_t size, void *ctx)
+{
+	(void)ctx;
+	munmap(area, size);
+}
+
+const struct eb_pool_backing eb_pool_backing_huge = {
+	.alloc = eb_pool_huge_alloc,
+	.release = eb_pool_mmap_release,
+	.slab_size = EB_POOL_HUGE_SLAB_SIZE,
+	.ctx = NULL,
+};
+
+/* Bind <area> to the NUMA node of <ctx> with a raw mbind() call, so as not
+ * to depend on libnuma. The binding is a placement hint : failures (no NUMA,
+ * bad node) are ignored and the slab stays usable wherever it is.
+ */
+static void *eb_pool_numa_alloc(size_t size, void *ctx)
+{
+	struct eb_pool_numa_backing *nb = ctx;
+	void *area;
+
+	area = eb_pool_mmap(size, nb->huge);
+#if defined(__linux__) && defined(SYS_mbind)
+	if (area && nb->node >= 0 && nb->node < 512) {
+		unsigned long mask[512 / (8 * sizeof(long))] = { 0 };
+
+		mask[nb->node / (8 * sizeof(long))] =
+			1UL << (nb->node % (8 * sizeof(long)));
+		syscall(SYS_mbind, area, size, 2 /* MPOL_BIND */,
+			mask, sizeof(mask) * 8, 0);
+	}
+#endif
+	return area;
+}
+
+void eb_pool_backing_numa_init(struct eb_pool_numa_backing *nb,
+			       int numa_node, int huge)
+{
+	nb->backing.alloc = eb_pool_numa_alloc;
+	nb->backing.release = eb_pool_mmap_release;
+	nb->backing.slab_size = huge ? EB_POOL_HUGE_SLAB_SIZE : 0;
+	nb->backing.ctx = nb;
+	nb->node = numa_node;
+	nb->huge = huge;
+}
+
+/* Return a pointer to item <idx> in <slab> for a pool of <pool>. */
+static inline void *eb_pool_item(struct eb_pool *pool, struct eb_pool_slab *slab,
+				 unsigned int idx)
+{
+	return (char *)(slab + 1) + idx * pool->item_size;
+}
+
+/* Initialize <pool> to serve items of <item_size> bytes from slabs provided
+ * by <backing>, or by malloc() when <backing> is NULL. The size is rounded up
+ * so that items remain pointer-aligned, and must leave room for at least one
+ * item per slab.
+ */
+void eb_pool_init_backed(struct eb_pool *pool, size_t item_size,
+			 const struct eb_pool_backing *backing)
+{
+	if (item_size < sizeof(void *))
+		item_size = sizeof(void *);
+	item_size = (item_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	pool->item_size = item_size;
+	pool->backing = backing;
+	pool->slab_size = (backing && backing->slab_size) ?
+		backing->slab_size : EB_POOL_SLAB_SIZE;
+	pool->per_slab = (pool->slab_size - sizeof(struct eb_pool_slab)) / item_size;
+	pool->used = 0;
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+}
+
+/* Initialize <pool> to serve items of <item_size> bytes. */
+void eb_pool_init(struct eb_pool *pool, size_t item_size)
+{
+	eb_pool_init_backed(pool, item_size, NULL);
+}
+
+/* Return a new item from <pool>, or NULL if memory is exhausted. Freed items
+ * are reused first, then the head slab is carved further.
+ */
+void *eb_pool_alloc(struct eb_pool *pool)
+{
+	struct eb_pool_slab *slab;
+	void *item;
+
+	if (pool->free_list) {
+		item = pool->free_list;
+		pool->free_list = *(void **)item;
+		return item;
+	}
+
+	if (!pool->slabs || pool->used >= pool->per_slab) {
+		slab = eb_pool_slab_get(pool);
+		if (!slab)
+			return NULL;
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		pool->used = 0;
+	}
+	return eb_pool_item(pool, pool->slabs, pool->used++);
+}
+
+/* Release <item> back to <pool> in O(1) by chaining it into the free list
+ * through its first word.
+ */
+void eb_pool_free(struct eb_pool *pool, void *item)
+{
+	*(void **)item = pool->free_list;
+	pool->free_list = item;
+}
+
+/* Release all the memory held by <pool>. All items become invalid. */
+void eb_pool_destroy(struct eb_pool *pool)
+{
+	struct eb_pool_slab *slab, *next;
+
+	for (slab = pool->slabs; slab; slab = next) {
+		next = slab->next;
+		eb_pool_slab_put(pool, slab);
+	}
+	pool->slabs = NULL;
+	pool->used = 0;
+	pool->free_list = NULL;
+}
+
+/* Fix all the pointers referencing <old> after its contents were copied to
+ * <new>, so that <new> takes its place in the tree. This covers the parent
+ * slots above the leaf and node parts, the parent pointers of the node
+ * part's children, and the case where the node part is attached directly
+ * above its own leaf.
+ */
+static void eb_node_relocate(struct eb_node *old, struct eb_node *new)
+{
+	eb_troot_t *t;
+	unsigned int side;
+
+	/* start with the pointers <new> holds to <old> itself, which happens
+	 * when the node part is the direct parent of its own leaf.
+	 */
+	side = eb_gettag(new->leaf_p);
+	if (eb_untag(new->leaf_p, side) == &old->branches)
+		new->leaf_p = eb_dotag(&new->branches, side);
+
+	if (new->node_p) {
+		side = eb_gettag(new->node_p);
+		if (eb_untag(new->node_p, side) == &old->branches)
+			new->node_p = eb_dotag(&new->branches, side);
+	}
+
+	/* update the parent slot above the leaf part */
+	t = new->leaf_p;
+	side = eb_gettag(t);
+	eb_untag(t, side)->b[side] = eb_dotag(&new->branches, EB_LEAF);
+
+#ifdef EB_THREADED
+	/* re-point the neighbor threads at the new location */
+	if (new->thr_prev)
+		new->thr_prev->thr_next = new;
+	if (new->thr_next)
+		new->thr_next->thr_prev = new;
+#endif
+
+	if (!new->node_p)
+		return; /* node part unused (lone leaf below the root) */
+
+	/* update the parent slot above the node part */
+	t = new->node_p;
+	side = eb_gettag(t);
+	eb_untag(t, side)->b[side] = eb_dotag(&new->branches, EB_NODE);
+
+	/* update the parent pointers of both children of the node part */
+	for (side = 0; side <= 1; side++) {
+		t = new->branches.b[side];
+		if (eb_gettag(t) == EB_LEAF)
+			eb_root_to_node(eb_untag(t, EB_LEAF))->leaf_p =
+				eb_dotag(&new->branches, side);
+		else
+			eb_root_to_node(eb_untag(t, EB_NODE))->node_p =
+				eb_dotag(&new->branches, side);
+	}
+}
+
+/* Re-pack into key order all the items of <pool> which are linked in tree
+ * <root> via an eb_node located <node_off> bytes inside each item. The items
+ * are copied in walk order into fresh slabs which replace the pool's current
+ * ones, so after this call a tree walk visits memory sequentially. All live
+ * items of the pool must be reachable from <root>, others are lost. Returns
+ * 0 on success, -1 on allocation failure, in which case the tree and the
+ * pool are left untouched.
+ */
+int eb_pool_compact(struct eb_pool *pool, struct eb_root *root, size_t node_off)
+{
+	struct eb_pool new_pool;
+	struct eb_pool_slab **slabv;
+	struct eb_node *node, *moved;
+	unsigned int count, needed, idx, used;
+	void *item;
+
+	eb_pool_init_backed(&new_pool, pool->item_size, pool->backing);
+
+	/* count the nodes and reserve all the memory upfront, so that no
+	 * failure may happen anymore once relocation has started.
+	 */
+	count = 0;
+	for (node = eb_first(root); node; node = eb_next(node))
+		count++;
+
+	needed = (count + new_pool.per_slab - 1) / new_pool.per_slab;
+	if (!needed) {
+		eb_pool_destroy(pool);
+		*pool = new_pool;
+		return 0;
+	}
+
+	slabv = malloc(needed * sizeof(*slabv));
+	if (!slabv)
+		return -1;
+
+	for (idx = 0; idx < needed; idx++) {
+		slabv[idx] = eb_pool_slab_get(&new_pool);
+		if (!slabv[idx]) {
+			while (idx)
+				eb_pool_slab_put(&new_pool, slabv[--idx]);
+			free(slabv);
+			return -1;
+		}
+	}
+
+	/* chain the slabs so that slabv[0] is the head */
+	for (idx = 0; idx < needed; idx++)
+		slabv[idx]->next = (idx + 1 < needed) ? slabv[idx + 1] : NULL;
+
+	/* Copy the items in walk order. The slabs are carved from the tail of
+	 * the chain towards its head, so that the head slab ends up being the
+	 * partially carved one that eb_pool_alloc() will keep carving.
+	 */
+	idx = needed - 1;
+	used = 0;
+	for (node = eb_first(root); node; node = eb_next(moved)) {
+		if (used >= new_pool.per_slab) {
+			idx--;
+			used = 0;
+		}
+		item = eb_pool_item(&new_pool, slabv[idx], used++);
+		memcpy(item, (char *)node - node_off, pool->item_size);
+		moved = (struct eb_node *)((char *)item + node_off);
+		eb_node_relocate(node, moved);
+	}
+
+	new_pool.slabs = slabv[0];
+	new_pool.used = used;
+	free(slabv);
+
+	eb_pool_destroy(pool);
+	*pool = new_pool;
+	return 0;
+}
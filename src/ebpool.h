@@ -0,0 +1,103 @@
+/*
+ * Elastic Binary Trees - slab allocator for tree nodes.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBPOOL_H
+#define _EBPOOL_H
+
+#include <stddef.h>
+#include "ebtree.h"
+
+/* One slab of items. Slabs are chained together, most recent first, and
+ * items are carved out of them in sequence.
+ */
+struct eb_pool_slab {
+	struct eb_pool_slab *next;
+	/* the items immediately follow */
+};
+
+/* A backing store provides the memory the slabs are carved from. The default
+ * one (a NULL backing) uses malloc()/free(); the alternative ones below map
+ * slabs on huge pages to cut the TLB misses of descents over large trees, or
+ * bind them to a NUMA node so that a tree stays on the socket whose threads
+ * use it. A backing may impose its own slab size (e.g. one huge page); zero
+ * keeps the default.
+ */
+struct eb_pool_backing {
+	void *(*alloc)(size_t size, void *ctx);         /* get a slab, NULL on failure */
+	void (*release)(void *area, size_t size, void *ctx); /* return a slab */
+	size_t slab_size;           /* slab size this backing requires, 0 = default */
+	void *ctx;                  /* opaque argument passed to both hooks */
+};
+
+/* The pool itself. Items are fixed-size and at least one pointer large so
+ * that freed ones can be chained into the free list. Allocations are served
+ * from the free list first, then by advancing <used> in the head slab.
+ */
+struct eb_pool {
+	size_t item_size;           /* rounded item size, in bytes */
+	size_t slab_size;           /* size of one slab, in bytes */
+	unsigned int per_slab;      /* number of items per slab */
+	unsigned int used;          /* items carved out of the head slab */
+	struct eb_pool_slab *slabs; /* head slab, the one being carved */
+	void *free_list;            /* chain of freed items, or NULL */
+	const struct eb_pool_backing *backing; /* slab provider, NULL = malloc() */
+};
+
+/* A NUMA backing and its parameters. Initialized by eb_pool_backing_numa_init()
+ * and passed to eb_pool_init_backed() via its embedded backing; it must stay
+ * valid for the pool's whole life.
+ */
+struct eb_pool_numa_backing {
+	struct eb_pool_backing backing;
+	int node;                   /* NUMA node the slabs are bound to */
+	int huge;                   /* non-zero to also request huge pages */
+};
+
+/*
+ * Exported functions and macros.
+ */
+
+/* Initialize <pool> to serve items of <item_size> bytes. */
+extern void eb_pool_init(struct eb_pool *pool, size_t item_size);
+
+/* Same, with the slabs provided by <backing>, which must remain valid for the
+ * pool's whole life. A NULL backing is the plain malloc() one.
+ */
+extern void eb_pool_init_backed(struct eb_pool *pool, size_t item_size,
+				const struct eb_pool_backing *backing);
+
+/* A backing mapping each slab on a 2MB huge page, falling back to regular
+ * anonymous pages when no huge page is available.
+ */
+extern const struct eb_pool_backing eb_pool_backing_huge;
+
+/* Initialize <nb> as a backing binding its slabs to NUMA node <numa_node>,
+ * also on huge pages if <huge> is non-zero. The binding is best-effort : on
+ * systems without NUMA support the slabs are simply left where the kernel
+ * puts them.
+ */
+extern void eb_pool_backing_numa_init(struct eb_pool_numa_backing *nb,
+				      int numa_node, int huge);
+
+/* Return a new item from <pool>, or NULL if memory is exhausted. */
+extern void *eb_pool_alloc(struct eb_pool *pool);
+
+/* Release <item> back to <pool> in O(1). */
+extern void eb_pool_free(struct eb_pool *pool, void *item);
+
+/* Release all the memory held by <pool>. All items become invalid. */
+extern void eb_pool_destroy(struct eb_pool *pool);
+
+/* Re-pack into key order all the items of <pool> which are linked in tree
+ * <root> via an eb_node located <node_off> bytes inside each item. Returns 0
+ * on success, -1 on allocation failure (the tree is left untouched).
+ */
+extern int eb_pool_compact(struct eb_pool *pool, struct eb_root *root, size_t node_off);
+
+#endif /* _EBPOOL_H */
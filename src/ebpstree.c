@@ -0,0 +1,520 @@
+/*
+ * Elastic Binary Trees - macros to manipulate prefix-cached Indirect String
+ * data nodes.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include <string.h>
+#include "ebtree.h"
+#include "ebpstree.h"
+
+/* These functions mirror the descents of ebistree.c/ebimtree.c, except that
+ * the key bytes needed by a branch decision are first looked for in the
+ * node's cached 8-byte prefix, and the out-of-line key is only dereferenced
+ * when the prefixes tie beyond it.
+ */
+
+/* Return the structure of type <type> whose member <member> points to <ptr> */
+#define ebps_entry(ptr, type, member) container_of(ptr, type, member)
+
+/* Build the inline prefix for the first <len> bytes of <key>, which must not
+ * contain a zero. Bytes past <len> are zero-padded like the trailing zero of
+ * a shorter key, and are never read.
+ */
+static inline uint64_t ebps_make_pfx_len(const void *key, unsigned int len)
+{
+	const unsigned char *b = key;
+	uint64_t pfx = 0;
+	unsigned int i;
+
+	if (len > 8)
+		len = 8;
+	for (i = 0; i < len; i++)
+		pfx |= (uint64_t)b[i] << (56 - (i << 3));
+	return pfx;
+}
+
+/* Return non-zero if prefix <pfx> holds a zero byte, ie if the whole key it
+ * was built from fits in the prefix, so that a prefix tie implies that the
+ * keys are equal up to and including the trailing zero.
+ */
+static inline int ebps_pfx_ends(uint64_t pfx)
+{
+	return (pfx - 0x0101010101010101ULL) & ~pfx & 0x8080808080808080ULL ? 1 : 0;
+}
+
+/* Equivalent of string_equal_bits(<x>, <node>->key, 0) with the first
+ * 8 bytes resolved from the cached prefixes. <xpfx> is the prefix built from
+ * <x>. The node's key is only dereferenced when the prefixes tie without
+ * holding the trailing zero. The tail is then compared from its start : the
+ * prefix tie proves the first 64 bits, so unlike a running hint taken from a
+ * previous node's key, this can never start past the end of a shorter key
+ * and mistake two different keys for equal ones. The result is thus always
+ * the exact common length, which the callers rely on.
+ */
+static inline int ebps_string_equal_bits(const unsigned char *x, uint64_t xpfx,
+					 const struct ebps_node *node)
+{
+	uint64_t pxor = xpfx ^ node->pfx;
+	int bit;
+
+	if (pxor)
+		return 64 - fls64(pxor);
+	if (ebps_pfx_ends(xpfx))
+		return -1; /* equal keys, the trailing zero was covered */
+	bit = string_equal_bits(x + 8, (unsigned char *)node->key + 8, 0);
+	return bit < 0 ? bit : bit + 64;
+}
+
+/* Equivalent of equal_bits(<x>, <node>->key, 0, <len>) with the first
+ * 8 bytes resolved from the cached prefixes. <len> must be a multiple of 8
+ * bits here, which is always the case for the byte-counted lengths below.
+ * Like above, the tail is compared from its start so the result is exact.
+ */
+static inline int ebps_equal_bits(const unsigned char *x, uint64_t xpfx,
+				  const struct ebps_node *node, int len)
+{
+	uint64_t pxor = xpfx ^ node->pfx;
+
+	if (len < 64)
+		pxor &= ~0ULL << (64 - len);
+	if (pxor)
+		return 64 - fls64(pxor);
+	if (len <= 64)
+		return len;
+	return 64 + equal_bits(x + 8, (unsigned char *)node->key + 8,
+			       0, len - 64);
+}
+
+/* Compare the first <len> bytes of <x> against the key of <node>, returning
+ * non-zero when they are all equal. The out-of-line key is only read past
+ * its prefix.
+ */
+static inline int ebps_equal_len(const unsigned char *x, uint64_t xpfx,
+				 const struct ebps_node *node, unsigned int len)
+{
+	uint64_t pxor = xpfx ^ node->pfx;
+
+	if (len < 8)
+		pxor &= ~0ULL << (64 - (len << 3));
+	if (pxor)
+		return 0;
+	if (len <= 8)
+		return 1;
+	return memcmp((const char *)node->key + 8, x + 8, len - 8) == 0;
+}
+
+/* Return the sign of the difference between keys <x> and <node>->key which
+ * are known to share exactly <pos> bits, like cmp_bits() would.
+ */
+static inline int ebps_cmp_bit(const unsigned char *x, uint64_t xpfx,
+			       const struct ebps_node *node, unsigned int pos)
+{
+	if (pos < 64)
+		return (int)((xpfx >> (63 - pos)) & 1) -
+		       (int)((node->pfx >> (63 - pos)) & 1);
+	return cmp_bits(x, node->key, pos);
+}
+
+/* Return bit <pos> of key <x> whose prefix is <xpfx>, reading the prefix
+ * whenever possible. Bits past a short key's trailing zero read as zero from
+ * the prefix, which is what the padded keys in the tree use as well.
+ */
+static inline unsigned int ebps_get_bit(const unsigned char *x, uint64_t xpfx,
+					unsigned int pos)
+{
+	if (pos < 64)
+		return (xpfx >> (63 - pos)) & 1;
+	return (x[pos >> 3] >> (~pos & 7)) & 1;
+}
+
+/* Return leftmost node in the tree, or NULL if none */
+struct ebps_node *ebps_first(struct eb_root *root)
+{
+	return ebps_entry(eb_first(root), struct ebps_node, node);
+}
+
+/* Return rightmost node in the tree, or NULL if none */
+struct ebps_node *ebps_last(struct eb_root *root)
+{
+	return ebps_entry(eb_last(root), struct ebps_node, node);
+}
+
+/* Return next node in the tree, or NULL if none */
+struct ebps_node *ebps_next(struct ebps_node *ebps)
+{
+	return ebps_entry(eb_next(&ebps->node), struct ebps_node, node);
+}
+
+/* Return previous node in the tree, or NULL if none */
+struct ebps_node *ebps_prev(struct ebps_node *ebps)
+{
+	return ebps_entry(eb_prev(&ebps->node), struct ebps_node, node);
+}
+
+/* Return next node in the tree, skipping duplicates, or NULL if none */
+struct ebps_node *ebps_next_unique(struct ebps_node *ebps)
+{
+	return ebps_entry(eb_next_unique(&ebps->node), struct ebps_node, node);
+}
+
+/* Return previous node in the tree, skipping duplicates, or NULL if none */
+struct ebps_node *ebps_prev_unique(struct ebps_node *ebps)
+{
+	return ebps_entry(eb_prev_unique(&ebps->node), struct ebps_node, node);
+}
+
+/* Delete node from the tree if it was linked in. Mark the node unused. */
+void ebps_delete(struct ebps_node *ebps)
+{
+	eb_delete(&ebps->node);
+}
+
+/* Find the first occurence of a zero-terminated string <x> in the tree <root>.
+ * It's the caller's reponsibility to use this function only on trees which
+ * only contain zero-terminated strings. If none can be found, return NULL.
+ */
+struct ebps_node *ebps_lookup(struct eb_root *root, const char *x)
+{
+	uint64_t xpfx = ebps_make_pfx(x);
+	struct ebps_node *node;
+	eb_troot_t *troot;
+	int bit;
+	int node_bit;
+
+	troot = root->b[EB_LEFT];
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	bit = 0;
+	while (1) {
+		if ((eb_gettag(troot) == EB_LEAF)) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct ebps_node, node.branches);
+			if (node->pfx != xpfx)
+				return NULL;
+			if (ebps_pfx_ends(xpfx) ||
+			    strcmp((const char *)node->key + 8, x + 8) == 0)
+				return node;
+			return NULL;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct ebps_node, node.branches);
+		node_bit = node->node.bit;
+
+		if (node_bit < 0) {
+			/* We have a dup tree now. Either it's for the same
+			 * value, and we walk down left, or it's a different
+			 * one and we don't have our key.
+			 */
+			if (node->pfx != xpfx)
+				return NULL;
+			if (!ebps_pfx_ends(xpfx) &&
+			    strcmp((const char *)node->key + 8, x + 8) != 0)
+				return NULL;
+
+			troot = node->node.branches.b[EB_LEFT];
+			while (eb_gettag(troot) != EB_LEAF)
+				troot = (eb_untag(troot, EB_NODE))->b[EB_LEFT];
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct ebps_node, node.branches);
+			return node;
+		}
+
+		/* OK, normal data node, let's walk down but don't compare data
+		 * if we already reached the end of the key.
+		 */
+		if (likely(bit >= 0)) {
+			bit = ebps_string_equal_bits((const unsigned char *)x, xpfx, node);
+			if (likely(bit < node_bit)) {
+				if (bit >= 0)
+					return NULL; /* no more common bits */
+
+				/* bit < 0 : we reached the end of the key. If we
+				 * are in a tree with unique keys, we can return
+				 * this node. Otherwise we have to walk it down
+				 * and stop comparing bits.
+				 */
+				if (eb_gettag(root->b[EB_RGHT]))
+					return node;
+			}
+		}
+
+		troot = node->node.branches.b[ebps_get_bit((const unsigned char *)x,
+							   xpfx, node_bit)];
+	}
+}
+
+/* Find the first occurence of a length <len> string <x> in the tree <root>.
+ * It's the caller's reponsibility to use this function only on trees which
+ * only contain zero-terminated strings, and that no null character is present
+ * in string <x> in the first <len> chars. If none can be found, return NULL.
+ */
+struct ebps_node *ebps_lookup_len(struct eb_root *root, const char *x, unsigned int len)
+{
+	struct ebps_node *node;
+	eb_troot_t *troot;
+	uint64_t xpfx = 0;
+	int len8;
+	int bit;
+	int node_bit;
+
+	troot = root->b[EB_LEFT];
+	if (unlikely(troot == NULL))
+		return NULL;
+
+	if (unlikely(len == 0))
+		goto walk_down;
+
+	xpfx = ebps_make_pfx_len(x, len);
+	len8 = len << 3;
+	bit = 0;
+	while (1) {
+		if (eb_gettag(troot) == EB_LEAF) {
+			node = container_of(eb_untag(troot, EB_LEAF),
+					    struct ebps_node, node.branches);
+			if (!ebps_equal_len((const unsigned char *)x, xpfx, node, len))
+				return NULL;
+			goto ret_term;
+		}
+		node = container_of(eb_untag(troot, EB_NODE),
+				    struct ebps_node, node.branches);
+		node_bit = node->node.bit;
+
+		if (node_bit < 0) {
+			/* We have a dup tree now. Either it's for the same
+			 * value, and we walk down left, or it's a different
+			 * one and we don't have our key.
+			 */
+			if (!ebps_equal_len((const unsigned char *)x, xpfx, node, len))
+				return NULL;
+			goto walk_left;
+		}
+
+		if (bit < node_bit) {
+			int tocheck = node_bit < len8 ? node_bit : len8;
+
+			bit = ebps_equal_bits((const unsigned char *)x, xpfx,
+					      node, tocheck);
+			if (bit < tocheck)
+				return NULL; /* no more common bits */
+			if (tocheck == len8)
+				goto walk_left; /* all <len> bytes matched */
+		}
+
+		troot = node->node.branches.b[ebps_get_bit((const unsigned char *)x,
+							   xpfx, node_bit)];
+	}
+ walk_left:
+	troot = node->node.branches.b[EB_LEFT];
+ walk_down:
+	while (eb_gettag(troot) != EB_LEAF)
+		troot = (eb_untag(troot, EB_NODE))->b[EB_LEFT];
+	node = container_of(eb_untag(troot, EB_LEAF),
+			    struct ebps_node, node.branches);
+ ret_term:
+	if (((const char *)node->key)[len] != 0)
+		return NULL;
+	return node;
+}
+
+/* Insert ebps_node <new> into subtree starting at node root <root>. The key
+ * must have been set with ebps_set_key() so that the cached prefix matches
+ * the zero-terminated string it designates. The ebps_node is returned. If
+ * root->b[EB_RGHT]==1, the tree may only contain unique keys.
+ */
+struct ebps_node *ebps_insert(struct eb_root *root, struct ebps_node *new)
+{
+	struct ebps_node *old;
+	unsigned int side;
+	eb_troot_t *troot;
+	eb_troot_t *root_right = root;
+	int diff;
+	int bit;
+	int old_node_bit;
+
+	side = EB_LEFT;
+	troot = root->b[EB_LEFT];
+	root_right = root->b[EB_RGHT];
+	if (unlikely(troot == NULL)) {
+		/* Tree is empty, insert the leaf part below the left branch */
+		root->b[EB_LEFT] = eb_dotag(&new->node.branches, EB_LEAF);
+		new->node.leaf_p = eb_dotag(root, EB_LEFT);
+		new->node.node_p = NULL; /* node part unused */
+		EB_THR_LINK(&new->node);
+		return new;
+	}
+
+	/* The tree descent is fairly easy :
+	 *  - first, check if we have reached a leaf node
+	 *  - second, check if we have gone too far
+	 *  - third, reiterate
+	 * Everywhere, we use <new> for the node node we are inserting, <root>
+	 * for the node we attach it to, and <old> for the node we are
+	 * displacing below <new>. <troot> will always point to the future node
+	 * (tagged with its type). <side> carries the side the node <new> is
+	 * attached to below its parent, which is also where previous node
+	 * was attached.
+	 */
+
+	bit = 0;
+	while (1) {
+		if (unlikely(eb_gettag(troot) == EB_LEAF)) {
+			eb_troot_t *new_left, *new_rght;
+			eb_troot_t *new_leaf, *old_leaf;
+
+			old = container_of(eb_untag(troot, EB_LEAF),
+					    struct ebps_node, node.branches);
+
+			new_left = eb_dotag(&new->node.branches, EB_LEFT);
+			new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+			new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+			old_leaf = eb_dotag(&old->node.branches, EB_LEAF);
+
+			new->node.node_p = old->node.leaf_p;
+
+			/* Right here, we have 3 possibilities :
+			 * - the tree does not contain the key, and we have
+			 *   new->key < old->key. We insert new above old, on
+			 *   the left ;
+			 *
+			 * - the tree does not contain the key, and we have
+			 *   new->key > old->key. We insert new above old, on
+			 *   the right ;
+			 *
+			 * - the tree does contain the key, which implies it
+			 *   is alone. We add the new key next to it as a
+			 *   first duplicate.
+			 *
+			 * The last two cases can easily be partially merged.
+			 */
+			if (bit >= 0)
+				bit = ebps_string_equal_bits(new->key, new->pfx, old);
+
+			if (bit < 0) {
+				/* key was already there */
+
+				/* we may refuse to duplicate this key if the tree is
+				 * tagged as containing only unique keys.
+				 */
+				if (eb_gettag(root_right))
+					return old;
+
+				/* new arbitrarily goes to the right and tops the dup tree */
+				old->node.leaf_p = new_left;
+				new->node.leaf_p = new_rght;
+				new->node.branches.b[EB_LEFT] = old_leaf;
+				new->node.branches.b[EB_RGHT] = new_leaf;
+				new->node.bit = -1;
+				root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+				EB_THR_LINK(&new->node);
+				return new;
+			}
+
+			diff = ebps_cmp_bit(new->key, new->pfx, old, bit);
+			if (diff < 0) {
+				/* new->key < old->key, new takes the left */
+				new->node.leaf_p = new_left;
+				old->node.leaf_p = new_rght;
+				new->node.branches.b[EB_LEFT] = new_leaf;
+				new->node.branches.b[EB_RGHT] = old_leaf;
+			} else {
+				/* new->key > old->key, new takes the right */
+				old->node.leaf_p = new_left;
+				new->node.leaf_p = new_rght;
+				new->node.branches.b[EB_LEFT] = old_leaf;
+				new->node.branches.b[EB_RGHT] = new_leaf;
+			}
+			break;
+		}
+
+		/* OK we're walking down this link */
+		old = container_of(eb_untag(troot, EB_NODE),
+				   struct ebps_node, node.branches);
+		old_node_bit = old->node.bit;
+
+		/* Stop going down when we don't have common bits anymore. We
+		 * also stop in front of a duplicates tree because it means we
+		 * have to insert above. Note: we can compare more bits than
+		 * the current node's because as long as they are identical, we
+		 * know we descend along the correct side.
+		 */
+		if (bit >= 0 && (bit < old_node_bit || old_node_bit < 0))
+			bit = ebps_string_equal_bits(new->key, new->pfx, old);
+
+		if (unlikely(bit < 0)) {
+			/* Perfect match, we must only stop on head of dup tree
+			 * or walk down to a leaf.
+			 */
+			if (old_node_bit < 0) {
+				/* We know here that ebps_string_equal_bits matched all
+				 * bits and that we're on top of a dup tree, then
+				 * we can perform the dup insertion and return.
+				 */
+				struct eb_node *ret;
+				ret = eb_insert_dup(&old->node, &new->node);
+				return container_of(ret, struct ebps_node, node);
+			}
+			/* OK so let's walk down */
+		}
+		else if (bit < old_node_bit || old_node_bit < 0) {
+			/* The tree did not contain the key, or we stopped on top of a dup
+			 * tree, possibly containing the key. In the former case, we insert
+			 * <new> before the node <old>, and set ->bit to designate the lowest
+			 * bit position in <new> which applies to ->branches.b[]. In the later
+			 * case, we add the key to the existing dup tree. Note that we cannot
+			 * enter here if we match an intermediate node's key that is not the
+			 * head of a dup tree.
+			 */
+			eb_troot_t *new_left, *new_rght;
+			eb_troot_t *new_leaf, *old_node;
+
+			new_left = eb_dotag(&new->node.branches, EB_LEFT);
+			new_rght = eb_dotag(&new->node.branches, EB_RGHT);
+			new_leaf = eb_dotag(&new->node.branches, EB_LEAF);
+			old_node = eb_dotag(&old->node.branches, EB_NODE);
+
+			new->node.node_p = old->node.node_p;
+
+			/* we can never match all bits here */
+			diff = ebps_cmp_bit(new->key, new->pfx, old, bit);
+			if (diff < 0) {
+				new->node.leaf_p = new_left;
+				old->node.node_p = new_rght;
+				new->node.branches.b[EB_LEFT] = new_leaf;
+				new->node.branches.b[EB_RGHT] = old_node;
+			}
+			else {
+				old->node.node_p = new_left;
+				new->node.leaf_p = new_rght;
+				new->node.branches.b[EB_LEFT] = old_node;
+				new->node.branches.b[EB_RGHT] = new_leaf;
+			}
+			break;
+		}
+
+		/* walk down */
+		root = &old->node.branches;
+		side = ebps_get_bit(new->key, new->pfx, old_node_bit);
+		troot = root->b[side];
+	}
+
+	/* Ok, now we are inserting <new> between <root> and <old>. <old>'s
+	 * parent is already set to <new>, and the <root>'s branch is still in
+	 * <side>. Update the root's leaf till we have it. Note that we can also
+	 * find the side by checking the side of new->node.node_p.
+	 */
+
+	/* We need the common higher bits between new->key and old->key.
+	 * This number of bits is already in <bit>.
+	 * NOTE: we can't get here whit bit < 0 since we found a dup !
+	 */
+	new->node.bit = bit;
+	root->b[side] = eb_dotag(&new->node.branches, EB_NODE);
+	EB_THR_LINK(&new->node);
+	return new;
+}
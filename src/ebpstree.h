@@ -0,0 +1,86 @@
+/*
+ * Elastic Binary Trees - macros to manipulate prefix-cached Indirect String
+ * data nodes.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBPSTREE_H
+#define _EBPSTREE_H
+
+#include <string.h>
+#include "ebtree.h"
+
+/* This structure carries a node, a pointer to an indirect zero-terminated
+ * string key, and an inline copy of the first 8 key bytes. The descents of
+ * ebis trees spend more time on the dependent fetch of the out-of-line key
+ * than in the tree logic itself, so here most branch decisions are resolved
+ * from the cached prefix and the key pointer is only dereferenced when the
+ * prefixes tie beyond 8 bytes. The prefix is loaded most significant byte
+ * first so that integer comparisons rank like strcmp(), and is zero-padded
+ * past the trailing zero. It must always be set with ebps_set_key() so that
+ * it stays consistent with the bytes the pointer designates.
+ */
+struct ebps_node {
+	struct eb_node node; /* the tree node, must be at the beginning */
+	void *key;
+	uint64_t pfx;        /* first 8 key bytes, MSB first, zero-padded */
+};
+
+/* Build the inline prefix for the zero-terminated string <key> : up to 8
+ * bytes are loaded most significant first, and nothing is read past the
+ * trailing zero.
+ */
+static inline uint64_t ebps_make_pfx(const void *key)
+{
+	const unsigned char *b = key;
+	uint64_t pfx = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (!b[i])
+			break;
+		pfx |= (uint64_t)b[i] << (56 - (i << 3));
+	}
+	return pfx;
+}
+
+/* Set <key> as the key of node <node> and refresh the cached prefix. This
+ * must be used instead of assigning ->key directly, and called again if the
+ * designated bytes are modified while the node is not in a tree.
+ */
+static inline void ebps_set_key(struct ebps_node *node, void *key)
+{
+	node->key = key;
+	node->pfx = ebps_make_pfx(key);
+}
+
+/* Return leftmost node in the tree, or NULL if none */
+extern struct ebps_node *ebps_first(struct eb_root *root);
+
+/* Return rightmost node in the tree, or NULL if none */
+extern struct ebps_node *ebps_last(struct eb_root *root);
+
+/* Return next node in the tree, or NULL if none */
+extern struct ebps_node *ebps_next(struct ebps_node *ebps);
+
+/* Return previous node in the tree, or NULL if none */
+extern struct ebps_node *ebps_prev(struct ebps_node *ebps);
+
+/* Return next node in the tree, skipping duplicates, or NULL if none */
+extern struct ebps_node *ebps_next_unique(struct ebps_node *ebps);
+
+/* Return previous node in the tree, skipping duplicates, or NULL if none */
+extern struct ebps_node *ebps_prev_unique(struct ebps_node *ebps);
+
+/* Delete node from the tree if it was linked in. Mark the node unused. */
+extern void ebps_delete(struct ebps_node *ebps);
+
+extern struct ebps_node *ebps_lookup(struct eb_root *root, const char *x);
+extern struct ebps_node *ebps_lookup_len(struct eb_root *root, const char *x, unsigned int len);
+extern struct ebps_node *ebps_insert(struct eb_root *root, struct ebps_node *new);
+
+#endif /* _EBPSTREE_H */
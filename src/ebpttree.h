@@ -11,8 +11,6 @@
 #define _EBPTTREE_H
 
 #include "ebtree.h"
-#include "eb32tree.h"
-#include "eb64tree.h"
 
 
 #define EBPT_ROOT	EB_ROOT
@@ -29,7 +27,8 @@ typedef PTR_INT_TYPE ptr_t;
  * eb_node so that it can be cast into an eb_node. We could also have put some
  * sort of transparent union here to reduce the indirection level, but the fact
  * is, the end user is not meant to manipulate internals, so this is pointless.
- * Internally, it is automatically cast as an eb32_node or eb64_node.
+ * The descents handle the key directly as a ptr_t, ie at the platform's
+ * native pointer width.
  */
 struct ebpt_node {
 	struct eb_node node; /* the tree node, must be at the beginning */
@@ -66,7 +65,7 @@ extern struct ebpt_node *ebpt_prev_unique(struct ebpt_node *ebpt);
 extern void ebpt_delete(struct ebpt_node *ebpt);
 
 /*
- * The following functions are inlined but derived from the integer versions.
+ * The following functions perform the descents natively on the ptr_t key.
  */
 extern struct ebpt_node *ebpt_lookup(struct eb_root *root, void *x);
 
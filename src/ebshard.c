@@ -0,0 +1,238 @@
+/*
+ * Elastic Binary Trees - sharded tree wrapper for parallel writers.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include <stdlib.h>
+#include "ebshard.h"
+
+/* Tiny test-and-set spinlock over the bucket's lock byte. Shard critical
+ * sections only cover one tree operation, so contention is short and a
+ * plain spin with a relaxed re-read is enough.
+ */
+static inline void eb_shard_lock(char *lock)
+{
+	while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void eb_shard_unlock(char *lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+/* Round <n> up to a power of two, with a minimum of 1 */
+static inline unsigned int eb_shard_round(unsigned int n)
+{
+	unsigned int r = 1;
+
+	while (r < n)
+		r <<= 1;
+	return r;
+}
+
+int eb64_shard_init(struct eb64_shard *shard, unsigned int shards, int unique)
+{
+	unsigned int i;
+
+	shards = eb_shard_round(shards);
+	shard->buckets = calloc(shards, sizeof(*shard->buckets));
+	if (!shard->buckets)
+		return -1;
+
+	shard->mask = shards - 1;
+	shard->shift = 64;
+	while (shards > 1) {
+		shard->shift--;
+		shards >>= 1;
+	}
+	for (i = 0; i <= shard->mask; i++)
+		shard->buckets[i].root.b[EB_RGHT] = unique ? (eb_troot_t *)1 : NULL;
+	return 0;
+}
+
+void eb64_shard_destroy(struct eb64_shard *shard)
+{
+	free(shard->buckets);
+	shard->buckets = NULL;
+}
+
+/* Return the bucket covering key <x>. With a single shard the shift equals
+ * the key width, which a shift instruction would not perform, hence the
+ * explicit mask check.
+ */
+static inline struct eb64_shard_bucket *eb64_shard_of(struct eb64_shard *shard, uint64_t x)
+{
+	return &shard->buckets[shard->mask ? (unsigned int)(x >> shard->shift) : 0];
+}
+
+struct eb64_node *eb64_shard_insert(struct eb64_shard *shard, struct eb64_node *new)
+{
+	struct eb64_shard_bucket *b = eb64_shard_of(shard, new->key);
+	struct eb64_node *ret;
+
+	eb_shard_lock(&b->lock);
+	ret = eb64_insert(&b->root, new);
+	eb_shard_unlock(&b->lock);
+	return ret;
+}
+
+void eb64_shard_delete(struct eb64_shard *shard, struct eb64_node *eb64)
+{
+	struct eb64_shard_bucket *b = eb64_shard_of(shard, eb64->key);
+
+	eb_shard_lock(&b->lock);
+	eb64_delete(eb64);
+	eb_shard_unlock(&b->lock);
+}
+
+struct eb64_node *eb64_shard_lookup(struct eb64_shard *shard, uint64_t x)
+{
+	struct eb64_shard_bucket *b = eb64_shard_of(shard, x);
+	struct eb64_node *ret;
+
+	eb_shard_lock(&b->lock);
+	ret = eb64_lookup(&b->root, x);
+	eb_shard_unlock(&b->lock);
+	return ret;
+}
+
+/* Return the first node of the first non-empty shard at index <i> or above,
+ * or NULL when all remaining shards are empty.
+ */
+static struct eb64_node *eb64_shard_first_from(struct eb64_shard *shard, unsigned int i)
+{
+	struct eb64_node *ret;
+
+	for (; i <= shard->mask; i++) {
+		struct eb64_shard_bucket *b = &shard->buckets[i];
+
+		eb_shard_lock(&b->lock);
+		ret = eb64_first(&b->root);
+		eb_shard_unlock(&b->lock);
+		if (ret)
+			return ret;
+	}
+	return NULL;
+}
+
+struct eb64_node *eb64_shard_first(struct eb64_shard *shard)
+{
+	return eb64_shard_first_from(shard, 0);
+}
+
+struct eb64_node *eb64_shard_next(struct eb64_shard *shard, struct eb64_node *eb64)
+{
+	struct eb64_shard_bucket *b = eb64_shard_of(shard, eb64->key);
+	unsigned int i = b - shard->buckets;
+	struct eb64_node *ret;
+
+	eb_shard_lock(&b->lock);
+	ret = eb64_next(eb64);
+	eb_shard_unlock(&b->lock);
+	if (ret)
+		return ret;
+	return eb64_shard_first_from(shard, i + 1);
+}
+
+int eb32_shard_init(struct eb32_shard *shard, unsigned int shards, int unique)
+{
+	unsigned int i;
+
+	shards = eb_shard_round(shards);
+	shard->buckets = calloc(shards, sizeof(*shard->buckets));
+	if (!shard->buckets)
+		return -1;
+
+	shard->mask = shards - 1;
+	shard->shift = 32;
+	while (shards > 1) {
+		shard->shift--;
+		shards >>= 1;
+	}
+	for (i = 0; i <= shard->mask; i++)
+		shard->buckets[i].root.b[EB_RGHT] = unique ? (eb_troot_t *)1 : NULL;
+	return 0;
+}
+
+void eb32_shard_destroy(struct eb32_shard *shard)
+{
+	free(shard->buckets);
+	shard->buckets = NULL;
+}
+
+static inline struct eb32_shard_bucket *eb32_shard_of(struct eb32_shard *shard, uint32_t x)
+{
+	return &shard->buckets[shard->mask ? x >> shard->shift : 0];
+}
+
+struct eb32_node *eb32_shard_insert(struct eb32_shard *shard, struct eb32_node *new)
+{
+	struct eb32_shard_bucket *b = eb32_shard_of(shard, new->key);
+	struct eb32_node *ret;
+
+	eb_shard_lock(&b->lock);
+	ret = eb32_insert(&b->root, new);
+	eb_shard_unlock(&b->lock);
+	return ret;
+}
+
+void eb32_shard_delete(struct eb32_shard *shard, struct eb32_node *eb32)
+{
+	struct eb32_shard_bucket *b = eb32_shard_of(shard, eb32->key);
+
+	eb_shard_lock(&b->lock);
+	eb32_delete(eb32);
+	eb_shard_unlock(&b->lock);
+}
+
+struct eb32_node *eb32_shard_lookup(struct eb32_shard *shard, uint32_t x)
+{
+	struct eb32_shard_bucket *b = eb32_shard_of(shard, x);
+	struct eb32_node *ret;
+
+	eb_shard_lock(&b->lock);
+	ret = eb32_lookup(&b->root, x);
+	eb_shard_unlock(&b->lock);
+	return ret;
+}
+
+static struct eb32_node *eb32_shard_first_from(struct eb32_shard *shard, unsigned int i)
+{
+	struct eb32_node *ret;
+
+	for (; i <= shard->mask; i++) {
+		struct eb32_shard_bucket *b = &shard->buckets[i];
+
+		eb_shard_lock(&b->lock);
+		ret = eb32_first(&b->root);
+		eb_shard_unlock(&b->lock);
+		if (ret)
+			return ret;
+	}
+	return NULL;
+}
+
+struct eb32_node *eb32_shard_first(struct eb32_shard *shard)
+{
+	return eb32_shard_first_from(shard, 0);
+}
+
+struct eb32_node *eb32_shard_next(struct eb32_shard *shard, struct eb32_node *eb32)
+{
+	struct eb32_shard_bucket *b = eb32_shard_of(shard, eb32->key);
+	unsigned int i = b - shard->buckets;
+	struct eb32_node *ret;
+
+	eb_shard_lock(&b->lock);
+	ret = eb32_next(eb32);
+	eb_shard_unlock(&b->lock);
+	if (ret)
+		return ret;
+	return eb32_shard_first_from(shard, i + 1);
+}
@@ -0,0 +1,99 @@
+/*
+ * Elastic Binary Trees - sharded tree wrapper for parallel writers.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBSHARD_H
+#define _EBSHARD_H
+
+#include "eb32tree.h"
+#include "eb64tree.h"
+
+/* A sharded tree splits the key space over a power-of-two array of regular
+ * trees, each guarded by its own spinlock, so that writers working on
+ * different key ranges no longer serialize on a single tree lock. The shard
+ * is selected from the top bits of the key, which keeps each shard covering
+ * a contiguous key range : a walk visiting the shards in index order thus
+ * returns the keys in the same global order as a single tree would, and the
+ * merged iteration degenerates to a cheap concatenation instead of a k-way
+ * merge.
+ *
+ * The insert/delete/lookup wrappers take the shard's lock around the
+ * underlying tree operation. The first/next walk also locks each shard it
+ * inspects, but the returned node is unprotected once the call returns, so
+ * walking a tree which is concurrently modified requires the usual external
+ * care (e.g. the grace period mechanism of eb_delete_rcu). Note that the
+ * top-bits split makes the balance depend on the key distribution ; keys
+ * sharing their upper bits will pile up in few shards.
+ */
+
+/* One shard : a tree root and its lock, padded to a cache line so that
+ * writers hammering different shards do not false-share.
+ */
+struct eb64_shard_bucket {
+	struct eb_root root;
+	char lock;
+} __attribute__((aligned(64)));
+
+struct eb64_shard {
+	unsigned int shift;		/* key bits shifted out to get the index */
+	unsigned int mask;		/* number of shards minus one */
+	struct eb64_shard_bucket *buckets;
+};
+
+struct eb32_shard_bucket {
+	struct eb_root root;
+	char lock;
+} __attribute__((aligned(64)));
+
+struct eb32_shard {
+	unsigned int shift;		/* key bits shifted out to get the index */
+	unsigned int mask;		/* number of shards minus one */
+	struct eb32_shard_bucket *buckets;
+};
+
+/*
+ * Exported functions and macros.
+ */
+
+/* Initialize <shard> with <shards> empty trees, rounded up to a power of
+ * two. If <unique> is non-zero the trees only accept unique keys. Returns 0
+ * on success, -1 on allocation failure.
+ */
+extern int eb64_shard_init(struct eb64_shard *shard, unsigned int shards, int unique);
+
+/* Release the memory held by <shard>. The trees must already be empty. */
+extern void eb64_shard_destroy(struct eb64_shard *shard);
+
+/* Insert node <new> into its shard of <shard>, under the shard's lock.
+ * Returns <new>, or the existing node when the keys are unique and the key
+ * was already present.
+ */
+extern struct eb64_node *eb64_shard_insert(struct eb64_shard *shard, struct eb64_node *new);
+
+/* Delete node <eb64> from its shard of <shard>, under the shard's lock. */
+extern void eb64_shard_delete(struct eb64_shard *shard, struct eb64_node *eb64);
+
+/* Find the first occurrence of key <x> in <shard>, or NULL if absent. */
+extern struct eb64_node *eb64_shard_lookup(struct eb64_shard *shard, uint64_t x);
+
+/* Return the node with the lowest key in <shard>, or NULL if empty. */
+extern struct eb64_node *eb64_shard_first(struct eb64_shard *shard);
+
+/* Return the node following <eb64> in global key order, or NULL if none. */
+extern struct eb64_node *eb64_shard_next(struct eb64_shard *shard, struct eb64_node *eb64);
+
+/* Same as above for 32-bit keys. */
+extern int eb32_shard_init(struct eb32_shard *shard, unsigned int shards, int unique);
+extern void eb32_shard_destroy(struct eb32_shard *shard);
+extern struct eb32_node *eb32_shard_insert(struct eb32_shard *shard, struct eb32_node *new);
+extern void eb32_shard_delete(struct eb32_shard *shard, struct eb32_node *eb32);
+extern struct eb32_node *eb32_shard_lookup(struct eb32_shard *shard, uint32_t x);
+extern struct eb32_node *eb32_shard_first(struct eb32_shard *shard);
+extern struct eb32_node *eb32_shard_next(struct eb32_shard *shard, struct eb32_node *eb32);
+
+#endif /* _EBSHARD_H */
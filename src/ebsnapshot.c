@@ -0,0 +1,238 @@
+/*
+ * Elastic Binary Trees - memory-mapped tree snapshots.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+/* Rebuilding a multi-gigabyte tree with one insert per key on every restart
+ * is a waste when the data did not change. This module dumps a tree and its
+ * items into a file in which every tree pointer is replaced by the offset of
+ * its target from the beginning of the file, keeping the branch type in the
+ * lowest bit just like in memory. Loading then only consists in mmap()ing
+ * the file and adding the mapping address back in one linear pass; the items'
+ * own payload is copied verbatim, so it must not contain pointers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ebsnapshot.h"
+
+/* The translation context used while saving : the address of each item's
+ * eb_node in walk order, plus the same array sorted by address so that a
+ * pointer can be resolved to its walk index by binary search.
+ */
+struct eb_snapshot_ref {
+	struct eb_node *node;   /* address of the item's eb_node */
+	uint64_t idx;           /* its index in walk order */
+};
+
+static int eb_snapshot_ref_cmp(const void *a, const void *b)
+{
+	const struct eb_snapshot_ref *ra = a;
+	const struct eb_snapshot_ref *rb = b;
+
+	if (ra->node < rb->node)
+		return -1;
+	return ra->node > rb->node;
+}
+
+/* Convert tagged pointer <ptr> to its offset-encoded on-disk form. Values not
+ * larger than one (NULL and the unique-keys marker) are kept as they are.
+ * Pointers to the root are redirected to the root embedded in the header.
+ */
+static uint64_t eb_snapshot_encode(const struct eb_snapshot_hdr *hdr,
+				   const struct eb_snapshot_ref *refs,
+				   const struct eb_root *root, eb_troot_t *ptr)
+{
+	uintptr_t v = (uintptr_t)ptr;
+	uint64_t tag = v & 1;
+	uint64_t lo, hi;
+	struct eb_node *node;
+
+	if (v <= 1)
+		return v;
+
+	if ((void *)(v - tag) == (const void *)root)
+		return offsetof(struct eb_snapshot_hdr, root) + tag;
+
+	/* The untagged pointer aims at a node's branches, which are at the
+	 * beginning of the eb_node.
+	 */
+	node = (struct eb_node *)(v - tag);
+	lo = 0;
+	hi = hdr->count;
+	while (lo < hi) {
+		uint64_t mid = (lo + hi) / 2;
+
+		if (refs[mid].node < node)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return sizeof(*hdr) + refs[lo].idx * hdr->item_size + hdr->node_off + tag;
+}
+
+/* Serialize into file <path> the tree <root>, whose items are <item_size>
+ * bytes each with their eb_node located <node_off> bytes inside. The file is
+ * created or truncated. Returns 0 on success, -1 on error with errno set.
+ */
+int eb_snapshot_save(struct eb_root *root, const char *path,
+		     size_t item_size, size_t node_off)
+{
+	struct eb_snapshot_hdr hdr;
+	struct eb_snapshot_ref *refs;
+	struct eb_node *node;
+	char *buf;
+	uint64_t idx;
+	int fd, ret = -1;
+
+	hdr.magic = EB_SNAPSHOT_MAGIC;
+	hdr.version = EB_SNAPSHOT_VERSION;
+	hdr.item_size = item_size;
+	hdr.node_off = node_off;
+	hdr.count = 0;
+	for (node = eb_first(root); node; node = eb_next(node))
+		hdr.count++;
+
+	refs = malloc((hdr.count + 1) * sizeof(*refs));
+	buf = malloc(item_size);
+	if (!refs || !buf) {
+		free(refs);
+		free(buf);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	idx = 0;
+	for (node = eb_first(root); node; node = eb_next(node)) {
+		refs[idx].node = node;
+		refs[idx].idx = idx;
+		idx++;
+	}
+	qsort(refs, hdr.count, sizeof(*refs), eb_snapshot_ref_cmp);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		goto out;
+
+	hdr.root.b[EB_LEFT] = (eb_troot_t *)eb_snapshot_encode(&hdr, refs, root, root->b[EB_LEFT]);
+	hdr.root.b[EB_RGHT] = (eb_troot_t *)eb_snapshot_encode(&hdr, refs, root, root->b[EB_RGHT]);
+	if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))
+		goto out_close;
+
+	for (node = eb_first(root); node; node = eb_next(node)) {
+		struct eb_node *copy = (struct eb_node *)(buf + node_off);
+
+		memcpy(buf, (char *)node - node_off, item_size);
+		copy->branches.b[EB_LEFT] = (eb_troot_t *)eb_snapshot_encode(&hdr, refs, root, node->branches.b[EB_LEFT]);
+		copy->branches.b[EB_RGHT] = (eb_troot_t *)eb_snapshot_encode(&hdr, refs, root, node->branches.b[EB_RGHT]);
+		copy->node_p = (eb_troot_t *)eb_snapshot_encode(&hdr, refs, root, node->node_p);
+		copy->leaf_p = (eb_troot_t *)eb_snapshot_encode(&hdr, refs, root, node->leaf_p);
+#ifdef EB_THREADED
+		/* the threads are rebuilt from the layout at load time */
+		copy->thr_next = NULL;
+		copy->thr_prev = NULL;
+#endif
+		if (write(fd, buf, item_size) != (ssize_t)item_size)
+			goto out_close;
+	}
+	ret = 0;
+
+ out_close:
+	if (close(fd) < 0)
+		ret = -1;
+ out:
+	free(refs);
+	free(buf);
+	return ret;
+}
+
+/* Relocate on-disk offset <v> by the mapping address <base>. Values not
+ * larger than one are kept as they are, and the type tag travels in the
+ * lowest bit of the offset.
+ */
+static inline eb_troot_t *eb_snapshot_decode(char *base, eb_troot_t *v)
+{
+	if ((uintptr_t)v <= 1)
+		return v;
+	return (eb_troot_t *)(base + (uintptr_t)v);
+}
+
+/* Map the snapshot file <path> and rebuild its pointers in one linear pass.
+ * Returns the tree root living inside the mapping, usable with the regular
+ * tree functions, or NULL on error with errno set (EINVAL when the file does
+ * not look like a snapshot). <snap> is filled for eb_snapshot_close().
+ */
+struct eb_root *eb_snapshot_load(const char *path, struct eb_snapshot *snap)
+{
+	struct eb_snapshot_hdr *hdr;
+	struct stat st;
+	char *base;
+	uint64_t idx;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	hdr = (struct eb_snapshot_hdr *)base;
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+	    hdr->magic != EB_SNAPSHOT_MAGIC ||
+	    hdr->version != EB_SNAPSHOT_VERSION ||
+	    sizeof(*hdr) + hdr->count * hdr->item_size > (uint64_t)st.st_size) {
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hdr->root.b[EB_LEFT] = eb_snapshot_decode(base, hdr->root.b[EB_LEFT]);
+	hdr->root.b[EB_RGHT] = eb_snapshot_decode(base, hdr->root.b[EB_RGHT]);
+
+	for (idx = 0; idx < hdr->count; idx++) {
+		struct eb_node *node = (struct eb_node *)
+			(base + sizeof(*hdr) + idx * hdr->item_size + hdr->node_off);
+
+		node->branches.b[EB_LEFT] = eb_snapshot_decode(base, node->branches.b[EB_LEFT]);
+		node->branches.b[EB_RGHT] = eb_snapshot_decode(base, node->branches.b[EB_RGHT]);
+		node->node_p = eb_snapshot_decode(base, node->node_p);
+		node->leaf_p = eb_snapshot_decode(base, node->leaf_p);
+#ifdef EB_THREADED
+		/* the items lie in walk order : the neighbor threads simply
+		 * follow the layout.
+		 */
+		node->thr_prev = idx ? (struct eb_node *)((char *)node - hdr->item_size) : NULL;
+		node->thr_next = (idx + 1 < hdr->count) ?
+			(struct eb_node *)((char *)node + hdr->item_size) : NULL;
+#endif
+	}
+
+	snap->map = base;
+	snap->size = st.st_size;
+	return &hdr->root;
+}
+
+/* Release the mapping of a loaded snapshot. All its items become invalid. */
+void eb_snapshot_close(struct eb_snapshot *snap)
+{
+	munmap(snap->map, snap->size);
+	snap->map = NULL;
+	snap->size = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Elastic Binary Trees - memory-mapped tree snapshots.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBSNAPSHOT_H
+#define _EBSNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ebtree.h"
+
+/* On-disk snapshot header. The items follow it in tree walk order, and all
+ * the tree pointers in the file (including the root's branches) are encoded
+ * as offsets from the beginning of the file, with the branch type kept in
+ * the lowest bit just like in memory.
+ */
+struct eb_snapshot_hdr {
+	uint32_t magic;         /* EB_SNAPSHOT_MAGIC */
+	uint32_t version;       /* EB_SNAPSHOT_VERSION */
+	uint64_t item_size;     /* size of one item, in bytes */
+	uint64_t node_off;      /* offset of the eb_node inside each item */
+	uint64_t count;         /* number of items in the file */
+	struct eb_root root;    /* the tree root, offset-encoded on disk */
+};
+
+#define EB_SNAPSHOT_MAGIC	0x45425453U /* "EBTS" */
+#define EB_SNAPSHOT_VERSION	1
+
+/* A loaded snapshot : the mapping and its size, kept so that it can be
+ * released with eb_snapshot_close().
+ */
+struct eb_snapshot {
+	void *map;
+	size_t size;
+};
+
+/*
+ * Exported functions and macros.
+ */
+
+/* Serialize into file <path> the tree <root>, whose items are <item_size>
+ * bytes each with their eb_node located <node_off> bytes inside. Returns 0
+ * on success, -1 on error with errno set.
+ */
+extern int eb_snapshot_save(struct eb_root *root, const char *path, size_t item_size, size_t node_off);
+
+/* Map the snapshot file <path> and rebuild its pointers in one linear pass.
+ * Returns the tree root living inside the mapping, usable with the regular
+ * tree functions, or NULL on error with errno set. <snap> is filled for a
+ * later eb_snapshot_close().
+ */
+extern struct eb_root *eb_snapshot_load(const char *path, struct eb_snapshot *snap);
+
+/* Release the mapping of a loaded snapshot. All its items become invalid. */
+extern void eb_snapshot_close(struct eb_snapshot *snap);
+
+#endif /* _EBSNAPSHOT_H */
@@ -0,0 +1,169 @@
+/*
+ * Elastic Binary Trees - optional per-tree statistics.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ebstats.h"
+
+#ifdef EB_STATS
+
+/* The trees carry no room for statistics, so they are kept aside in a small
+ * registry keyed by the root pointer. The list is scanned linearly, which is
+ * fine for the handful of trees one typically instruments at once.
+ */
+struct eb_stats_reg {
+	struct eb_stats_reg *next;
+	struct eb_root *root;
+	struct eb_stats stats;
+};
+
+static struct eb_stats_reg *eb_stats_list;
+
+/* Return the statistics of tree <root>, creating them on first use, or NULL
+ * on allocation failure (in which case the event is simply not accounted).
+ */
+static struct eb_stats *eb_stats_of(struct eb_root *root)
+{
+	struct eb_stats_reg *reg;
+
+	for (reg = eb_stats_list; reg; reg = reg->next)
+		if (reg->root == root)
+			return &reg->stats;
+
+	reg = calloc(1, sizeof(*reg));
+	if (!reg)
+		return NULL;
+	reg->root = root;
+	reg->next = eb_stats_list;
+	eb_stats_list = reg;
+	return &reg->stats;
+}
+
+/* Climb from parent link <t> of a linked node up to the root of its tree.
+ * The root is the only eb_root reached by a left link whose right branch
+ * carries no pointer, since regular nodes always have both branches in use.
+ */
+static struct eb_root *eb_stats_root(eb_troot_t *t)
+{
+	while (1) {
+		struct eb_root *r = eb_untag(t, eb_gettag(t));
+
+		if (eb_gettag(t) == EB_LEFT && eb_clrtag(r->b[EB_RGHT]) == NULL)
+			return r;
+		t = eb_root_to_node(r)->node_p;
+	}
+}
+
+static inline void eb_stats_bucket(unsigned long *hist, unsigned int depth)
+{
+	hist[depth < EB_STATS_BUCKETS ? depth : EB_STATS_BUCKETS - 1]++;
+}
+
+/* Account a lookup which visited <depth> levels in tree <root>. */
+void __eb_stats_lookup(struct eb_root *root, unsigned int depth)
+{
+	struct eb_stats *stats = eb_stats_of(root);
+
+	if (!stats)
+		return;
+	stats->lookups++;
+	eb_stats_bucket(stats->depth, depth);
+}
+
+/* Account an insertion which visited <depth> levels in tree <root>. */
+void __eb_stats_insert(struct eb_root *root, unsigned int depth)
+{
+	struct eb_stats *stats = eb_stats_of(root);
+
+	if (!stats)
+		return;
+	stats->inserts++;
+	stats->count++;
+	eb_stats_bucket(stats->depth, depth);
+}
+
+/* Account the deletion of <node>, which is still linked in its tree. */
+void __eb_stats_delete(struct eb_node *node)
+{
+	struct eb_stats *stats = eb_stats_of(eb_stats_root(node->leaf_p));
+
+	if (!stats)
+		return;
+	stats->deletes++;
+	stats->count--;
+}
+
+/* Account a duplicate insertion next to <node> whose dup subtree descent
+ * walked <len> levels. The subtree holds at most 2^len leaves, so the
+ * histogram directly exposes how long the duplicate chains grow.
+ */
+void __eb_stats_dup(struct eb_node *node, unsigned int len)
+{
+	struct eb_stats *stats = eb_stats_of(eb_stats_root(node->node_p));
+
+	if (!stats)
+		return;
+	eb_stats_bucket(stats->dup_len, len);
+}
+
+/* Account a duplicate appended as <node> by eb_insert_dup_tail(), whose
+ * spine climb walked <len> levels. Unlike __eb_stats_dup(), the insertion
+ * itself is counted here too since the append path bypasses the typed
+ * insert functions.
+ */
+void __eb_stats_append(struct eb_node *node, unsigned int len)
+{
+	struct eb_stats *stats = eb_stats_of(eb_stats_root(node->leaf_p));
+
+	if (!stats)
+		return;
+	stats->inserts++;
+	stats->count++;
+	eb_stats_bucket(stats->dup_len, len);
+}
+
+/* Return the statistics attached to tree <root>, allocating them on first
+ * use. Returns NULL on allocation failure.
+ */
+struct eb_stats *eb_stats_get(struct eb_root *root)
+{
+	return eb_stats_of(root);
+}
+
+/* Reset the counters and histograms of tree <root>, preserving the current
+ * node count which reflects the tree itself.
+ */
+void eb_stats_reset(struct eb_root *root)
+{
+	struct eb_stats *stats = eb_stats_of(root);
+	unsigned long count;
+
+	if (!stats)
+		return;
+	count = stats->count;
+	memset(stats, 0, sizeof(*stats));
+	stats->count = count;
+}
+
+/* Forget everything about tree <root>, eg when the tree is destroyed. */
+void eb_stats_release(struct eb_root *root)
+{
+	struct eb_stats_reg *reg, **prev = &eb_stats_list;
+
+	for (reg = eb_stats_list; reg; reg = reg->next) {
+		if (reg->root == root) {
+			*prev = reg->next;
+			free(reg);
+			return;
+		}
+		prev = &reg->next;
+	}
+}
+
+#endif /* EB_STATS */
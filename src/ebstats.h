@@ -0,0 +1,77 @@
+/*
+ * Elastic Binary Trees - optional per-tree statistics.
+ * Version 6.0
+ *
+ * Copyright (C) 2000-2015 Willy Tarreau <w@1wt.eu>
+ * Distributed under MIT/X11 license (See accompanying file LICENSE)
+ *
+ */
+
+#ifndef _EBSTATS_H
+#define _EBSTATS_H
+
+#include "ebtree.h"
+
+/* The trees are deliberately unbalanced, so pathological key distributions
+ * can only be diagnosed by observing the descents themselves. Building with
+ * -DEB_STATS (make EB_STATS=1) maintains per-root counters and histograms
+ * which can be consulted with eb_stats_get(). Without the define, all the
+ * hooks below compile to nothing and the library is strictly unchanged.
+ * The statistics registry is not thread-safe ; this is a diagnostics build.
+ */
+
+#ifdef EB_STATS
+
+/* number of histogram buckets ; deeper descents all land in the last one */
+#define EB_STATS_BUCKETS 96
+
+struct eb_stats {
+	unsigned long count;    /* nodes currently in the tree */
+	unsigned long inserts;  /* total successful insertions */
+	unsigned long lookups;  /* total lookups, hits and misses */
+	unsigned long deletes;  /* total deletions */
+	unsigned long depth[EB_STATS_BUCKETS];   /* levels visited per lookup/insert */
+	unsigned long dup_len[EB_STATS_BUCKETS]; /* levels walked by eb_insert_dup() */
+};
+
+/* Return the statistics attached to tree <root>, allocating them on first
+ * use. Returns NULL on allocation failure.
+ */
+extern struct eb_stats *eb_stats_get(struct eb_root *root);
+
+/* Reset the counters and histograms of tree <root>, preserving the current
+ * node count which reflects the tree itself.
+ */
+extern void eb_stats_reset(struct eb_root *root);
+
+/* Forget everything about tree <root>, eg when the tree is destroyed. */
+extern void eb_stats_release(struct eb_root *root);
+
+/* Internal hooks below, inserted in the tree code via the macros. */
+extern void __eb_stats_lookup(struct eb_root *root, unsigned int depth);
+extern void __eb_stats_insert(struct eb_root *root, unsigned int depth);
+extern void __eb_stats_delete(struct eb_node *node);
+extern void __eb_stats_dup(struct eb_node *node, unsigned int len);
+extern void __eb_stats_append(struct eb_node *node, unsigned int len);
+
+#define EB_STATS_DESCENT(root)	unsigned int __eb_depth = 0; struct eb_root *__eb_sroot = (root)
+#define EB_STATS_DOWN()		(__eb_depth++)
+#define EB_STATS_LOOKUP()	__eb_stats_lookup(__eb_sroot, __eb_depth)
+#define EB_STATS_INSERT()	__eb_stats_insert(__eb_sroot, __eb_depth)
+#define EB_STATS_DELETE(node)	__eb_stats_delete(node)
+#define EB_STATS_DUP(node, len)	__eb_stats_dup(node, len)
+#define EB_STATS_APPEND(node, len)	__eb_stats_append(node, len)
+
+#else /* !EB_STATS : everything compiles out */
+
+#define EB_STATS_DESCENT(root)	do { } while (0)
+#define EB_STATS_DOWN()		do { } while (0)
+#define EB_STATS_LOOKUP()	do { } while (0)
+#define EB_STATS_INSERT()	do { } while (0)
+#define EB_STATS_DELETE(node)	do { } while (0)
+#define EB_STATS_DUP(node, len)	do { } while (0)
+#define EB_STATS_APPEND(node, len)	do { } while (0)
+
+#endif /* EB_STATS */
+
+#endif /* _EBSTATS_H */
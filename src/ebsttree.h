@@ -21,6 +21,7 @@
 extern struct ebmb_node *ebst_lookup(struct eb_root *root, const char *x);
 extern struct ebmb_node *ebst_lookup_len(struct eb_root *root, const char *x, unsigned int len);
 extern struct ebmb_node *ebst_insert(struct eb_root *root, struct ebmb_node *new);
+extern struct ebmb_node *ebst_insert_len(struct eb_root *root, struct ebmb_node *new, unsigned int len);
 
 #endif /* _EBSTTREE_H */
 
@@ -242,7 +242,13 @@
 
 #include "ebtree.h"
 #include <stdlib.h>
+#include <string.h>
 #include "compiler.h"
+#include "ebstats.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /**************************************\
  * Public functions, for the end-user *
@@ -254,51 +260,36 @@ int eb_is_empty(struct eb_root *root)
 	return !root->b[EB_LEFT];
 }
 
+/* The four functions below are thin wrappers around the static inline bodies
+ * of ebtree.h, which EB_INLINE consumers call directly. They are compiled out
+ * when this file itself is built into an EB_INLINE consumer, where the header
+ * definitions take their place.
+ */
+#ifndef EB_INLINE
 /* Return the first leaf in the tree starting at <root>, or NULL if none */
 struct eb_node *eb_first(struct eb_root *root)
 {
-	return eb_walk_down(root->b[0], EB_LEFT);
+	return __eb_first(root);
 }
 
 /* Return the last leaf in the tree starting at <root>, or NULL if none */
 struct eb_node *eb_last(struct eb_root *root)
 {
-	return eb_walk_down(root->b[0], EB_RGHT);
+	return __eb_last(root);
 }
 
 /* Return previous leaf node before an existing leaf node, or NULL if none. */
 struct eb_node *eb_prev(struct eb_node *node)
 {
-	eb_troot_t *t = node->leaf_p;
-
-	while (eb_gettag(t) == EB_LEFT) {
-		/* Walking up from left branch. We must ensure that we never
-		 * walk beyond root.
-		 */
-		if (unlikely(eb_clrtag((eb_untag(t, EB_LEFT))->b[EB_RGHT]) == NULL))
-			return NULL;
-		t = (eb_root_to_node(eb_untag(t, EB_LEFT)))->node_p;
-	}
-	/* Note that <t> cannot be NULL at this stage */
-	t = (eb_untag(t, EB_RGHT))->b[EB_LEFT];
-	return eb_walk_down(t, EB_RGHT);
+	return __eb_prev(node);
 }
 
 /* Return next leaf node after an existing leaf node, or NULL if none. */
 struct eb_node *eb_next(struct eb_node *node)
 {
-	eb_troot_t *t = node->leaf_p;
-
-	while (eb_gettag(t) != EB_LEFT)
-		/* Walking up from right branch, so we cannot be below root */
-		t = (eb_root_to_node(eb_untag(t, EB_RGHT)))->node_p;
-
-	/* Note that <t> cannot be NULL at this stage */
-	t = (eb_untag(t, EB_LEFT))->b[EB_RGHT];
-	if (eb_clrtag(t) == NULL)
-		return NULL;
-	return eb_walk_down(t, EB_LEFT);
+	return __eb_next(node);
 }
+#endif /* EB_INLINE */
 
 /* Return previous leaf node before an existing leaf node, skipping duplicates,
  * or NULL if none. */
@@ -372,6 +363,10 @@ void eb_delete(struct eb_node *node)
 	if (!node->leaf_p)
 		return;
 
+	EB_STATS_DELETE(node);
+	EB_SIZE_UNLINK(node);
+	EB_THR_UNLINK(node);
+
 	/* we need the parent, our side, and the grand parent */
 	pside = eb_gettag(node->leaf_p);
 	parent = eb_root_to_node(eb_untag(node->leaf_p, pside));
@@ -383,7 +378,7 @@ void eb_delete(struct eb_node *node)
 
 	if (eb_clrtag(parent->branches.b[EB_RGHT]) == NULL) {
 		/* we're just below the root, it's trivial. */
-		parent->branches.b[EB_LEFT] = NULL;
+		eb_pstore(parent->branches.b[EB_LEFT], NULL);
 		goto delete_unlink;
 	}
 
@@ -395,22 +390,24 @@ void eb_delete(struct eb_node *node)
 	gpside = eb_gettag(parent->node_p);
 	gparent = eb_untag(parent->node_p, gpside);
 
-	gparent->b[gpside] = parent->branches.b[!pside];
+	eb_pstore(gparent->b[gpside], parent->branches.b[!pside]);
 	sibtype = eb_gettag(gparent->b[gpside]);
 
 	if (sibtype == EB_LEAF) {
-		eb_root_to_node(eb_untag(gparent->b[gpside], EB_LEAF))->leaf_p =
-			eb_dotag(gparent, gpside);
+		eb_pstore(eb_root_to_node(eb_untag(gparent->b[gpside], EB_LEAF))->leaf_p,
+			  eb_dotag(gparent, gpside));
 	} else {
-		eb_root_to_node(eb_untag(gparent->b[gpside], EB_NODE))->node_p =
-			eb_dotag(gparent, gpside);
+		eb_pstore(eb_root_to_node(eb_untag(gparent->b[gpside], EB_NODE))->node_p,
+			  eb_dotag(gparent, gpside));
 	}
 	/* Mark the parent unused. Note that we do not check if the parent is
 	 * our own node, but that's not a problem because if it is, it will be
 	 * marked unused at the same time, which we'll use below to know we can
-	 * safely remove it.
+	 * safely remove it. A concurrent reader which already climbed to the
+	 * detached parent may observe this NULL, which is why the lockless
+	 * upward walks re-start their lookup when they load a NULL parent.
 	 */
-	parent->node_p = NULL;
+	eb_pstore(parent->node_p, NULL);
 
 	/* The parent node has been detached, and is currently unused. It may
 	 * belong to another node, so we cannot remove it that way. Also, our
@@ -427,31 +424,189 @@ void eb_delete(struct eb_node *node)
 	 * below <node>, so keeping its key for the bit string is OK.
 	 */
 
-	parent->node_p = node->node_p;
-	parent->branches = node->branches;
-	parent->bit = node->bit;
+	eb_pstore(parent->node_p, node->node_p);
+	eb_pstore(parent->branches.b[EB_LEFT], node->branches.b[EB_LEFT]);
+	eb_pstore(parent->branches.b[EB_RGHT], node->branches.b[EB_RGHT]);
+	eb_pstore(parent->bit, node->bit);
+#ifdef EB_AUGMENT
+	/* <node>'s count was already decremented by the climb above */
+	parent->size = node->size;
+#endif
 
 	/* We must now update the new node's parent... */
 	gpside = eb_gettag(parent->node_p);
 	gparent = eb_untag(parent->node_p, gpside);
-	gparent->b[gpside] = eb_dotag(&parent->branches, EB_NODE);
+	eb_pstore(gparent->b[gpside], eb_dotag(&parent->branches, EB_NODE));
 
 	/* ... and its branches */
 	for (pside = 0; pside <= 1; pside++) {
 		if (eb_gettag(parent->branches.b[pside]) == EB_NODE) {
-			eb_root_to_node(eb_untag(parent->branches.b[pside], EB_NODE))->node_p =
-				eb_dotag(&parent->branches, pside);
+			eb_pstore(eb_root_to_node(eb_untag(parent->branches.b[pside], EB_NODE))->node_p,
+				  eb_dotag(&parent->branches, pside));
 		} else {
-			eb_root_to_node(eb_untag(parent->branches.b[pside], EB_LEAF))->leaf_p =
-				eb_dotag(&parent->branches, pside);
+			eb_pstore(eb_root_to_node(eb_untag(parent->branches.b[pside], EB_LEAF))->leaf_p,
+				  eb_dotag(&parent->branches, pside));
 		}
 	}
  delete_unlink:
 	/* Now the node has been completely unlinked */
-	node->leaf_p = NULL;
+	eb_pstore(node->leaf_p, NULL);
 	return; /* tree is not empty yet */
 }
 
+/* The hook receiving the nodes unlinked by eb_delete_rcu(). It must defer
+ * the actual reclamation of the node's memory until all concurrent readers
+ * are done with it.
+ */
+void (*eb_reclaim_hook)(struct eb_node *node);
+
+/* Removes a leaf node from the tree like eb_delete(), then hands it to
+ * eb_reclaim_hook so that its memory is only recycled once concurrent
+ * readers cannot hold a reference to it anymore. The node's key, branches
+ * and parent links are left in place on purpose : a reader still traversing
+ * them keeps seeing a consistent (if slightly outdated) picture until the
+ * grace period expires.
+ */
+void eb_delete_rcu(struct eb_node *node)
+{
+	eb_delete(node);
+	if (eb_reclaim_hook)
+		eb_reclaim_hook(node);
+}
+
+#ifdef EB_AUGMENT
+/* Update the subtree counts after the leaf of <new> was linked in its tree.
+ * When its node part is in use, its count is recomputed from its two branches
+ * (the displaced subtree plus the new leaf itself), then every node part
+ * above it gains one leaf. This climb makes the hook insertion-path agnostic:
+ * regular descents, appends, hinted inserts and duplicate subtrees are all
+ * covered alike.
+ */
+void eb_size_link(struct eb_node *new)
+{
+	struct eb_root *r;
+	eb_troot_t *t;
+	unsigned int side;
+
+	if (new->node_p) {
+		new->size = __eb_branch_size(new->branches.b[EB_LEFT]) +
+			    __eb_branch_size(new->branches.b[EB_RGHT]);
+		t = new->node_p;
+	} else {
+		/* single leaf below the root, no count to maintain */
+		t = new->leaf_p;
+	}
+
+	while (1) {
+		side = eb_gettag(t);
+		r = eb_untag(t, side);
+		if (side == EB_LEFT && eb_clrtag(r->b[EB_RGHT]) == NULL)
+			break; /* reached the tree root */
+		eb_root_to_node(r)->size++;
+		t = eb_root_to_node(r)->node_p;
+	}
+}
+
+/* Subtract one from the count of every node part above the still-linked leaf
+ * of <node>. This runs before eb_delete() detaches anything, so the climb
+ * follows valid parent links, and the count possibly transplanted with
+ * <node>'s node part is already correct.
+ */
+void eb_size_unlink(struct eb_node *node)
+{
+	struct eb_root *r;
+	eb_troot_t *t = node->leaf_p;
+	unsigned int side;
+
+	while (1) {
+		side = eb_gettag(t);
+		r = eb_untag(t, side);
+		if (side == EB_LEFT && eb_clrtag(r->b[EB_RGHT]) == NULL)
+			break; /* reached the tree root */
+		eb_root_to_node(r)->size--;
+		t = eb_root_to_node(r)->node_p;
+	}
+}
+
+/* Return the number of leaves in tree <root>, in constant time. */
+unsigned int eb_count(struct eb_root *root)
+{
+	eb_troot_t *troot = root->b[EB_LEFT];
+
+	if (troot == NULL)
+		return 0;
+	return __eb_branch_size(troot);
+}
+#endif /* EB_AUGMENT */
+
+#ifdef EB_THREADED
+/* Splice the freshly linked leaf of <new> into the neighbor thread. Its
+ * predecessor is located with one structural walk, and the successor is then
+ * a single load from the predecessor's thread, so the hook costs no more
+ * than the insertion descent which preceded it.
+ */
+void eb_thr_link(struct eb_node *new)
+{
+	struct eb_node *prev, *next;
+
+	prev = __eb_prev_walk(new);
+	next = prev ? prev->thr_next : __eb_next_walk(new);
+	new->thr_prev = prev;
+	new->thr_next = next;
+	if (prev)
+		prev->thr_next = new;
+	if (next)
+		next->thr_prev = new;
+}
+
+/* Remove the still-linked leaf of <node> from the neighbor thread by joining
+ * its two neighbors. The node's own thread pointers are left in place, like
+ * its branches, so that a leftover reader finishes its walk coherently.
+ */
+void eb_thr_unlink(struct eb_node *node)
+{
+	if (node->thr_prev)
+		node->thr_prev->thr_next = node->thr_next;
+	if (node->thr_next)
+		node->thr_next->thr_prev = node->thr_prev;
+}
+#endif /* EB_THREADED */
+
+/* Return the first leaf in cached tree <root>, or NULL if none. This is a
+ * single load from the cached extremum pointer instead of a left spine
+ * descent.
+ */
+struct eb_node *eb_first_cached(struct eb_root_cached *root)
+{
+	return root->first;
+}
+
+/* Return the last leaf in cached tree <root>, or NULL if none. This is a
+ * single load from the cached extremum pointer instead of a right spine
+ * descent.
+ */
+struct eb_node *eb_last_cached(struct eb_root_cached *root)
+{
+	return root->last;
+}
+
+/* Removes a leaf node from cached tree <root>, updating the cached extremum
+ * pointers when the node was one of them. The neighbour is looked up before
+ * the node is unlinked, so this adds at most two hops (one on average) to a
+ * plain eb_delete().
+ */
+void eb_delete_cached(struct eb_root_cached *root, struct eb_node *node)
+{
+	if (!node->leaf_p)
+		return;
+
+	if (node == root->first)
+		root->first = eb_next(node);
+	if (node == root->last)
+		root->last = eb_prev(node);
+	eb_delete(node);
+}
+
 /* Compare blocks <a> and <b> byte-to-byte, from bit <ignore> to bit <len-1>.
  * Return the number of equal bits between strings, assuming that the first
  * <ignore> bits are already identical. It is possible to return slightly more
@@ -459,6 +614,48 @@ void eb_delete(struct eb_node *node)
  * bytes. Note that parts or all of <ignore> bits may be rechecked. It is only
  * passed here as a hint to speed up the check.
  */
+#if defined(__SSE2__)
+int equal_bits(const unsigned char *a,
+				  const unsigned char *b,
+				  int ignore, int len)
+{
+	int bytes = (len + 7) >> 3; /* number of bytes the check may touch */
+	int beg = ignore >> 3;
+
+	/* compare 16 bytes per round as long as they all belong to the keys;
+	 * the movemask inverts the per-byte equality so that the first set
+	 * bit designates the first differing byte.
+	 */
+	while (beg + 16 <= bytes) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + beg));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + beg));
+		unsigned int diff;
+
+		diff = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+		if (diff) {
+			beg += __builtin_ctz(diff);
+			return (beg << 3) + 8 - flsnz8(a[beg] ^ b[beg]);
+		}
+		beg += 16;
+	}
+
+	/* byte-at-a-time tail, same as the generic version */
+	for (ignore = beg << 3, a += beg, b += beg;
+	     ignore < len; ) {
+		unsigned char c;
+
+		a++; b++;
+		ignore += 8;
+		c = b[-1] ^ a[-1];
+
+		if (c) {
+			ignore -= flsnz8(c);
+			break;
+		}
+	}
+	return ignore;
+}
+#else
 int equal_bits(const unsigned char *a,
 				  const unsigned char *b,
 				  int ignore, int len)
@@ -483,11 +680,49 @@ int equal_bits(const unsigned char *a,
 	}
 	return ignore;
 }
+#endif
 
 /* check that the two blocks <a> and <b> are equal on <len> bits. If it is known
  * they already are on some bytes, this number of equal bytes to be skipped may
  * be passed in <skip>. It returns 0 if they match, otherwise non-zero.
  */
+#if defined(__SSE2__)
+int check_bits(const unsigned char *a,
+				  const unsigned char *b,
+				  int skip,
+				  int len)
+{
+	int last = (len - 1) >> 3; /* index of the last byte holding a bit */
+	int bit, ret;
+
+	/* compare 16 bytes per round as long as they are all complete, ie
+	 * strictly before the last byte which may only be partially covered.
+	 */
+	while (skip + 16 <= last) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + skip));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + skip));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+			return 1;
+		skip += 16;
+	}
+
+	/* byte-at-a-time tail, same as the generic version */
+	bit = ~len + (skip << 3) + 9; // = (skip << 3) + (8 - len)
+	ret = a[skip] ^ b[skip];
+	if (unlikely(bit >= 0))
+		return ret >> bit;
+	while (1) {
+		skip++;
+		if (ret)
+			return ret;
+		ret = a[skip] ^ b[skip];
+		bit += 8;
+		if (bit >= 0)
+			return ret >> bit;
+	}
+}
+#else
 int check_bits(const unsigned char *a,
 				  const unsigned char *b,
 				  int skip,
@@ -514,6 +749,7 @@ int check_bits(const unsigned char *a,
 			return ret >> bit;
 	}
 }
+#endif
 
 
 /* Compare strings <a> and <b> byte-to-byte, from bit <ignore> to the last 0.
@@ -525,6 +761,66 @@ int check_bits(const unsigned char *a,
  * permitted. Equal strings are reported as a negative number of bits, which
  * indicates the end was reached.
  */
+#if defined(__SSE2__)
+int string_equal_bits(const unsigned char *a,
+					 const unsigned char *b,
+					 int ignore)
+{
+	int beg = ignore >> 3;
+	unsigned char c;
+
+	while (1) {
+		__m128i va, vb;
+		unsigned int diff, zero;
+		int pd, pz;
+
+		/* Stay byte-at-a-time until the loads are known to be safe :
+		 * the load on <a> is aligned so it may not cross a page
+		 * boundary even past the trailing zero, and the unaligned
+		 * load on <b> must not come closer than 16 bytes from the
+		 * end of its page.
+		 */
+		while (((uintptr_t)(a + beg) & 15) ||
+		       ((uintptr_t)(b + beg) & 4095) > 4080) {
+			unsigned char d;
+
+			c = a[beg];
+			d = b[beg];
+			beg++;
+
+			c ^= d;
+			if (c)
+				goto found;
+			if (!d)
+				return -1;
+		}
+
+		va = _mm_load_si128((const __m128i *)(a + beg));
+		vb = _mm_loadu_si128((const __m128i *)(b + beg));
+		diff = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+		zero = _mm_movemask_epi8(_mm_cmpeq_epi8(vb, _mm_setzero_si128()));
+
+		if (diff | zero) {
+			pd = diff ? __builtin_ctz(diff) : 16;
+			pz = zero ? __builtin_ctz(zero) : 16;
+			if (pz < pd)
+				return -1; /* both ended before differing */
+			beg += pd;
+			c = a[beg] ^ b[beg];
+			beg++;
+			goto found;
+		}
+		beg += 16;
+	}
+ found:
+	/* OK now we know that a and b differ at byte <beg-1>. We have to find
+	 * what bit is differing and report it as the number of identical
+	 * bits. Note that low bit numbers are assigned to high positions in
+	 * the byte, as we compare them as strings.
+	 */
+	return (beg << 3) - flsnz8(c);
+}
+#else
 int string_equal_bits(const unsigned char *a,
 					 const unsigned char *b,
 					 int ignore)
@@ -557,6 +853,64 @@ int string_equal_bits(const unsigned char *a,
 	 */
 	return (beg << 3) - flsnz8(c);
 }
+#endif
+
+/* Compare the first <len> chars of <a>, taken as a string of that exact
+ * length, against the zero-terminated string <b>, from bit <ignore>. <a> must
+ * hold no zero among its first <len> chars. The return convention is that of
+ * string_equal_bits() : the number of equal bits, or a negative value when <b>
+ * equals <a> including the terminator. Since the length is known up front,
+ * whole 64-bit words are compared without scanning for the terminator, which
+ * makes the function about 4 times cheaper than string_equal_bits() on long
+ * keys. The first word covering a zero on either side necessarily differs
+ * because <a> has none among its <len> first chars, so at most 7 bytes past
+ * <b>'s terminating zero are ever read. Keys used with this function must
+ * thus be stored in buffers padded to the next 8-byte boundary.
+ */
+int string_equal_bits_len(const unsigned char *a,
+					 const unsigned char *b,
+					 int ignore, int len)
+{
+	int beg = ignore >> 3;
+	unsigned char c;
+
+	/* compare 8 bytes per round as long as they are all key chars */
+	while (beg + 8 <= len) {
+		uint64_t wa, wb;
+
+		memcpy(&wa, a + beg, 8);
+		memcpy(&wb, b + beg, 8);
+		if (wa != wb) {
+			/* locate the first differing byte of the word */
+			while (a[beg] == b[beg])
+				beg++;
+			c = a[beg] ^ b[beg];
+			beg++;
+			goto found;
+		}
+		beg += 8;
+	}
+
+	/* byte-at-a-time tail over the last chars and the terminator, where
+	 * <a>'s chars past <len> are read as zeroes.
+	 */
+	while (1) {
+		c = (beg < len) ? a[beg] : 0;
+		c ^= b[beg];
+		beg++;
+		if (c)
+			goto found;
+		if (beg > len)
+			return -1;
+	}
+ found:
+	/* OK now we know that a and b differ at byte <beg-1>. We have to find
+	 * what bit is differing and report it as the number of identical bits.
+	 * Note that low bit numbers are assigned to high positions in the byte,
+	 * as we compare them as strings.
+	 */
+	return (beg << 3) - flsnz8(c);
+}
 
 int cmp_bits(const unsigned char *a, const unsigned char *b, unsigned int pos)
 {
@@ -588,11 +942,7 @@ int get_bit(const unsigned char *a, unsigned int pos)
  */
 struct eb_node *eb_walk_down(eb_troot_t *start, unsigned int side)
 {
-	/* A NULL pointer on an empty tree root will be returned as-is */
-	while (eb_gettag(start) == EB_NODE)
-		start = (eb_untag(start, EB_NODE))->b[side];
-	/* NULL is left untouched (root==eb_node, EB_LEAF==0) */
-	return eb_root_to_node(eb_untag(start, EB_LEAF));
+	return __eb_walk_down(start, side);
 }
 
 /* This function is used to build a tree of duplicates by adding a new node to
@@ -612,6 +962,10 @@ struct eb_node *eb_insert_dup(struct eb_node *sub, struct eb_node *new)
 	struct eb_troot *new_rght = (struct eb_troot *)eb_dotag(&new->branches, EB_RGHT);
 	struct eb_troot *new_leaf = (struct eb_troot *)eb_dotag(&new->branches, EB_LEAF);
 
+#ifdef EB_STATS
+	unsigned int dup_len = 0;
+#endif
+
 	/* first, identify the deepest hole on the right branch */
 	while (eb_gettag(head->branches.b[EB_RGHT]) != EB_LEAF) {
 		struct eb_node *last = head;
@@ -619,6 +973,9 @@ struct eb_node *eb_insert_dup(struct eb_node *sub, struct eb_node *new)
 				    struct eb_node, branches);
 		if (head->bit > last->bit + 1)
 			sub = head;     /* there's a hole here */
+#ifdef EB_STATS
+		dup_len++;
+#endif
 	}
 
 	/* Here we have a leaf attached to (head)->b[EB_RGHT] */
@@ -627,13 +984,19 @@ struct eb_node *eb_insert_dup(struct eb_node *sub, struct eb_node *new)
 		new->bit = -1;
 		sub = container_of(eb_untag(head->branches.b[EB_RGHT], EB_LEAF),
 				   struct eb_node, branches);
-		head->branches.b[EB_RGHT] = eb_dotag(&new->branches, EB_NODE);
 
+		/* the new node must be fully initialized before a lockless
+		 * reader can reach it through the published branch below.
+		 */
 		new->node_p = sub->leaf_p;
 		new->leaf_p = new_rght;
-		sub->leaf_p = new_left;
 		new->branches.b[EB_LEFT] = eb_dotag(&sub->branches, EB_LEAF);
 		new->branches.b[EB_RGHT] = new_leaf;
+		eb_pstore(sub->leaf_p, new_left);
+		eb_pstore(head->branches.b[EB_RGHT], eb_dotag(&new->branches, EB_NODE));
+		EB_STATS_DUP(new, dup_len);
+		EB_SIZE_LINK(new);
+		EB_THR_LINK(new);
 		return new;
 	} else {
 		int side;
@@ -645,14 +1008,129 @@ struct eb_node *eb_insert_dup(struct eb_node *sub, struct eb_node *new)
 		new->bit = sub->bit - 1; /* install at the lowest level */
 		side = eb_gettag(sub->node_p);
 		head = container_of(eb_untag(sub->node_p, side), struct eb_node, branches);
-		head->branches.b[side] = eb_dotag(&new->branches, EB_NODE);
 
 		new->node_p = sub->node_p;
 		new->leaf_p = new_rght;
-		sub->node_p = new_left;
 		new->branches.b[EB_LEFT] = eb_dotag(&sub->branches, EB_NODE);
 		new->branches.b[EB_RGHT] = new_leaf;
+		eb_pstore(sub->node_p, new_left);
+		eb_pstore(head->branches.b[side], eb_dotag(&new->branches, EB_NODE));
+		EB_STATS_DUP(new, dup_len);
+		EB_SIZE_LINK(new);
+		EB_THR_LINK(new);
 		return new;
 	}
 }
 
+/* This function appends duplicate node <new> to the right of <tail>, which
+ * must be the current rightmost leaf among the entries carrying the same key,
+ * typically the node returned by the previous append. It produces exactly the
+ * same tree as eb_insert_dup() called from the regular insertion code, but
+ * works bottom-up from <tail> instead of descending the duplicate subtree, so
+ * that the spine climbs amortize to constant time over a run of appends, the
+ * same way carries do in a binary counter. Neither the key equality nor the
+ * rightmost position of <tail> are checked here ; this is the job of the
+ * typed wrappers. It is not for the end-user.
+ */
+struct eb_node *eb_insert_dup_tail(struct eb_node *tail, struct eb_node *new)
+{
+	struct eb_node *sub, *parent;
+	struct eb_root *up;
+	int side;
+
+	struct eb_troot *new_left = (struct eb_troot *)eb_dotag(&new->branches, EB_LEFT);
+	struct eb_troot *new_rght = (struct eb_troot *)eb_dotag(&new->branches, EB_RGHT);
+	struct eb_troot *new_leaf = (struct eb_troot *)eb_dotag(&new->branches, EB_LEAF);
+
+#ifdef EB_STATS
+	unsigned int dup_len = 0;
+#endif
+
+	side = eb_gettag(tail->leaf_p);
+	sub = eb_root_to_node(eb_untag(tail->leaf_p, side));
+
+	if (side != EB_RGHT || sub->bit >= 0) {
+		/* <tail> is still alone under its key : it hangs either left
+		 * of its parent (possibly the root), or right of a regular
+		 * node, never right of a duplicate node. So we turn it into
+		 * the first duplicate pair. Note that the root can only be
+		 * reached by a left link, so <sub> is a valid node here.
+		 */
+		new->bit = -1;
+		side = eb_gettag(tail->leaf_p);
+		up = eb_untag(tail->leaf_p, side);
+
+		/* as in eb_insert_dup(), the new node must be complete before
+		 * the publication store lets a lockless reader reach it.
+		 */
+		new->node_p = tail->leaf_p;
+		new->leaf_p = new_rght;
+		new->branches.b[EB_LEFT] = eb_dotag(&tail->branches, EB_LEAF);
+		new->branches.b[EB_RGHT] = new_leaf;
+		eb_pstore(tail->leaf_p, new_left);
+		eb_pstore(up->b[side], eb_dotag(&new->branches, EB_NODE));
+		EB_STATS_APPEND(new, dup_len);
+		EB_SIZE_LINK(new);
+		EB_THR_LINK(new);
+		return new;
+	}
+
+	if (sub->bit < -1) {
+		/* A hole exists just before <tail>, we insert there. This is
+		 * the first case of eb_insert_dup(), reached without the
+		 * descent since <sub> is simply <tail>'s parent.
+		 */
+		new->bit = -1;
+
+		new->node_p = tail->leaf_p;
+		new->leaf_p = new_rght;
+		new->branches.b[EB_LEFT] = eb_dotag(&tail->branches, EB_LEAF);
+		new->branches.b[EB_RGHT] = new_leaf;
+		eb_pstore(tail->leaf_p, new_left);
+		eb_pstore(sub->branches.b[EB_RGHT], eb_dotag(&new->branches, EB_NODE));
+		EB_STATS_APPEND(new, dup_len);
+		EB_SIZE_LINK(new);
+		EB_THR_LINK(new);
+		return new;
+	}
+
+	/* No room at the bottom. Climb the right spine until we leave the
+	 * duplicate subtree or find a hole above us ; this designates the
+	 * node the top-down descent would have selected as <sub>.
+	 */
+	while (1) {
+		side = eb_gettag(sub->node_p);
+		up = eb_untag(sub->node_p, side);
+
+		if (side == EB_LEFT && eb_clrtag(up->b[EB_RGHT]) == NULL)
+			break;	/* <sub> is the head, right below the root */
+		parent = eb_root_to_node(up);
+		if (parent->bit >= 0)
+			break;	/* <sub> is the head of the duplicate subtree */
+		if (parent->bit != sub->bit - 1)
+			break;	/* there's a hole above <sub> */
+		sub = parent;
+#ifdef EB_STATS
+		dup_len++;
+#endif
+	}
+
+	/* Insert above <sub> at the lowest level, exactly as the second case
+	 * of eb_insert_dup() does.
+	 */
+	new->bit = sub->bit - 1;
+	side = eb_gettag(sub->node_p);
+	up = eb_untag(sub->node_p, side);
+
+	new->node_p = sub->node_p;
+	new->leaf_p = new_rght;
+	new->branches.b[EB_LEFT] = eb_dotag(&sub->branches, EB_NODE);
+	new->branches.b[EB_RGHT] = new_leaf;
+	eb_pstore(sub->node_p, new_left);
+	eb_pstore(up->b[side], eb_dotag(&new->branches, EB_NODE));
+	EB_STATS_APPEND(new, dup_len);
+	EB_SIZE_LINK(new);
+	EB_THR_LINK(new);
+	return new;
+}
+
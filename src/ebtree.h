@@ -305,6 +305,25 @@
  */
 typedef void eb_troot_t;
 
+/* Publication store and load, used on the links a concurrent reader may be
+ * chasing. By default they are plain accesses and cost nothing. When built
+ * with -DEB_CONCURRENT (make EB_CONCURRENT=1), they become release stores
+ * and acquire loads, which combined with the careful store ordering in the
+ * insertion and deletion code allows a SINGLE writer to modify a tree while
+ * any number of lockless readers run eb64_lookup()/eb64_lookup_ge() on it.
+ * Readers are then weakly consistent : a lookup racing with a modification
+ * may still return a just-deleted node or miss a just-inserted one, but it
+ * never crashes nor returns an unrelated node, provided that deleted nodes
+ * are only reclaimed after a grace period (see eb_delete_rcu() below).
+ */
+#ifdef EB_CONCURRENT
+#define eb_pstore(lnk, val)	__atomic_store_n(&(lnk), (val), __ATOMIC_RELEASE)
+#define eb_pload(lnk)		__atomic_load_n(&(lnk), __ATOMIC_ACQUIRE)
+#else
+#define eb_pstore(lnk, val)	((lnk) = (val))
+#define eb_pload(lnk)		(lnk)
+#endif
+
 /* The eb_root connects the node which contains it, to two nodes below it, one
  * of which may be the same node. At the top of the tree, we use an eb_root
  * too, which always has its right branch NULL (+/1 low-order bits).
@@ -324,8 +343,43 @@ struct eb_node {
 	eb_troot_t    *leaf_p;  /* leaf node's parent */
 	short int      bit;     /* link's bit position. */
 	short int      pfx;     /* data prefix length, always related to leaf */
+#ifdef EB_AUGMENT
+	unsigned int   size;    /* leaves below the node part ; fits in the
+				 * structure's padding on 64-bit targets */
+#endif
+#ifdef EB_THREADED
+	struct eb_node *thr_next; /* next leaf in key order, NULL at the end */
+	struct eb_node *thr_prev; /* previous leaf in key order, NULL at the start */
+#endif
 };
 
+/* An eb_root extended with cached pointers to the leftmost and rightmost
+ * leaves, so that eb_first_cached()/eb_last_cached() are a single load instead
+ * of a descent along the left or right spine. The cache is maintained by the
+ * *_cached flavours of the insert and delete operations, which must then be
+ * used consistently on such a tree. The embedded root may still be passed to
+ * all read-only primitives (lookups, walks).
+ */
+struct eb_root_cached {
+	struct eb_root root;    /* the tree itself, must be at the beginning */
+	struct eb_node *first;  /* leftmost leaf, NULL if the tree is empty */
+	struct eb_node *last;   /* rightmost leaf, NULL if the tree is empty */
+};
+
+#define EB_ROOT_CACHED					\
+	(struct eb_root_cached) {			\
+		.root = { .b = {[0] = NULL, [1] = NULL } }, \
+		.first = NULL,				\
+		.last = NULL,				\
+	}
+
+#define EB_ROOT_CACHED_UNIQUE				\
+	(struct eb_root_cached) {			\
+		.root = { .b = {[0] = NULL, [1] = (void *)1 } }, \
+		.first = NULL,				\
+		.last = NULL,				\
+	}
+
 /**************************************\
  * Public functions, for the end-user *
 \**************************************/
@@ -333,6 +387,11 @@ struct eb_node {
 /* Return non-zero if the tree is empty, otherwise zero */
 extern int eb_is_empty(struct eb_root *root);
 
+/* The functions below are also provided as static inline definitions further
+ * down when EB_INLINE is defined (see the __eb_first() block), so that hot
+ * call sites can avoid the PLT indirection of the shared library.
+ */
+#ifndef EB_INLINE
 /* Return the first leaf in the tree starting at <root>, or NULL if none */
 extern struct eb_node *eb_first(struct eb_root *root);
 
@@ -343,6 +402,7 @@ extern struct eb_node *eb_last(struct eb_root *root);
 extern struct eb_node *eb_prev(struct eb_node *node);
 /* Return next leaf node after an existing leaf node, or NULL if none. */
 extern struct eb_node *eb_next(struct eb_node *node);
+#endif
 /* Return previous leaf node before an existing leaf node, skipping duplicates,
  * or NULL if none. */
 extern struct eb_node *eb_prev_unique(struct eb_node *node);
@@ -355,6 +415,98 @@ extern struct eb_node *eb_next_unique(struct eb_node *node);
  */
 extern void eb_delete(struct eb_node *node);
 
+/* Called with each node unlinked by eb_delete_rcu(). The hook must defer the
+ * actual reclamation of the node's memory until all concurrent readers are
+ * done with it (eg by queueing it behind the application's grace period).
+ * NULL by default, in which case eb_delete_rcu() behaves like eb_delete().
+ */
+extern void (*eb_reclaim_hook)(struct eb_node *node);
+
+/* Removes a leaf node from the tree like eb_delete(), then passes it to
+ * eb_reclaim_hook so that its memory is only recycled once concurrent
+ * readers cannot hold a reference to it anymore.
+ */
+extern void eb_delete_rcu(struct eb_node *node);
+
+/* Building with -DEB_AUGMENT (make EB_AUGMENT=1) maintains in each node part
+ * the number of leaves below it, which rank/select operations (see
+ * eb32_rank()/eb64_select() and friends) use to answer order statistics in
+ * one descent. The counts are maintained by the eb32/eb64 insertion paths,
+ * eb_insert_dup()/eb_insert_dup_tail() and eb_delete() ; the other key types
+ * and the bulk eb32/eb64_delete_le() do not maintain them, so such trees must
+ * not be queried through rank/select. The counts are not meant to be read by
+ * lockless readers : rank/select require the writer lock under EB_CONCURRENT.
+ */
+#ifdef EB_AUGMENT
+/* Update the subtree counts after the leaf of <new> was linked in its tree :
+ * compute the count of the new node part from its two branches, then add one
+ * to every node part above it up to the root.
+ */
+extern void eb_size_link(struct eb_node *new);
+
+/* Subtract one from the count of every node part above the still-linked leaf
+ * of <node>, to be called before eb_delete() detaches it.
+ */
+extern void eb_size_unlink(struct eb_node *node);
+
+/* Return the number of leaves in tree <root>, in constant time. */
+extern unsigned int eb_count(struct eb_root *root);
+
+#define EB_SIZE_LINK(node)	eb_size_link(node)
+#define EB_SIZE_UNLINK(node)	eb_size_unlink(node)
+
+#else /* !EB_AUGMENT : the hooks compile to nothing */
+
+#define EB_SIZE_LINK(node)	do { } while (0)
+#define EB_SIZE_UNLINK(node)	do { } while (0)
+
+#endif /* EB_AUGMENT */
+
+/* Building with -DEB_THREADED (make EB_THREADED=1) threads the leaves with
+ * forward and backward neighbor pointers, turning eb_next()/eb_prev() and the
+ * typed walkers built on them into a single predictable load instead of an up
+ * to log(P) pointer chase through the parent links, which lets the hardware
+ * prefetcher stay ahead during full-tree scans. The threads are maintained by
+ * every insertion path of the eb_node based types (scalars, multi-byte,
+ * strings and the indirect variants, including the appends, hinted inserts
+ * and bulk loaders), by eb_delete() and by the bulk eb32/eb64_delete_le() ;
+ * the offset-based eb32c trees and the quad trees use their own node layout
+ * and are not concerned. The link hook costs one structural walk per
+ * insertion. The threads are not meant to be followed by lockless readers :
+ * walking them requires the writer lock under EB_CONCURRENT.
+ */
+#ifdef EB_THREADED
+/* Splice the freshly linked leaf of <new> into the neighbor thread, locating
+ * its predecessor with a structural walk.
+ */
+extern void eb_thr_link(struct eb_node *new);
+
+/* Remove the still-linked leaf of <node> from the neighbor thread, to be
+ * called before the tree unlinks it.
+ */
+extern void eb_thr_unlink(struct eb_node *node);
+
+#define EB_THR_LINK(node)	eb_thr_link(node)
+#define EB_THR_UNLINK(node)	eb_thr_unlink(node)
+
+#else /* !EB_THREADED : the hooks compile to nothing */
+
+#define EB_THR_LINK(node)	do { } while (0)
+#define EB_THR_UNLINK(node)	do { } while (0)
+
+#endif /* EB_THREADED */
+
+/* Return the first leaf in cached tree <root>, or NULL if none. O(1). */
+extern struct eb_node *eb_first_cached(struct eb_root_cached *root);
+
+/* Return the last leaf in cached tree <root>, or NULL if none. O(1). */
+extern struct eb_node *eb_last_cached(struct eb_root_cached *root);
+
+/* Removes a leaf node from cached tree <root>, updating the cached extremum
+ * pointers when the node was one of them. Marks the node as unlinked.
+ */
+extern void eb_delete_cached(struct eb_root_cached *root, struct eb_node *node);
+
 /* Compare blocks <a> and <b> byte-to-byte, from bit <ignore> to bit <len-1>.
  * Return the number of equal bits between strings, assuming that the first
  * <ignore> bits are already identical. It is possible to return slightly more
@@ -388,6 +540,20 @@ extern int string_equal_bits(const unsigned char *a,
 					 const unsigned char *b,
 					 int ignore);
 
+/* Compare the first <len> chars of <a>, taken as a string of that exact
+ * length, against the zero-terminated string <b>, from bit <ignore>, 8 bytes
+ * per round. The first <ignore> bits are assumed to be already identical and
+ * <a> must hold no zero among its first <len> chars. The return convention is
+ * that of string_equal_bits() : the number of equal bits, or a negative value
+ * when <b> equals <a> including the terminator. Because whole words are
+ * compared, up to 7 bytes past <b>'s terminating zero may be read, so keys
+ * looked up this way must be stored in buffers padded to the next 8-byte
+ * boundary.
+ */
+extern int string_equal_bits_len(const unsigned char *a,
+					 const unsigned char *b,
+					 int ignore, int len);
+
 extern int cmp_bits(const unsigned char *a, const unsigned char *b, unsigned int pos);
 
 extern int get_bit(const unsigned char *a, unsigned int pos);
@@ -403,6 +569,7 @@ static struct eb_root *eb_clrtag(const eb_troot_t *troot);
 static struct eb_node *eb_root_to_node(struct eb_root *root);
 extern struct eb_node *eb_walk_down(eb_troot_t *start, unsigned int side);
 extern struct eb_node *eb_insert_dup(struct eb_node *sub, struct eb_node *new);
+extern struct eb_node *eb_insert_dup_tail(struct eb_node *tail, struct eb_node *new);
 extern void eb_delete(struct eb_node *node);
 
 /* Converts a root pointer to its equivalent eb_troot_t pointer,
@@ -444,6 +611,134 @@ static inline struct eb_node *eb_root_to_node(struct eb_root *root)
 	return container_of(root, struct eb_node, branches);
 }
 
+#ifdef EB_AUGMENT
+/* Return the number of leaves below branch <troot> : one for a leaf, the
+ * maintained count for a node part.
+ */
+static inline unsigned int __eb_branch_size(eb_troot_t *troot)
+{
+	if (eb_gettag(troot) == EB_LEAF)
+		return 1;
+	return eb_root_to_node(eb_untag(troot, EB_NODE))->size;
+}
+#endif
+
+/* The walk primitives below are the bodies of eb_first()/eb_last()/eb_next()/
+ * eb_prev(), kept in the header so that, with EB_INLINE defined, call sites
+ * get static inline definitions of the public names and pay neither the PLT
+ * indirection of the shared library nor the call itself on short walks. The
+ * exported functions in ebtree.c are thin wrappers around them, so both
+ * flavours always behave identically. Code meant to stay binary-compatible
+ * with the library (eg the D bindings) must not define EB_INLINE.
+ */
+
+/* Walks down starting at root pointer <start>, and always walking on side
+ * <side>. It either returns the node hosting the first leaf on that side,
+ * or NULL if no leaf is found. <start> may either be NULL or a branch pointer.
+ * The pointer to the leaf (or NULL) is returned.
+ */
+static forceinline struct eb_node *__eb_walk_down(eb_troot_t *start, unsigned int side)
+{
+	/* A NULL pointer on an empty tree root will be returned as-is */
+	while (eb_gettag(start) == EB_NODE)
+		start = eb_pload((eb_untag(start, EB_NODE))->b[side]);
+	/* NULL is left untouched (root==eb_node, EB_LEAF==0) */
+	return eb_root_to_node(eb_untag(start, EB_LEAF));
+}
+
+/* Return the first leaf in the tree starting at <root>, or NULL if none */
+static forceinline struct eb_node *__eb_first(struct eb_root *root)
+{
+	return __eb_walk_down(root->b[0], EB_LEFT);
+}
+
+/* Return the last leaf in the tree starting at <root>, or NULL if none */
+static forceinline struct eb_node *__eb_last(struct eb_root *root)
+{
+	return __eb_walk_down(root->b[0], EB_RGHT);
+}
+
+/* Return previous leaf node before an existing leaf node by climbing the
+ * parent links, or NULL if none. This is the structural walk which remains
+ * correct while the neighbor threads of EB_THREADED are being updated.
+ */
+static forceinline struct eb_node *__eb_prev_walk(struct eb_node *node)
+{
+	eb_troot_t *t = node->leaf_p;
+
+	while (eb_gettag(t) == EB_LEFT) {
+		/* Walking up from left branch. We must ensure that we never
+		 * walk beyond root.
+		 */
+		if (unlikely(eb_clrtag((eb_untag(t, EB_LEFT))->b[EB_RGHT]) == NULL))
+			return NULL;
+		t = (eb_root_to_node(eb_untag(t, EB_LEFT)))->node_p;
+	}
+	/* Note that <t> cannot be NULL at this stage */
+	t = (eb_untag(t, EB_RGHT))->b[EB_LEFT];
+	return __eb_walk_down(t, EB_RGHT);
+}
+
+/* Return next leaf node after an existing leaf node by climbing the parent
+ * links, or NULL if none.
+ */
+static forceinline struct eb_node *__eb_next_walk(struct eb_node *node)
+{
+	eb_troot_t *t = node->leaf_p;
+
+	while (eb_gettag(t) != EB_LEFT)
+		/* Walking up from right branch, so we cannot be below root */
+		t = (eb_root_to_node(eb_untag(t, EB_RGHT)))->node_p;
+
+	/* Note that <t> cannot be NULL at this stage */
+	t = (eb_untag(t, EB_LEFT))->b[EB_RGHT];
+	if (eb_clrtag(t) == NULL)
+		return NULL;
+	return __eb_walk_down(t, EB_LEFT);
+}
+
+/* Return previous leaf node before an existing leaf node, or NULL if none. */
+static forceinline struct eb_node *__eb_prev(struct eb_node *node)
+{
+#ifdef EB_THREADED
+	return node->thr_prev;
+#else
+	return __eb_prev_walk(node);
+#endif
+}
+
+/* Return next leaf node after an existing leaf node, or NULL if none. */
+static forceinline struct eb_node *__eb_next(struct eb_node *node)
+{
+#ifdef EB_THREADED
+	return node->thr_next;
+#else
+	return __eb_next_walk(node);
+#endif
+}
+
+#ifdef EB_INLINE
+static forceinline struct eb_node *eb_first(struct eb_root *root)
+{
+	return __eb_first(root);
+}
+
+static forceinline struct eb_node *eb_last(struct eb_root *root)
+{
+	return __eb_last(root);
+}
+
+static forceinline struct eb_node *eb_prev(struct eb_node *node)
+{
+	return __eb_prev(node);
+}
+
+static forceinline struct eb_node *eb_next(struct eb_node *node)
+{
+	return __eb_next(node);
+}
+#endif /* EB_INLINE */
+
 static inline int flsnz8_generic(unsigned int x)
 {
 	int ret = 0;